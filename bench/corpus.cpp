@@ -0,0 +1,267 @@
+#include "./corpus.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+using std::string;
+using std::string_view;
+
+namespace Midx::Bench {
+
+namespace {
+
+// A few with accents, they go through the case and accent folding of the search
+constexpr std::array<string_view, 24> words{
+    "Blue",   "Night",  "River", "Echo",  "Golden", "Silent",   "Fire",  "Dream",
+    "Summer", "Shadow", "Glass", "Café",  "Heart",  "Electric", "Stone", "Ocean",
+    "Wild",   "Ghost",  "Neon",  "Señor", "Winter", "Paper",    "Über",  "Moon",
+};
+
+/**
+ * splitmix64, its output only depends on the seed so the corpus is the same everywhere (the
+ * standard distributions are implementation defined).
+ */
+class Random {
+ public:
+  explicit Random(const uint64_t seed) : m_state{seed} {}
+
+  uint64_t next() {
+    uint64_t z = (m_state += 0x9e3779b97f4a7c15);
+    z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z          = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+
+  size_t below(const size_t n) { return n == 0 ? 0 : next() % n; }
+
+  /**
+   * In [0, 1).
+   */
+  double real() { return double(next() >> 11) * 0x1p-53; }
+
+ private:
+  uint64_t m_state;
+};
+
+string make_name(Random &rng, const size_t min_words, const size_t max_words) {
+  const size_t n = min_words + rng.below(max_words - min_words + 1);
+  string res{};
+  for (size_t i = 0; i < n; ++i) {
+    if (i > 0)
+      res += ' ';
+    res += words[rng.below(words.size())];
+  }
+  return res;
+}
+
+void append_be(string &out, const uint64_t value, const size_t n_bytes) {
+  for (size_t i = n_bytes; i-- > 0;)
+    out += char((value >> (8 * i)) & 0xff);
+}
+
+void append_le32(string &out, const uint32_t value) {
+  for (size_t i = 0; i < 4; ++i)
+    out += char((value >> (8 * i)) & 0xff);
+}
+
+void append_syncsafe32(string &out, const size_t value) {
+  for (size_t i = 4; i-- > 0;)
+    out += char((value >> (7 * i)) & 0x7f);
+}
+
+/**
+ * Bytes that start and end like a JPEG, they are only stored and hashed, never decoded.
+ */
+string make_picture(const uint64_t seed, const size_t size) {
+  if (size < 4)
+    return {};
+  Random rng{seed};
+  string res{"\xff\xd8\xff\xe0", 4};
+  while (res.size() + 2 < size)
+    res += char(rng.next() & 0xff);
+  res += "\xff\xd9";
+  return res;
+}
+
+struct TrackTags {
+  string title;
+  string artist;
+  string album;
+  size_t track_number;
+};
+
+constexpr uint32_t sample_rate = 44100;
+/**
+ * MPEG-1 layer III at 128 kb/s and 44.1 kHz without padding, both formats get an audio stream
+ * of this bitrate.
+ */
+constexpr size_t mpeg_frame_size        = 417;
+constexpr size_t samples_per_mpeg_frame = 1152;
+
+size_t n_mpeg_frames(const double seconds) {
+  return size_t(std::ceil(std::max(seconds, 0.0) * sample_rate / samples_per_mpeg_frame));
+}
+
+void append_flac_block(string &out, const int type, const bool last, const string &data) {
+  out += char((last ? 0x80 : 0) | type);
+  append_be(out, data.size(), 3);
+  out += data;
+}
+
+string make_flac(const TrackTags &tags, const string &picture, const double seconds) {
+  const size_t n_frames = n_mpeg_frames(seconds);
+  string res{"fLaC"};
+
+  string info{};
+  append_be(info, 4096, 2);
+  append_be(info, 4096, 2);
+  append_be(info, 0, 3);
+  append_be(info, 0, 3);
+  const uint64_t n_samples = uint64_t(n_frames) * samples_per_mpeg_frame;
+  // Sample rate, 2 channels, 16 bits per sample and number of samples
+  const uint64_t format =
+      (uint64_t(sample_rate) << 44) | (uint64_t(1) << 41) | (uint64_t(15) << 36) | n_samples;
+  append_be(info, format, 8);
+  info.append(16, '\0');
+  append_flac_block(res, 0, false, info);
+
+  string comments{};
+  constexpr string_view vendor = "midx_bench";
+  append_le32(comments, uint32_t(vendor.size()));
+  comments += vendor;
+  const std::array<string, 4> fields{
+      "TITLE=" + tags.title, "ARTIST=" + tags.artist, "ALBUM=" + tags.album,
+      "TRACKNUMBER=" + std::to_string(tags.track_number)
+  };
+  append_le32(comments, uint32_t(fields.size()));
+  for (const auto &field : fields) {
+    append_le32(comments, uint32_t(field.size()));
+    comments += field;
+  }
+  append_flac_block(res, 4, picture.empty(), comments);
+
+  if (not picture.empty()) {
+    constexpr string_view mime = "image/jpeg";
+    string block{};
+    append_be(block, 3, 4);  // Front cover
+    append_be(block, mime.size(), 4);
+    block += mime;
+    append_be(block, 0, 4);  // Description
+    append_be(block, 500, 4);
+    append_be(block, 500, 4);
+    append_be(block, 24, 4);
+    append_be(block, 0, 4);
+    append_be(block, picture.size(), 4);
+    block += picture;
+    append_flac_block(res, 6, true, block);
+  }
+  // Frames aren't decoded, the stream only has to be there
+  res.append(n_frames * mpeg_frame_size, '\0');
+  return res;
+}
+
+void append_id3_frame(string &out, const string_view id, const string &data) {
+  out += id;
+  append_syncsafe32(out, data.size());
+  out += string(2, '\0');
+  out += data;
+}
+
+string make_mp3(const TrackTags &tags, const string &picture, const double seconds) {
+  string frames{};
+  // UTF-8 text frames
+  append_id3_frame(frames, "TIT2", '\x03' + tags.title);
+  append_id3_frame(frames, "TPE1", '\x03' + tags.artist);
+  append_id3_frame(frames, "TALB", '\x03' + tags.album);
+  append_id3_frame(frames, "TRCK", '\x03' + std::to_string(tags.track_number));
+  if (not picture.empty()) {
+    string apic{"\x00image/jpeg\x00\x03\x00", 14};
+    apic += picture;
+    append_id3_frame(frames, "APIC", apic);
+  }
+  const size_t padding = 256;
+
+  string res{"ID3\x04\x00\x00", 6};
+  append_syncsafe32(res, frames.size() + padding);
+  res += frames;
+  res.append(padding, '\0');
+  string frame{"\xff\xfb\x90\x00", 4};
+  frame.resize(mpeg_frame_size, '\0');
+  for (size_t i = 0, n = n_mpeg_frames(seconds); i < n; ++i)
+    res += frame;
+  return res;
+}
+
+}  // namespace
+
+Corpus generate_corpus(const string &root, const CorpusOptions &options) {
+  Random rng{options.seed};
+  const size_t n_artists         = std::max<size_t>(options.n_artists, 1);
+  const size_t albums_per_artist = std::max<size_t>(options.albums_per_artist, 1);
+  const size_t n_albums          = n_artists * albums_per_artist;
+
+  std::vector<string> artists{};
+  for (size_t i = 0; i < n_artists; ++i)
+    artists.push_back(make_name(rng, 1, 3));
+  std::vector<string> albums{};
+  std::vector<bool> album_is_flac{};
+  for (size_t i = 0; i < n_albums; ++i) {
+    albums.push_back(make_name(rng, 1, 4));
+    album_is_flac.push_back(rng.real() < options.flac_ratio);
+  }
+
+  // Artist `k` gets a share of the tracks proportional to 1 / (k + 1)^skew
+  std::vector<double> cumulative_weights{};
+  double total = 0;
+  for (size_t k = 0; k < n_artists; ++k) {
+    total += 1.0 / std::pow(double(k + 1), options.artist_skew);
+    cumulative_weights.push_back(total);
+  }
+
+  const size_t fan_out = std::max<size_t>(options.fan_out, 1);
+  size_t n_directories = 1;
+  for (size_t d = 0; d < options.depth; ++d)
+    n_directories *= fan_out;
+
+  Corpus res{};
+  std::vector<size_t> n_album_tracks(n_albums, 0);
+  std::vector<string> pictures(n_albums);
+  for (size_t i = 0; i < options.n_files; ++i) {
+    const auto it = std::upper_bound(
+        cumulative_weights.begin(), cumulative_weights.end(), rng.real() * total
+    );
+    const size_t artist = std::min(size_t(it - cumulative_weights.begin()), n_artists - 1);
+    const size_t album  = artist * albums_per_artist + rng.below(albums_per_artist);
+
+    const TrackTags tags{
+        make_name(rng, 1, 4), artists[artist], albums[album], ++n_album_tracks[album]
+    };
+    if (pictures[album].empty() and options.art_size > 0)
+      pictures[album] = make_picture(options.seed ^ (album + 1), options.art_size);
+
+    // The tracks of an album are in the same directory
+    fs::path dir{root};
+    for (size_t d = 0, leaf = album % n_directories; d < options.depth; ++d, leaf /= fan_out)
+      dir /= std::format("d{:02}", leaf % fan_out);
+    fs::create_directories(dir);
+
+    const bool flac = album_is_flac[album];
+    const auto path = dir / std::format("{:06} {}.{}", i, tags.title, flac ? "flac" : "mp3");
+    const string data = flac ? make_flac(tags, pictures[album], options.audio_seconds)
+                             : make_mp3(tags, pictures[album], options.audio_seconds);
+    std::ofstream out{path, std::ios::binary | std::ios::trunc};
+    out.write(data.data(), std::streamsize(data.size()));
+    res.n_bytes += data.size();
+    res.files.push_back(path);
+  }
+  return res;
+}
+
+}  // namespace Midx::Bench
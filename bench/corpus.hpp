@@ -0,0 +1,53 @@
+// Synthetic corpus for the benchmarks: tagged FLAC and MP3 files that TagLib and the native
+// reader both parse, spread over artists, albums and directories like a real library.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Midx::Bench {
+
+struct CorpusOptions {
+  size_t n_files           = 1000;
+  size_t n_artists         = 100;
+  size_t albums_per_artist = 4;
+  /**
+   * Zipf exponent of how tracks are spread over artists, 0 spreads them evenly.
+   */
+  double artist_skew = 1.0;
+  /**
+   * Every directory has `fan_out` sub-directories, `depth` levels deep, and the files are spread
+   * over the deepest ones.
+   */
+  size_t fan_out = 8;
+  size_t depth   = 2;
+  /**
+   * Share of FLAC files, the others are MP3.
+   */
+  double flac_ratio = 0.5;
+  /**
+   * Size of the picture embedded in every file of an album, 0 for none.
+   */
+  size_t art_size = 32 * 1024;
+  /**
+   * Length of the audio stream, MP3 files get this many seconds of empty frames.
+   */
+  double audio_seconds = 1.0;
+  uint64_t seed        = 42;
+};
+
+struct Corpus {
+  std::vector<std::string> files{};
+  uint64_t n_bytes = 0;
+};
+
+/**
+ * Write a corpus under `root`, the same options and seed always give the same files. Returns
+ * the paths of the files in the order they were written.
+ */
+Corpus generate_corpus(const std::string &root, const CorpusOptions &options);
+
+}  // namespace Midx::Bench
@@ -0,0 +1,129 @@
+// Cost of reading the tags and album art of every file of a corpus: opening each file twice
+// (a FileRef for the tags then a FLAC::File or MPEG::File for the picture, how it used to be
+// done) against a single open. Reads are counted with /proc/self/io.
+//
+// Usage: load_metadata_bench <corpus directory> [passes]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <taglib/attachedpictureframe.h>
+#include <taglib/fileref.h>
+#include <taglib/flacfile.h>
+#include <taglib/id3v2tag.h>
+#include <taglib/mpegfile.h>
+
+#include "internal.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct IoCounters {
+  size_t rchar = 0;
+  size_t syscr = 0;
+};
+
+IoCounters read_io_counters() {
+  IoCounters res{};
+  std::ifstream io{"/proc/self/io"};
+  std::string key;
+  size_t value = 0;
+  while (io >> key >> value) {
+    if (key == "rchar:")
+      res.rchar = value;
+    else if (key == "syscr:")
+      res.syscr = value;
+  }
+  return res;
+}
+
+/**
+ * How metadata used to be read: the tags with a FileRef, then the file is opened again to get
+ * the picture.
+ */
+size_t load_with_two_opens(const std::string &path) {
+  TagLib::FileRef fref{path.c_str()};
+  if (fref.isNull() or fref.tag()->isEmpty() or fref.tag()->album().isEmpty())
+    return 0;
+  if (path.ends_with(".flac")) {
+    TagLib::FLAC::File f{path.c_str()};
+    if (f.isValid() and not f.pictureList().isEmpty())
+      return f.pictureList().front()->data().size();
+  } else {
+    TagLib::MPEG::File f{path.c_str()};
+    if (not f.isValid() or not f.hasID3v2Tag() or f.ID3v2Tag()->frameList("APIC").isEmpty())
+      return 0;
+    const auto *pic =
+        static_cast<TagLib::ID3v2::AttachedPictureFrame *>(f.ID3v2Tag()->frameList("APIC").front());
+    return pic->picture().size();
+  }
+  return 0;
+}
+
+/**
+ * How metadata is read by TagLib now, the FLAC or MPEG file is opened once for the tags and the
+ * picture. The native readers are turned off so this keeps comparing TagLib against itself.
+ */
+size_t load_with_one_open(const std::string &path) {
+  Midx::Utils::ParseOptions options{};
+  options.native_tags = false;
+  const auto track = Midx::Utils::parse_track(path, options);
+  if (not track or not track->metadata or not track->metadata->album_art)
+    return 0;
+  return track->metadata->album_art->size();
+}
+
+void run(
+    const char *name, const std::vector<std::string> &files, const size_t passes,
+    const std::function<size_t(const std::string &)> &load
+) {
+  size_t art_bytes = 0;
+  const auto io    = read_io_counters();
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t pass = 0; pass < passes; ++pass) {
+    for (const auto &path : files)
+      art_bytes += load(path);
+  }
+  const std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  const auto io_end = read_io_counters();
+  const double n    = double(files.size() * passes);
+  std::printf(
+      "%-10s %10.1f us/file %12.0f B read/file %8.1f reads/file (%zu art bytes)\n", name,
+      elapsed.count() / n, double(io_end.rchar - io.rchar) / n, double(io_end.syscr - io.syscr) / n,
+      art_bytes
+  );
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <corpus directory> [passes]\n", argv[0]);
+    return 1;
+  }
+  const size_t passes = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 3;
+
+  std::vector<std::string> files{};
+  for (const auto &entry : fs::recursive_directory_iterator(argv[1])) {
+    if (entry.is_regular_file() and Midx::Utils::is_supported_file_type(entry.path()))
+      files.push_back(entry.path());
+  }
+  if (files.empty() or passes == 0) {
+    std::fprintf(stderr, "No .flac or .mp3 files in %s\n", argv[1]);
+    return 1;
+  }
+  std::printf("%zu files, %zu passes\n", files.size(), passes);
+
+  // Warm the page cache so both runs read from memory
+  run("warm-up", files, 1, load_with_one_open);
+  run("two opens", files, passes, load_with_two_opens);
+  run("one open", files, passes, load_with_one_open);
+}
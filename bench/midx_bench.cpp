@@ -0,0 +1,308 @@
+// Reproducible end to end benchmarks: generates a synthetic corpus (see corpus.hpp) then times
+// a full scan, rescans and the main queries on it. Each benchmark is run `--repeat` times and
+// the median is reported, `--json` also writes the results and the scan metrics for comparing
+// runs. `--trace` writes a Chrome trace of the full scans.
+//
+// Usage: midx_bench [--dir <work directory>] [--corpus <existing corpus>] [--generate-only]
+//                   [--files N] [--artists N] [--albums-per-artist N] [--artist-skew X]
+//                   [--fan-out N] [--depth N] [--flac-ratio X] [--art-size N]
+//                   [--audio-seconds X] [--seed N] [--workers N] [--repeat N] [--lookups N]
+//                   [--json <file>] [--trace <file>]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+#include "./corpus.hpp"
+#include "midx.hpp"
+
+namespace fs = std::filesystem;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Config {
+  string dir = (fs::temp_directory_path() / "midx_bench").string();
+  string corpus{};
+  bool generate_only = false;
+  Midx::Bench::CorpusOptions corpus_options{};
+  size_t n_workers = Midx::ScanOptions{}.n_workers;
+  size_t repeat    = 5;
+  size_t n_lookups = 100'000;
+  string json{};
+  string trace{};
+};
+
+struct Result {
+  string name;
+  /**
+   * Files, rows or calls handled by one run.
+   */
+  size_t n_items;
+  vector<double> seconds;
+
+  double median() const {
+    vector<double> sorted = seconds;
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[sorted.size() / 2];
+  }
+  double min() const { return *std::min_element(seconds.begin(), seconds.end()); }
+};
+
+double time_seconds(const std::function<void()> &fn) {
+  const auto start = std::chrono::steady_clock::now();
+  fn();
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+string json_string(const std::string_view s) {
+  string res{"\""};
+  for (const char c : s) {
+    if (c == '"' or c == '\\')
+      res += '\\';
+    if (uint8_t(c) < 0x20)
+      res += std::format("\\u{:04x}", int(c));
+    else
+      res += c;
+  }
+  return res + '"';
+}
+
+bool parse_args(const int argc, char **argv, Config &config) {
+  auto &corpus = config.corpus_options;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg{argv[i]};
+    if (arg == "--generate-only") {
+      config.generate_only = true;
+      continue;
+    }
+    if (i + 1 >= argc)
+      return false;
+    const char *value = argv[++i];
+    const auto number = [&] { return size_t(std::strtoull(value, nullptr, 10)); };
+    if (arg == "--dir")
+      config.dir = value;
+    else if (arg == "--corpus")
+      config.corpus = value;
+    else if (arg == "--files")
+      corpus.n_files = number();
+    else if (arg == "--artists")
+      corpus.n_artists = number();
+    else if (arg == "--albums-per-artist")
+      corpus.albums_per_artist = number();
+    else if (arg == "--artist-skew")
+      corpus.artist_skew = std::strtod(value, nullptr);
+    else if (arg == "--fan-out")
+      corpus.fan_out = number();
+    else if (arg == "--depth")
+      corpus.depth = number();
+    else if (arg == "--flac-ratio")
+      corpus.flac_ratio = std::strtod(value, nullptr);
+    else if (arg == "--art-size")
+      corpus.art_size = number();
+    else if (arg == "--audio-seconds")
+      corpus.audio_seconds = std::strtod(value, nullptr);
+    else if (arg == "--seed")
+      corpus.seed = std::strtoull(value, nullptr, 10);
+    else if (arg == "--workers")
+      config.n_workers = number();
+    else if (arg == "--repeat")
+      config.repeat = std::max<size_t>(number(), 1);
+    else if (arg == "--lookups")
+      config.n_lookups = std::max<size_t>(number(), 1);
+    else if (arg == "--json")
+      config.json = value;
+    else if (arg == "--trace")
+      config.trace = value;
+    else
+      return false;
+  }
+  return true;
+}
+
+void print_result(const Result &result) {
+  std::printf(
+      "%-20s %10.3f ms %10.3f ms %12.1f ns/item (%zu items)\n", result.name.c_str(),
+      result.median() * 1e3, result.min() * 1e3,
+      result.median() * 1e9 / double(std::max<size_t>(result.n_items, 1)), result.n_items
+  );
+}
+
+string to_json(
+    const Config &config, const size_t n_files, const vector<Result> &results,
+    const string &scan_metrics
+) {
+  const auto &corpus = config.corpus_options;
+  string res         = "{\"config\": {";
+  res += std::format(
+      "\"corpus\": {}, \"n_files\": {}, \"n_artists\": {}, \"albums_per_artist\": {}, "
+      "\"artist_skew\": {}, \"fan_out\": {}, \"depth\": {}, \"flac_ratio\": {}, "
+      "\"art_size\": {}, \"audio_seconds\": {}, \"seed\": {}, \"n_workers\": {}, "
+      "\"repeat\": {}, \"n_lookups\": {}, \"sqlite_version\": {}",
+      json_string(config.corpus), n_files, corpus.n_artists, corpus.albums_per_artist,
+      corpus.artist_skew, corpus.fan_out, corpus.depth, corpus.flac_ratio, corpus.art_size,
+      corpus.audio_seconds, corpus.seed, config.n_workers, config.repeat, config.n_lookups,
+      json_string(SQLite::VERSION)
+  );
+  res += "}, \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    res += std::format(
+        "{}{{\"name\": {}, \"items\": {}, \"median_seconds\": {}, \"min_seconds\": {}, "
+        "\"seconds\": [",
+        i > 0 ? ", " : "", json_string(r.name), r.n_items, r.median(), r.min()
+    );
+    for (size_t j = 0; j < r.seconds.size(); ++j)
+      res += std::format("{}{}", j > 0 ? ", " : "", r.seconds[j]);
+    res += "]}";
+  }
+  res += "], \"scan_metrics\": " + scan_metrics + "}\n";
+  return res;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Config config{};
+  if (not parse_args(argc, argv, config)) {
+    std::fprintf(stderr, "Usage: see the top of bench/midx_bench.cpp\n");
+    return 1;
+  }
+  spdlog::set_level(spdlog::level::warn);
+  fs::create_directories(config.dir);
+
+  vector<string> files{};
+  if (config.corpus.empty()) {
+    config.corpus = config.dir + "/corpus";
+    fs::remove_all(config.corpus);
+    Midx::Bench::Corpus corpus{};
+    const double seconds = time_seconds([&] {
+      corpus = Midx::Bench::generate_corpus(config.corpus, config.corpus_options);
+    });
+    files = std::move(corpus.files);
+    std::printf(
+        "Generated %zu files (%.1f MB) in %s in %.2f s\n", files.size(),
+        double(corpus.n_bytes) / 1e6, config.corpus.c_str(), seconds
+    );
+  } else {
+    for (const auto &entry : fs::recursive_directory_iterator(config.corpus)) {
+      if (entry.is_regular_file())
+        files.push_back(entry.path());
+    }
+  }
+  if (config.generate_only)
+    return 0;
+  if (files.empty()) {
+    std::fprintf(stderr, "No files in %s\n", config.corpus.c_str());
+    return 1;
+  }
+
+  Midx::data_dir       = config.dir + "/data";
+  const string db_path = config.dir + "/midx_bench.db";
+  Midx::ScanOptions scan_options{};
+  scan_options.n_workers = config.n_workers;
+  vector<Result> results{};
+  const auto run = [&](const string &name, const size_t n_items, const std::function<void()> &fn,
+                       const std::function<void()> &before = {}) {
+    Result result{name, n_items, {}};
+    for (size_t i = 0; i < config.repeat; ++i) {
+      if (before)
+        before();
+      result.seconds.push_back(time_seconds(fn));
+    }
+    print_result(result);
+    results.push_back(std::move(result));
+  };
+  std::printf("%-20s %13s %13s\n", "", "median", "min");
+
+  // Every full scan starts from an empty database and art directory
+  std::unique_ptr<SQLite::Database> db{};
+  const auto open_empty_database = [&] {
+    db.reset();
+    for (const char *suffix : {"", "-wal", "-shm"})
+      fs::remove(db_path + suffix);
+    fs::remove_all(Midx::data_dir);
+    fs::create_directories(Midx::data_dir);
+    db = std::make_unique<SQLite::Database>(
+        db_path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE
+    );
+    Midx::init_database(*db);
+  };
+  Midx::reset_metrics();
+  if (not config.trace.empty())
+    Midx::start_tracing();
+  run(
+      "full_scan", files.size(), [&] { Midx::scan_directory(*db, config.corpus, scan_options); },
+      open_empty_database
+  );
+  const string scan_metrics = Midx::metrics().to_json();
+  if (not config.trace.empty() and Midx::stop_tracing(config.trace))
+    std::printf("Trace of the full scans written to %s\n", config.trace.c_str());
+
+  run("rescan", files.size(), [&] { Midx::scan_directory(*db, config.corpus, scan_options); });
+
+  // 1% of the files are modified before each run
+  const size_t n_touched = std::max<size_t>(files.size() / 100, 1);
+  size_t next_touched    = 0;
+  run(
+      "rescan_1pct_changed", files.size(),
+      [&] { Midx::scan_directory(*db, config.corpus, scan_options); },
+      [&] {
+        const auto now = fs::file_time_type::clock::now();
+        for (size_t i = 0; i < n_touched; ++i)
+          fs::last_write_time(files[next_touched++ % files.size()], now);
+      }
+  );
+
+  const auto tracks  = Midx::get_all_tracks(*db);
+  const auto artists = Midx::get_all_artists(*db);
+  const auto albums  = Midx::get_all_albums(*db);
+  run("get_all_artists", artists.size(), [&] { Midx::get_all_artists(*db); });
+  run("get_all_albums", albums.size(), [&] { Midx::get_all_albums(*db); });
+  run("get_all_tracks", tracks.size(), [&] { Midx::get_all_tracks(*db); });
+  run("stream_all_tracks", tracks.size(), [&] {
+    size_t n = 0;
+    for (const auto &track : Midx::stream_all_tracks(*db))
+      n += track.id > 0;
+  });
+
+  // Lookups go through the items in a scattered order so they don't hit the same pages
+  if (not tracks.empty() and not artists.empty()) {
+    const auto scattered = [](const size_t i, const size_t n) { return (i * 7919) % n; };
+    run("get_track", config.n_lookups, [&] {
+      for (size_t i = 0; i < config.n_lookups; ++i)
+        Midx::get_track(*db, tracks[scattered(i, tracks.size())].id);
+    });
+    run("get_track_id", config.n_lookups, [&] {
+      for (size_t i = 0; i < config.n_lookups; ++i)
+        Midx::get_track_id(*db, tracks[scattered(i, tracks.size())].file_path);
+    });
+    run("get_artist_id", config.n_lookups, [&] {
+      for (size_t i = 0; i < config.n_lookups; ++i)
+        Midx::get_artist_id(*db, artists[scattered(i, artists.size())].name);
+    });
+  }
+
+  db.reset();
+
+  if (not config.json.empty()) {
+    std::ofstream out{config.json};
+    out << to_json(config, files.size(), results, scan_metrics);
+    std::printf("Results written to %s\n", config.json.c_str());
+  }
+}
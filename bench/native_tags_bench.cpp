@@ -0,0 +1,148 @@
+// Cost of parsing every file of a corpus with the native FLAC/ID3v2 reader (falling back to
+// TagLib for the files it doesn't handle) against TagLib alone, and whether both agree.
+// Reads are counted with /proc/self/io.
+//
+// Usage: native_tags_bench <corpus directory> [passes]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "internal.hpp"
+#include "native_tags.hpp"
+
+namespace fs = std::filesystem;
+
+using Midx::Utils::ParsedTrack;
+using Midx::Utils::ParseOptions;
+
+namespace {
+
+struct IoCounters {
+  size_t rchar = 0;
+  size_t syscr = 0;
+};
+
+IoCounters read_io_counters() {
+  IoCounters res{};
+  std::ifstream io{"/proc/self/io"};
+  std::string key;
+  size_t value = 0;
+  while (io >> key >> value) {
+    if (key == "rchar:")
+      res.rchar = value;
+    else if (key == "syscr:")
+      res.syscr = value;
+  }
+  return res;
+}
+
+void run(
+    const char *name, const std::vector<std::string> &files, const size_t passes,
+    const ParseOptions &options
+) {
+  size_t n_tagged  = 0;
+  const auto io    = read_io_counters();
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t pass = 0; pass < passes; ++pass) {
+    for (const auto &path : files) {
+      const auto track = Midx::Utils::parse_track(path, options);
+      if (track and track->metadata)
+        ++n_tagged;
+    }
+  }
+  const std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  const auto io_end = read_io_counters();
+  const double n    = double(files.size() * passes);
+  std::printf(
+      "%-8s %10.1f us/file %12.0f B read/file %8.1f reads/file (%zu tagged)\n", name,
+      elapsed.count() / n, double(io_end.rchar - io.rchar) / n, double(io_end.syscr - io.syscr) / n,
+      n_tagged / passes
+  );
+}
+
+/**
+ * Number of files the native reader handles.
+ */
+size_t count_native(const std::vector<std::string> &files) {
+  Midx::Utils::NativeTags tags{};
+  size_t res = 0;
+  for (const auto &path : files) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st {};
+    if (fd < 0 or fstat(fd, &st) != 0)
+      continue;
+    const auto read_at = Midx::Utils::make_fd_reader(fd);
+    const auto format  = Midx::Utils::sniff_format(read_at);
+    if (format and Midx::Utils::read_native_tags(*format, read_at, uint64_t(st.st_size), tags))
+      ++res;
+    close(fd);
+  }
+  return res;
+}
+
+bool same_metadata(const ParsedTrack &a, const ParsedTrack &b) {
+  if (a.metadata.has_value() != b.metadata.has_value())
+    return false;
+  if (a.metadata and (a.metadata->title != b.metadata->title or
+                      a.metadata->artist != b.metadata->artist or
+                      a.metadata->album != b.metadata->album or
+                      a.metadata->track_number != b.metadata->track_number or
+                      a.metadata->album_art.has_value() != b.metadata->album_art.has_value()))
+    return false;
+  return a.properties.has_value() == b.properties.has_value() and
+         (not a.properties or (a.properties->sample_rate == b.properties->sample_rate and
+                               a.properties->channels == b.properties->channels));
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <corpus directory> [passes]\n", argv[0]);
+    return 1;
+  }
+  const size_t passes = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 3;
+
+  std::vector<std::string> files{};
+  for (const auto &entry : fs::recursive_directory_iterator(argv[1])) {
+    if (entry.is_regular_file() and Midx::Utils::is_supported_file_type(entry.path()))
+      files.push_back(entry.path());
+  }
+  if (files.empty() or passes == 0) {
+    std::fprintf(stderr, "No audio files in %s\n", argv[1]);
+    return 1;
+  }
+  std::printf(
+      "%zu files, %zu passes, %zu read natively\n", files.size(), passes, count_native(files)
+  );
+
+  ParseOptions native{};
+  ParseOptions taglib{};
+  taglib.native_tags = false;
+
+  // Durations and bitrates may differ slightly, TagLib finds the last MPEG frame
+  size_t n_different = 0;
+  for (const auto &path : files) {
+    const auto a = Midx::Utils::parse_track(path, native);
+    const auto b = Midx::Utils::parse_track(path, taglib);
+    if (a and b and not same_metadata(*a, *b)) {
+      if (n_different++ < 10)
+        std::printf("differs: %s\n", path.c_str());
+    }
+  }
+  std::printf("%zu files parsed differently\n", n_different);
+
+  // The first loop warmed the page cache, both runs read from memory
+  run("taglib", files, passes, taglib);
+  run("native", files, passes, native);
+}
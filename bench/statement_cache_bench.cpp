@@ -0,0 +1,80 @@
+// Per-call cost of the lookup functions with a fresh statement per call (how they used to be
+// written) and with the statement cache.
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+#include "midx.hpp"
+
+namespace {
+
+constexpr size_t n_rows  = 10'000;
+constexpr size_t n_calls = 200'000;
+
+double ns_per_call(const std::function<void(size_t)> &fn) {
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n_calls; ++i)
+    fn(i);
+  const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / double(n_calls);
+}
+
+void report(const char *name, const double uncached, const double cached) {
+  std::printf("%-20s %10.0f ns %10.0f ns %8.2fx\n", name, uncached, cached, uncached / cached);
+}
+
+}  // namespace
+
+int main() {
+  SQLite::Database db{":memory:", SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE};
+  Midx::init_database(db);
+
+  std::vector<std::string> names{};
+  names.reserve(n_rows);
+  {
+    SQLite::Transaction transaction{db};
+    for (size_t i = 0; i < n_rows; ++i) {
+      names.push_back("Artist " + std::to_string(i));
+      const auto artist_id = Midx::insert_artist(db, names.back());
+      Midx::insert_album(db, "Album " + std::to_string(i), artist_id);
+    }
+    transaction.commit();
+  }
+
+  std::printf("%-20s %13s %13s %9s\n", "", "uncached", "cached", "speedup");
+
+  report(
+      "get_artist_id",
+      ns_per_call([&](const size_t i) {
+        SQLite::Statement stmt{db, "SELECT id FROM t_artists WHERE name = ?"};
+        stmt.bindNoCopy(1, names[i % n_rows]);
+        stmt.executeStep();
+      }),
+      ns_per_call([&](const size_t i) { Midx::get_artist_id(db, names[i % n_rows]); })
+  );
+
+  report(
+      "is_valid_artist_id",
+      ns_per_call([&](const size_t i) {
+        SQLite::Statement stmt{db, "SELECT EXISTS(SELECT 1 FROM t_artists WHERE id = ?)"};
+        stmt.bind(1, uint32_t(i % n_rows + 1));
+        stmt.executeStep();
+      }),
+      ns_per_call([&](const size_t i) { Midx::is_valid_artist_id(db, i % n_rows + 1); })
+  );
+
+  report(
+      "get_album",
+      ns_per_call([&](const size_t i) {
+        SQLite::Statement stmt{db, "SELECT id, name, artist_id FROM t_albums WHERE id = ?"};
+        stmt.bind(1, uint32_t(i % n_rows + 1));
+        stmt.executeStep();
+      }),
+      ns_per_call([&](const size_t i) { Midx::get_album(db, i % n_rows + 1); })
+  );
+}
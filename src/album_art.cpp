@@ -0,0 +1,79 @@
+#include "./album_art.hpp"
+
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+namespace Midx {
+
+AlbumArt::AlbumArt(
+    void *mapping, const size_t mapping_size, const size_t delta, const size_t size,
+    const std::string &mime_type
+)
+    : m_mapping{mapping},
+      m_mapping_size{mapping_size},
+      m_data{static_cast<const std::byte *>(mapping) + delta},
+      m_size{size},
+      m_mime_type{mime_type} {}
+
+AlbumArt::AlbumArt(AlbumArt &&other) noexcept
+    : m_mapping{std::exchange(other.m_mapping, nullptr)},
+      m_mapping_size{std::exchange(other.m_mapping_size, 0)},
+      m_data{std::exchange(other.m_data, nullptr)},
+      m_size{std::exchange(other.m_size, 0)},
+      m_mime_type{std::move(other.m_mime_type)} {}
+
+AlbumArt &AlbumArt::operator=(AlbumArt &&other) noexcept {
+  if (this != &other) {
+    if (m_mapping != nullptr)
+      munmap(m_mapping, m_mapping_size);
+    m_mapping      = std::exchange(other.m_mapping, nullptr);
+    m_mapping_size = std::exchange(other.m_mapping_size, 0);
+    m_data         = std::exchange(other.m_data, nullptr);
+    m_size         = std::exchange(other.m_size, 0);
+    m_mime_type    = std::move(other.m_mime_type);
+  }
+  return *this;
+}
+
+AlbumArt::~AlbumArt() {
+  if (m_mapping != nullptr)
+    munmap(m_mapping, m_mapping_size);
+}
+
+std::optional<AlbumArt> AlbumArt::map(
+    const std::string &path, const uint64_t offset, const uint64_t length,
+    const std::string &mime_type
+) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    spdlog::error("Failed to open {}", path);
+    return std::nullopt;
+  }
+  struct stat st {};
+  // Mapping past the end of the file would fault when read
+  if (fstat(fd, &st) != 0 or length == 0 or offset + length > uint64_t(st.st_size)) {
+    spdlog::error("Album art is out of the bounds of {}", path);
+    close(fd);
+    return std::nullopt;
+  }
+  // mmap() offsets must be page aligned
+  const auto page_size     = uint64_t(sysconf(_SC_PAGESIZE));
+  const uint64_t map_start = offset - offset % page_size;
+  const size_t delta       = offset - map_start;
+  const size_t map_size    = delta + length;
+  void *mapping            = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, off_t(map_start));
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    spdlog::error("Failed to map the album art in {}", path);
+    return std::nullopt;
+  }
+  return AlbumArt{mapping, map_size, delta, length, mime_type};
+}
+
+}  // namespace Midx
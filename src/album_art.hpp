@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+
+namespace Midx {
+
+/**
+ * Read-only view of an album's picture, the bytes are mapped from the file holding them
+ * (the audio file for lazily stored art) and unmapped when the view is destroyed.
+ */
+class AlbumArt {
+ public:
+  AlbumArt(AlbumArt &&other) noexcept;
+  AlbumArt &operator=(AlbumArt &&other) noexcept;
+  ~AlbumArt();
+
+  AlbumArt(const AlbumArt &)            = delete;
+  AlbumArt &operator=(const AlbumArt &) = delete;
+
+  /**
+   * Map `length` bytes of a file starting at `offset`, returns `nullopt` if the file is
+   * shorter than that or can't be mapped.
+   */
+  static std::optional<AlbumArt> map(
+      const std::string &path, const uint64_t offset, const uint64_t length,
+      const std::string &mime_type
+  );
+
+  std::span<const std::byte> data() const { return {m_data, m_size}; }
+
+  size_t size() const { return m_size; }
+
+  /**
+   * MIME type of the picture, empty if unknown.
+   */
+  const std::string &mime_type() const { return m_mime_type; }
+
+ private:
+  AlbumArt(
+      void *mapping, const size_t mapping_size, const size_t delta, const size_t size,
+      const std::string &mime_type
+  );
+
+ private:
+  void *m_mapping;
+  size_t m_mapping_size;
+  const std::byte *m_data;
+  size_t m_size;
+  std::string m_mime_type;
+};
+
+}  // namespace Midx
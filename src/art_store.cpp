@@ -0,0 +1,379 @@
+#include "./art_store.hpp"
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include <SQLiteCpp/Savepoint.h>
+#include <sqlite3.h>
+
+#include "./internal.hpp"
+#include "./midx.hpp"
+#include "./statement_cache.hpp"
+#include "./xxhash64.hpp"
+
+namespace fs = std::filesystem;
+
+using std::nullopt;
+using std::optional;
+using std::string;
+
+namespace Midx {
+
+namespace {
+
+/**
+ * Write a picture to a temporary file, sync it then rename it, readers never see a partial
+ * file and a picture stored under its hash is never truncated by a crash or a full disk.
+ */
+bool write_art_file(const string &path, const TagLib::ByteVector &pic) {
+  const string tmp_path = path + ".tmp";
+  const int fd          = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    spdlog::error("Failed to write album art {}: {}", tmp_path, std::strerror(errno));
+    return false;
+  }
+  const char *data = pic.data();
+  size_t n_left    = pic.size();
+  bool ok          = true;
+  while (ok and n_left > 0) {
+    const ssize_t n = write(fd, data, n_left);
+    if (n < 0 and errno == EINTR)
+      continue;
+    ok = n > 0;
+    if (ok) {
+      data += n;
+      n_left -= size_t(n);
+    }
+  }
+  ok = ok and fsync(fd) == 0;
+  // Some file systems only report write errors when the file is closed
+  ok = close(fd) == 0 and ok;
+  std::error_code ec;
+  if (not ok) {
+    spdlog::error("Failed to write album art {}: {}", tmp_path, std::strerror(errno));
+    fs::remove(tmp_path, ec);
+    return false;
+  }
+  fs::rename(tmp_path, path, ec);
+  if (ec) {
+    spdlog::error("Failed to write album art {}: {}", path, ec.message());
+    fs::remove(tmp_path, ec);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Delete the rows of the pictures no album uses, must run in a transaction holding the write
+ * lock. Their files are removed by `remove_art_files()` once it's committed.
+ */
+std::vector<Utils::ArtHash> delete_unused_art(SQLite::Database &db) {
+  std::vector<Utils::ArtHash> unused{};
+  Utils::CachedStatement stmt{db, "DELETE FROM t_art WHERE refcount <= 0 RETURNING hash"};
+  while (stmt->executeStep())
+    unused.push_back(uint64_t(stmt->getColumn(0).getInt64()));
+  return unused;
+}
+
+/**
+ * Remove the files of pictures whose rows were deleted by a committed transaction. A commit
+ * that failed leaves them, an orphaned file is harmless while a missing one isn't. The write
+ * lock is held so another connection can't store the same picture again in the meantime, the
+ * ones it did are kept.
+ */
+void remove_art_files(SQLite::Database &db, const std::vector<Utils::ArtHash> &hashes) {
+  if (hashes.empty())
+    return;
+  try {
+    SQLite::Transaction transaction{db, SQLite::TransactionBehavior::IMMEDIATE};
+    Utils::CachedStatement stmt{db, "SELECT EXISTS(SELECT 1 FROM t_art WHERE hash = ?)"};
+    std::error_code ec;
+    for (const auto hash : hashes) {
+      stmt->bind(1, int64_t(hash));
+      stmt->executeStep();
+      const bool stored_again = stmt->getColumn(0).getInt() != 0;
+      stmt->reset();
+      if (not stored_again)
+        fs::remove(Utils::get_art_file_path(hash), ec);
+    }
+    transaction.commit();
+  } catch (SQLite::Exception &e) {
+    spdlog::error("Failed to remove the files of {} unused pictures: {}", hashes.size(), e.what());
+  }
+}
+
+/**
+ * Guess the MIME type of a picture from its first bytes.
+ */
+string sniff_mime_type(const std::span<const std::byte> data) {
+  const auto starts_with = [&](const std::string_view magic) {
+    return data.size() >= magic.size() and
+           std::memcmp(data.data(), magic.data(), magic.size()) == 0;
+  };
+  if (starts_with("\xff\xd8\xff"))
+    return "image/jpeg";
+  if (starts_with("\x89PNG\r\n\x1a\n"))
+    return "image/png";
+  if (starts_with("GIF8"))
+    return "image/gif";
+  if (data.size() >= 12 and starts_with("RIFF") and
+      std::memcmp(data.data() + 8, "WEBP", 4) == 0)
+    return "image/webp";
+  return "";
+}
+
+}  // namespace
+
+void Utils::init_art_tables(SQLite::Database &db) {
+  db.exec(R"--(
+    CREATE TABLE IF NOT EXISTS t_art (
+      hash                       INTEGER PRIMARY KEY,
+      refcount                   INTEGER NOT NULL DEFAULT 0
+    );
+  )--");
+  db.exec(R"--(
+    CREATE TABLE IF NOT EXISTS t_albums_art (
+      album_id                   INTEGER PRIMARY KEY,
+      art_hash                   INTEGER NOT NULL,
+      FOREIGN KEY(album_id)      REFERENCES t_albums(id) ON DELETE CASCADE,
+      FOREIGN KEY(art_hash)      REFERENCES t_art(hash)
+    );
+  )--");
+  db.exec(R"--(
+    CREATE TABLE IF NOT EXISTS t_albums_embedded_art (
+      album_id                   INTEGER PRIMARY KEY,
+      track_id                   INTEGER NOT NULL,
+      offset                     INTEGER NOT NULL,
+      length                     INTEGER NOT NULL,
+      mime_type                  TEXT NOT NULL,
+      FOREIGN KEY(album_id)      REFERENCES t_albums(id) ON DELETE CASCADE,
+      FOREIGN KEY(track_id)      REFERENCES t_tracks(id) ON DELETE CASCADE
+    );
+  )--");
+  db.exec(R"--(
+    CREATE TRIGGER IF NOT EXISTS tr_albums_art_insert AFTER INSERT ON t_albums_art BEGIN
+      UPDATE t_art SET refcount = refcount + 1 WHERE hash = new.art_hash;
+    END;
+  )--");
+  db.exec(R"--(
+    CREATE TRIGGER IF NOT EXISTS tr_albums_art_delete AFTER DELETE ON t_albums_art BEGIN
+      UPDATE t_art SET refcount = refcount - 1 WHERE hash = old.art_hash;
+    END;
+  )--");
+  db.exec(R"--(
+    CREATE TRIGGER IF NOT EXISTS tr_albums_art_update AFTER UPDATE OF art_hash ON t_albums_art
+    WHEN old.art_hash IS NOT new.art_hash BEGIN
+      UPDATE t_art SET refcount = refcount - 1 WHERE hash = old.art_hash;
+      UPDATE t_art SET refcount = refcount + 1 WHERE hash = new.art_hash;
+    END;
+  )--");
+}
+
+string Utils::get_art_file_path(const ArtHash hash) {
+  return std::format("{}/art/{:016x}", data_dir, hash);
+}
+
+void Utils::store_album_art(
+    SQLite::Database &db, const std::map<AlbumId, TagLib::ByteVector> &pictures
+) {
+  if (pictures.empty())
+    return;
+  std::error_code ec;
+  fs::create_directories(data_dir + "/art", ec);
+  if (ec) {
+    spdlog::error("Failed to create {}/art: {}", data_dir, ec.message());
+    return;
+  }
+
+  // Called inside the caller's transaction, e.g. by `insert_track()`, the pictures are stored
+  // in a savepoint of it. The pictures they replace are left to `remove_unused_art()`, their
+  // files can't be removed before the caller commits.
+  const bool nested = sqlite3_get_autocommit(db.getHandle()) == 0;
+  std::vector<ArtHash> unused{};
+  try {
+    // Files are checked and written while holding the write lock, so another connection can't
+    // delete a picture between the check and the row referencing it
+    optional<SQLite::Transaction> transaction{};
+    optional<SQLite::Savepoint> savepoint{};
+    if (nested) {
+      savepoint.emplace(db, "midx_art");
+      // A write, even of no row, takes the lock if the caller's transaction didn't yet
+      db.exec("UPDATE t_art SET refcount = refcount WHERE hash IS NULL");
+    } else {
+      transaction.emplace(db, SQLite::TransactionBehavior::IMMEDIATE);
+    }
+    Utils::CachedStatement insert_art_stmt{db, "INSERT OR IGNORE INTO t_art (hash) VALUES (?)"};
+    Utils::CachedStatement set_art_stmt{db, R"--(
+      INSERT INTO t_albums_art (album_id, art_hash) VALUES (?, ?)
+      ON CONFLICT(album_id) DO UPDATE SET art_hash = excluded.art_hash
+    )--"};
+    Utils::CachedStatement del_embedded_stmt{
+        db, "DELETE FROM t_albums_embedded_art WHERE album_id = ?"
+    };
+    // Whether each picture of this call is available
+    std::unordered_map<ArtHash, bool> stored{};
+    for (const auto &[album_id, pic] : pictures) {
+      const ArtHash hash        = xxh64(pic.data(), pic.size());
+      const auto [it, is_first] = stored.try_emplace(hash, true);
+      if (is_first) {
+        const string path = get_art_file_path(hash);
+        if (not fs::exists(path, ec)) {
+          it->second = write_art_file(path, pic);
+          if (it->second)
+            spdlog::info("{}", path);
+        }
+        if (it->second) {
+          insert_art_stmt->bind(1, int64_t(hash));
+          insert_art_stmt->exec();
+          insert_art_stmt->reset();
+        }
+      }
+      if (not it->second)
+        continue;
+      set_art_stmt->bind(1, uint32_t(album_id));
+      set_art_stmt->bind(2, int64_t(hash));
+      set_art_stmt->exec();
+      set_art_stmt->reset();
+      del_embedded_stmt->bind(1, uint32_t(album_id));
+      del_embedded_stmt->exec();
+      del_embedded_stmt->reset();
+    }
+    if (nested) {
+      savepoint->release();
+    } else {
+      // Pictures that were replaced
+      unused = delete_unused_art(db);
+      transaction->commit();
+    }
+  } catch (SQLite::Exception &e) {
+    spdlog::error("Failed to store the album art of {} albums: {}", pictures.size(), e.what());
+    return;
+  }
+  remove_art_files(db, unused);
+}
+
+Utils::AlbumArtClaims::AlbumArtClaims(SQLite::Database &db) {
+  SQLite::Statement stmt{db, R"--(
+    SELECT t_artists.name, t_albums.name FROM t_albums_art
+    JOIN t_albums ON t_albums.id = t_albums_art.album_id
+    LEFT JOIN t_artists ON t_artists.id = t_albums.artist_id
+  )--"};
+  while (stmt.executeStep()) {
+    std::optional<string> artist = nullopt;
+    if (not stmt.isColumnNull(0))
+      artist = stmt.getColumn(0).getString();
+    m_albums.emplace(std::move(artist), stmt.getColumn(1).getString());
+  }
+}
+
+bool Utils::AlbumArtClaims::is_claimed(
+    const std::optional<string> &artist, const string &album
+) const {
+  const std::lock_guard lock{m_mutex};
+  return m_albums.contains({artist, album});
+}
+
+bool Utils::AlbumArtClaims::claim(const std::optional<string> &artist, const string &album) {
+  const std::lock_guard lock{m_mutex};
+  return m_albums.emplace(artist, album).second;
+}
+
+void Utils::set_embedded_album_art(
+    SQLite::Database &db, const AlbumId album_id, const TrackId track_id,
+    const ArtLocation &location
+) {
+  Utils::CachedStatement stmt{db, R"--(
+    INSERT OR REPLACE INTO t_albums_embedded_art (album_id, track_id, offset, length, mime_type)
+    VALUES (?, ?, ?, ?, ?)
+  )--"};
+  stmt->bind(1, uint32_t(album_id));
+  stmt->bind(2, uint32_t(track_id));
+  stmt->bind(3, int64_t(location.offset));
+  stmt->bind(4, int64_t(location.length));
+  stmt->bindNoCopy(5, location.mime_type);
+  stmt->exec();
+
+  Utils::CachedStatement del_stmt{db, "DELETE FROM t_albums_art WHERE album_id = ?"};
+  del_stmt->bind(1, uint32_t(album_id));
+  del_stmt->exec();
+}
+
+void Utils::remove_unused_art(SQLite::Database &db) {
+  std::vector<ArtHash> unused{};
+  try {
+    SQLite::Transaction transaction{db, SQLite::TransactionBehavior::IMMEDIATE};
+    unused = delete_unused_art(db);
+    transaction.commit();
+  } catch (SQLite::Exception &e) {
+    spdlog::error("Failed to remove unused album art: {}", e.what());
+    return;
+  }
+  remove_art_files(db, unused);
+}
+
+std::optional<AlbumArt> get_album_art(SQLite::Database &db, const AlbumId id) {
+  Utils::CachedStatement embedded_stmt{db, R"--(
+    SELECT t_tracks.file_path, offset, length, mime_type, mtime_ns, size, dev, inode
+    FROM t_albums_embedded_art
+    JOIN t_tracks ON t_tracks.id = t_albums_embedded_art.track_id
+    WHERE album_id = ?
+  )--"};
+  embedded_stmt->bind(1, uint32_t(id));
+  if (embedded_stmt->executeStep()) {
+    const string path = embedded_stmt->getColumn(0).getString();
+    optional<Utils::ArtLocation> location = Utils::ArtLocation{
+        uint64_t(embedded_stmt->getColumn(1).getInt64()),
+        uint64_t(embedded_stmt->getColumn(2).getInt64()), embedded_stmt->getColumn(3).getString()
+    };
+    const optional<Utils::FileFingerprint> stored =
+        embedded_stmt->isColumnNull(4)
+            ? nullopt
+            : optional<Utils::FileFingerprint>{Utils::FileFingerprint{
+                  embedded_stmt->getColumn(4).getInt64(), embedded_stmt->getColumn(5).getInt64(),
+                  uint64_t(embedded_stmt->getColumn(6).getInt64()),
+                  uint64_t(embedded_stmt->getColumn(7).getInt64())
+              }};
+    // The file changed since it was scanned, the picture may have moved
+    if (not stored.has_value() or stored != Utils::get_file_fingerprint(path)) {
+      const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        return nullopt;
+      const auto read_at = Utils::make_fd_reader(fd);
+      const auto format  = Utils::sniff_format(read_at);
+      const bool located =
+          format.has_value() and Utils::locate_embedded_art(*format, read_at, location);
+      close(fd);
+      if (not located or not location.has_value())
+        return nullopt;
+    }
+    return AlbumArt::map(path, location->offset, location->length, location->mime_type);
+  }
+
+  const auto path = get_album_art_path(db, id);
+  if (not path.has_value())
+    return nullopt;
+  std::error_code ec;
+  const auto size = fs::file_size(*path, ec);
+  if (ec)
+    return nullopt;
+  std::array<std::byte, 12> magic{};
+  std::ifstream file{*path, std::ios::binary};
+  file.read(reinterpret_cast<char *>(magic.data()), magic.size());
+  const auto n_read = size_t(file.gcount());
+  return AlbumArt::map(*path, 0, size, sniff_mime_type(std::span{magic.data(), n_read}));
+}
+
+}  // namespace Midx
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+#include <taglib/tbytevector.h>
+
+#include "./embedded_art.hpp"
+#include "./utils.hpp"
+
+/*
+ * Album art is stored by content: each distinct picture is written once, to
+ * `Midx::data_dir/art/<hash>`, albums point to it through `t_albums_art` and `t_art` counts
+ * how many albums use each picture.
+ *
+ * Lazily stored art (`ArtMode::Lazy`) isn't copied, `t_albums_embedded_art` holds where the
+ * picture is in one of the album's tracks.
+ */
+
+namespace Midx::Utils {
+
+/**
+ * XXH64 of a picture's bytes.
+ */
+using ArtHash = uint64_t;
+
+/**
+ * Create the art tables and the triggers keeping the reference counts up to date.
+ */
+void init_art_tables(SQLite::Database &db);
+
+std::string get_art_file_path(const ArtHash hash);
+
+/**
+ * Make each album point to its picture, writing the pictures that aren't stored yet, then
+ * delete the pictures no album uses anymore. Runs in its own transaction, or in a savepoint of
+ * the caller's one, in which case the unused pictures are only deleted by `remove_unused_art()`.
+ */
+void store_album_art(SQLite::Database &db, const std::map<AlbumId, TagLib::ByteVector> &pictures);
+
+/**
+ * Albums whose picture a scan already has, shared by its parsers so a picture is extracted from
+ * one track of its album rather than from all of them. Parsers don't know the albums' ids yet,
+ * albums are identified by their artist's name and their name.
+ */
+class AlbumArtClaims {
+ public:
+  /**
+   * Starts with the albums whose picture is stored in `data_dir`, their art isn't extracted
+   * again.
+   */
+  explicit AlbumArtClaims(SQLite::Database &db);
+
+  AlbumArtClaims(const AlbumArtClaims &)            = delete;
+  AlbumArtClaims &operator=(const AlbumArtClaims &) = delete;
+
+  bool is_claimed(const std::optional<std::string> &artist, const std::string &album) const;
+
+  /**
+   * Returns false if another track claimed the album first, the picture can be dropped.
+   */
+  bool claim(const std::optional<std::string> &artist, const std::string &album);
+
+ private:
+  mutable std::mutex m_mutex{};
+  std::set<std::pair<std::optional<std::string>, std::string>> m_albums{};
+};
+
+/**
+ * Make an album point to the picture embedded in one of its tracks, the picture it had in
+ * `data_dir` (if any) is released but only deleted by `remove_unused_art()`.
+ */
+void set_embedded_album_art(
+    SQLite::Database &db, const AlbumId album_id, const TrackId track_id,
+    const ArtLocation &location
+);
+
+/**
+ * Delete the pictures no album uses anymore.
+ */
+void remove_unused_art(SQLite::Database &db);
+
+}  // namespace Midx::Utils
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+namespace Midx::Utils {
+
+/**
+ * A fixed capacity multi-producer multi-consumer FIFO queue, used to connect the stages of
+ * the scan pipeline.
+ *
+ * `push()` blocks while the queue is full and `pop()` blocks while it is empty. Once `close()`
+ * is called, pushing fails and popping drains the remaining items before returning `nullopt`.
+ */
+template <class T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(const size_t capacity) : m_capacity{capacity > 0 ? capacity : 1} {}
+
+  BoundedQueue(const BoundedQueue &)            = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  /**
+   * Returns false if the queue was closed, in which case `value` is dropped.
+   */
+  bool push(T value) {
+    std::unique_lock lock{m_mutex};
+    m_not_full.wait(lock, [&] { return m_closed or m_items.size() < m_capacity; });
+    if (m_closed)
+      return false;
+    m_items.push_back(std::move(value));
+    lock.unlock();
+    m_not_empty.notify_one();
+    return true;
+  }
+
+  /**
+   * Returns `nullopt` once the queue is closed and empty.
+   */
+  std::optional<T> pop() {
+    std::unique_lock lock{m_mutex};
+    m_not_empty.wait(lock, [&] { return m_closed or not m_items.empty(); });
+    if (m_items.empty())
+      return std::nullopt;
+    std::optional<T> res{std::move(m_items.front())};
+    m_items.pop_front();
+    lock.unlock();
+    m_not_full.notify_one();
+    return res;
+  }
+
+  /**
+   * Like `pop()` but waits at most `timeout`, `timed_out` tells whether it returned `nullopt`
+   * because nothing came in time rather than because the queue is closed.
+   */
+  template <class Rep, class Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period> timeout, bool &timed_out) {
+    std::unique_lock lock{m_mutex};
+    timed_out = not m_not_empty.wait_for(lock, timeout, [&] {
+      return m_closed or not m_items.empty();
+    });
+    if (m_items.empty())
+      return std::nullopt;
+    std::optional<T> res{std::move(m_items.front())};
+    m_items.pop_front();
+    lock.unlock();
+    m_not_full.notify_one();
+    return res;
+  }
+
+  void close() {
+    {
+      std::lock_guard lock{m_mutex};
+      m_closed = true;
+    }
+    m_not_full.notify_all();
+    m_not_empty.notify_all();
+  }
+
+ private:
+  const size_t m_capacity;
+  std::deque<T> m_items{};
+  bool m_closed = false;
+  std::mutex m_mutex{};
+  std::condition_variable m_not_full{};
+  std::condition_variable m_not_empty{};
+};
+
+}  // namespace Midx::Utils
@@ -0,0 +1,227 @@
+#include "./embedded_art.hpp"
+
+#include <algorithm>
+#include <array>
+#include <string_view>
+#include <vector>
+
+using std::nullopt;
+using std::optional;
+using std::string;
+
+namespace Midx {
+
+namespace {
+
+constexpr uint32_t front_cover = 3;
+
+uint32_t read_be32(const char *p) {
+  const auto *u = reinterpret_cast<const unsigned char *>(p);
+  return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | u[3];
+}
+
+uint32_t read_syncsafe32(const char *p) {
+  const auto *u = reinterpret_cast<const unsigned char *>(p);
+  return (uint32_t(u[0] & 0x7f) << 21) | (uint32_t(u[1] & 0x7f) << 14) |
+         (uint32_t(u[2] & 0x7f) << 7) | (u[3] & 0x7f);
+}
+
+/**
+ * Size of the ID3v2 tag at `offset` (header and footer included), 0 if there is none.
+ */
+uint64_t id3v2_tag_size(const Utils::ReadAt &read_at, const uint64_t offset) {
+  std::array<char, 10> header{};
+  if (not read_at(offset, header.size(), header.data()) or
+      std::string_view{header.data(), 3} != "ID3")
+    return 0;
+  const bool has_footer = (header[5] & 0x10) != 0;
+  return 10 + uint64_t(read_syncsafe32(&header[6])) + (has_footer ? 10 : 0);
+}
+
+/**
+ * Keep the first picture, unless a front cover comes after it.
+ */
+void pick(
+    optional<Utils::ArtLocation> &location, bool &is_front, Utils::ArtLocation found,
+    const uint32_t pic_type
+) {
+  if (location.has_value() and (is_front or pic_type != front_cover))
+    return;
+  location = std::move(found);
+  is_front = pic_type == front_cover;
+}
+
+bool locate_flac_picture(const Utils::ReadAt &read_at, optional<Utils::ArtLocation> &location) {
+  // Some FLAC files start with an ID3v2 tag
+  uint64_t pos = id3v2_tag_size(read_at, 0);
+  std::array<char, 4> magic{};
+  if (not read_at(pos, magic.size(), magic.data()) or
+      std::string_view{magic.data(), magic.size()} != "fLaC")
+    return false;
+  pos += 4;
+
+  bool is_front = false;
+  bool is_last  = false;
+  while (not is_last) {
+    std::array<char, 4> block_header{};
+    if (not read_at(pos, block_header.size(), block_header.data()))
+      return false;
+    is_last                = (block_header[0] & 0x80) != 0;
+    const int type         = block_header[0] & 0x7f;
+    const uint32_t length  = read_be32(block_header.data()) & 0xffffff;
+    const uint64_t content = pos + 4;
+    pos                    = content + length;
+    if (type == 127)
+      return false;
+    if (type != 6)
+      continue;
+
+    // PICTURE: type, MIME type, description, width, height, depth, colors then the data
+    std::array<char, 8> head{};
+    if (not read_at(content, head.size(), head.data()))
+      return false;
+    const uint32_t pic_type = read_be32(head.data());
+    const uint32_t mime_len = read_be32(head.data() + 4);
+    if (8 + uint64_t(mime_len) > length)
+      return false;
+    string mime(mime_len, '\0');
+    std::array<char, 4> desc_len{};
+    if (not read_at(content + 8, mime_len, mime.data()) or
+        not read_at(content + 8 + mime_len, desc_len.size(), desc_len.data()))
+      return false;
+    const uint64_t data_len_pos = content + 12 + mime_len + read_be32(desc_len.data()) + 16;
+    std::array<char, 4> data_len_bytes{};
+    if (data_len_pos + 4 > pos or
+        not read_at(data_len_pos, data_len_bytes.size(), data_len_bytes.data()))
+      return false;
+    const uint64_t data_len = read_be32(data_len_bytes.data());
+    if (data_len_pos + 4 + data_len > pos)
+      return false;
+    pick(
+        location, is_front, Utils::ArtLocation{data_len_pos + 4, data_len, std::move(mime)},
+        pic_type
+    );
+  }
+  return true;
+}
+
+/**
+ * Length of a string terminated according to the text encoding of an ID3v2 frame, terminator
+ * included, `nullopt` if it isn't terminated.
+ */
+optional<size_t> id3v2_string_size(const char *p, const size_t size, const char encoding) {
+  // UTF-16 strings are terminated by two null bytes
+  const bool wide = encoding == 1 or encoding == 2;
+  for (size_t i = 0; i + (wide ? 1 : 0) < size; i += (wide ? 2 : 1)) {
+    if (p[i] == 0 and (not wide or p[i + 1] == 0))
+      return i + (wide ? 2 : 1);
+  }
+  return nullopt;
+}
+
+bool locate_id3v2_picture(const Utils::ReadAt &read_at, optional<Utils::ArtLocation> &location) {
+  std::array<char, 10> header{};
+  if (not read_at(0, header.size(), header.data()) or
+      std::string_view{header.data(), 3} != "ID3")
+    return true;  // No tag, no picture
+  const int version = header[3];
+  const int flags   = header[5];
+  // ID3v2.2 uses other frame ids, a whole unsynchronised tag can't be read in place
+  if (version < 3 or version > 4 or (flags & 0x80) != 0)
+    return false;
+  const uint64_t end = 10 + uint64_t(read_syncsafe32(&header[6]));
+  uint64_t pos       = 10;
+  if ((flags & 0x40) != 0) {
+    std::array<char, 4> ext_size{};
+    if (not read_at(pos, ext_size.size(), ext_size.data()))
+      return false;
+    // The size of the extended header excludes itself in v2.3, not in v2.4
+    pos += version == 3 ? 4 + uint64_t(read_be32(ext_size.data()))
+                        : uint64_t(read_syncsafe32(ext_size.data()));
+  }
+
+  bool is_front = false;
+  while (pos + 10 <= end) {
+    std::array<char, 10> frame_header{};
+    if (not read_at(pos, frame_header.size(), frame_header.data()))
+      return false;
+    if (frame_header[0] == 0)
+      break;  // Padding
+    const uint64_t size =
+        version == 4 ? read_syncsafe32(&frame_header[4]) : read_be32(&frame_header[4]);
+    uint64_t content      = pos + 10;
+    uint64_t content_size = size;
+    pos                   = content + size;
+    if (pos > end)
+      return false;
+    if (std::string_view{frame_header.data(), 4} != "APIC")
+      continue;
+
+    const int format_flags = frame_header[9];
+    // Bytes added by the format flags before the content
+    uint64_t flag_bytes = 0;
+    if (version == 3) {
+      // Compression, encryption
+      if ((format_flags & 0xc0) != 0)
+        return false;
+      if ((format_flags & 0x20) != 0)
+        flag_bytes += 1;  // Group id
+    } else {
+      // Compression, encryption, unsynchronisation
+      if ((format_flags & 0x0e) != 0)
+        return false;
+      if ((format_flags & 0x40) != 0)
+        flag_bytes += 1;
+      if ((format_flags & 0x01) != 0)
+        flag_bytes += 4;  // Data length indicator
+    }
+    // A corrupt frame too small to hold them
+    if (content_size < flag_bytes)
+      return false;
+    content += flag_bytes;
+    content_size -= flag_bytes;
+
+    // Encoding, MIME type, picture type and description come before the data
+    std::vector<char> head(std::min<uint64_t>(content_size, 4096));
+    if (head.size() < 2 or not read_at(content, head.size(), head.data()))
+      return false;
+    const auto mime_size = id3v2_string_size(head.data() + 1, head.size() - 1, 0);
+    if (not mime_size.has_value() or 1 + *mime_size >= head.size())
+      return false;
+    string mime{head.data() + 1};
+    // "-->" means the picture is a link
+    if (mime == "-->")
+      return false;
+    const size_t pic_type_pos = 1 + *mime_size;
+    const auto desc_size      = id3v2_string_size(
+        head.data() + pic_type_pos + 1, head.size() - pic_type_pos - 1, head[0]
+    );
+    if (not desc_size.has_value())
+      return false;
+    const uint64_t header_size = pic_type_pos + 1 + *desc_size;
+    pick(
+        location, is_front,
+        Utils::ArtLocation{content + header_size, content_size - header_size, std::move(mime)},
+        uint32_t(uint8_t(head[pic_type_pos]))
+    );
+  }
+  return true;
+}
+
+}  // namespace
+
+bool Utils::locate_embedded_art(
+    const AudioFormat format, const ReadAt &read_at, optional<ArtLocation> &location
+) {
+  location.reset();
+  switch (format) {
+    case AudioFormat::Flac:
+      return locate_flac_picture(read_at, location);
+    case AudioFormat::Mp3:
+      return locate_id3v2_picture(read_at, location);
+    default:
+      return false;
+  }
+}
+
+}  // namespace Midx
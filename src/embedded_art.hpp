@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "./formats.hpp"
+
+/*
+ * Finds where the picture embedded in an audio file is, without copying it, so it can be
+ * read later straight from the file (see `Midx::get_album_art()`).
+ */
+
+namespace Midx::Utils {
+
+/**
+ * Where the bytes of an embedded picture are.
+ */
+struct ArtLocation {
+  uint64_t offset;
+  uint64_t length;
+  std::string mime_type;
+};
+
+/**
+ * Locate the front cover (or the first picture) of a FLAC file (PICTURE block) or of an MP3
+ * file (ID3v2 APIC frame). `location` is left empty if the file has no picture.
+ *
+ * Returns false if the picture can't be located because of how it's stored: unsynchronised,
+ * compressed or encrypted ID3v2 frames, ID3v2.2 tags, other formats... The picture must then
+ * be copied.
+ */
+bool locate_embedded_art(
+    const AudioFormat format, const ReadAt &read_at, std::optional<ArtLocation> &location
+);
+
+
+}  // namespace Midx::Utils
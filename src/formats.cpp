@@ -0,0 +1,407 @@
+#include "./formats.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <taglib/aifffile.h>
+#include <taglib/apefile.h>
+#include <taglib/apetag.h>
+#include <taglib/attachedpictureframe.h>
+#include <taglib/flacfile.h>
+#include <taglib/id3v2framefactory.h>
+#include <taglib/id3v2tag.h>
+#include <taglib/mp4file.h>
+#include <taglib/mp4tag.h>
+#include <taglib/mpegfile.h>
+#include <taglib/opusfile.h>
+#include <taglib/vorbisfile.h>
+#include <taglib/wavfile.h>
+#include <taglib/wavpackfile.h>
+#include <taglib/xiphcomment.h>
+
+using std::nullopt;
+using std::optional;
+using std::string;
+using TagLib::ByteVector;
+
+namespace Midx {
+
+namespace {
+
+using Utils::AudioFormat;
+
+optional<ByteVector> front_cover(const TagLib::List<TagLib::FLAC::Picture *> &pictures) {
+  if (pictures.isEmpty())
+    return nullopt;
+  for (const auto *pic : pictures) {
+    if (pic->type() == TagLib::FLAC::Picture::FrontCover)
+      return pic->data();
+  }
+  return pictures.front()->data();
+}
+
+optional<ByteVector> front_cover(const TagLib::ID3v2::Tag *tag) {
+  if (tag == nullptr)
+    return nullopt;
+  const auto &frames = tag->frameList("APIC");
+  if (frames.isEmpty())
+    return nullopt;
+  for (const auto *frame : frames) {
+    const auto *pic = static_cast<const TagLib::ID3v2::AttachedPictureFrame *>(frame);
+    if (pic->type() == TagLib::ID3v2::AttachedPictureFrame::FrontCover)
+      return pic->picture();
+  }
+  return static_cast<const TagLib::ID3v2::AttachedPictureFrame *>(frames.front())->picture();
+}
+
+optional<ByteVector> front_cover(const TagLib::APE::Tag *tag) {
+  if (tag == nullptr or not tag->itemListMap().contains("COVER ART (FRONT)"))
+    return nullopt;
+  // The picture comes after a null terminated description
+  const ByteVector data = tag->itemListMap()["COVER ART (FRONT)"].binaryData();
+  const auto *end       = std::find(data.begin(), data.end(), '\0');
+  if (end == data.end())
+    return nullopt;
+  const auto offset = static_cast<unsigned int>(end - data.begin() + 1);
+  return data.mid(offset);
+}
+
+/*
+ * One extractor per format: the TagLib class opening it, its codec and how to get its album art.
+ */
+
+struct FlacExtractor {
+  using File                          = TagLib::FLAC::File;
+  static constexpr AudioFormat format = AudioFormat::Flac;
+
+  static string codec(File &) { return "FLAC"; }
+
+  static optional<ByteVector> album_art(File &file) { return front_cover(file.pictureList()); }
+};
+
+struct Mp3Extractor {
+  using File                          = TagLib::MPEG::File;
+  static constexpr AudioFormat format = AudioFormat::Mp3;
+
+  static string codec(File &) { return "MP3"; }
+
+  static optional<ByteVector> album_art(File &file) {
+    return file.hasID3v2Tag() ? front_cover(file.ID3v2Tag()) : nullopt;
+  }
+};
+
+struct OggVorbisExtractor {
+  using File                          = TagLib::Ogg::Vorbis::File;
+  static constexpr AudioFormat format = AudioFormat::OggVorbis;
+
+  static string codec(File &) { return "Vorbis"; }
+
+  static optional<ByteVector> album_art(File &file) {
+    return file.tag() != nullptr ? front_cover(file.tag()->pictureList()) : nullopt;
+  }
+};
+
+struct OggOpusExtractor {
+  using File                          = TagLib::Ogg::Opus::File;
+  static constexpr AudioFormat format = AudioFormat::OggOpus;
+
+  static string codec(File &) { return "Opus"; }
+
+  static optional<ByteVector> album_art(File &file) {
+    return file.tag() != nullptr ? front_cover(file.tag()->pictureList()) : nullopt;
+  }
+};
+
+struct Mp4Extractor {
+  using File                          = TagLib::MP4::File;
+  static constexpr AudioFormat format = AudioFormat::Mp4;
+
+  static string codec(File &file) {
+    const auto *properties = file.audioProperties();
+    if (properties != nullptr and properties->codec() == TagLib::MP4::Properties::ALAC)
+      return "ALAC";
+    return "AAC";
+  }
+
+  static optional<ByteVector> album_art(File &file) {
+    if (file.tag() == nullptr or not file.tag()->contains("covr"))
+      return nullopt;
+    const auto covers = file.tag()->item("covr").toCoverArtList();
+    if (covers.isEmpty())
+      return nullopt;
+    return covers.front().data();
+  }
+};
+
+struct WavExtractor {
+  using File                          = TagLib::RIFF::WAV::File;
+  static constexpr AudioFormat format = AudioFormat::Wav;
+
+  static string codec(File &) { return "PCM"; }
+
+  static optional<ByteVector> album_art(File &file) {
+    return file.hasID3v2Tag() ? front_cover(file.ID3v2Tag()) : nullopt;
+  }
+};
+
+struct AiffExtractor {
+  using File                          = TagLib::RIFF::AIFF::File;
+  static constexpr AudioFormat format = AudioFormat::Aiff;
+
+  static string codec(File &) { return "PCM"; }
+
+  static optional<ByteVector> album_art(File &file) {
+    return file.hasID3v2Tag() ? front_cover(file.tag()) : nullopt;
+  }
+};
+
+struct WavPackExtractor {
+  using File                          = TagLib::WavPack::File;
+  static constexpr AudioFormat format = AudioFormat::WavPack;
+
+  static string codec(File &) { return "WavPack"; }
+
+  static optional<ByteVector> album_art(File &file) {
+    return file.hasAPETag() ? front_cover(file.APETag()) : nullopt;
+  }
+};
+
+struct ApeExtractor {
+  using File                          = TagLib::APE::File;
+  static constexpr AudioFormat format = AudioFormat::Ape;
+
+  static string codec(File &) { return "APE"; }
+
+  static optional<ByteVector> album_art(File &file) {
+    return file.hasAPETag() ? front_cover(file.APETag()) : nullopt;
+  }
+};
+
+struct Extractor {
+  std::unique_ptr<TagLib::File> (*open)(
+      TagLib::IOStream *stream, bool read_properties, TagLib::AudioProperties::ReadStyle read_style
+  );
+  string (*codec)(TagLib::File &file);
+  optional<ByteVector> (*album_art)(TagLib::File &file);
+};
+
+template <class E>
+constexpr Extractor make_extractor() {
+  return Extractor{
+      [](TagLib::IOStream *stream, const bool read_properties,
+         const TagLib::AudioProperties::ReadStyle read_style) -> std::unique_ptr<TagLib::File> {
+        using File = typename E::File;
+        // Before TagLib 2, FLAC and MPEG files opened from a stream need an ID3v2 frame factory
+        if constexpr (std::is_constructible_v<
+                          File, TagLib::IOStream *, bool, TagLib::AudioProperties::ReadStyle>)
+          return std::make_unique<File>(stream, read_properties, read_style);
+        else
+          return std::make_unique<File>(
+              stream, TagLib::ID3v2::FrameFactory::instance(), read_properties, read_style
+          );
+      },
+      [](TagLib::File &file) { return E::codec(static_cast<typename E::File &>(file)); },
+      [](TagLib::File &file) { return E::album_art(static_cast<typename E::File &>(file)); }
+  };
+}
+
+/**
+ * Extractors indexed by format.
+ */
+template <class... E>
+constexpr std::array<Extractor, Utils::n_audio_formats> make_registry() {
+  static_assert(sizeof...(E) == Utils::n_audio_formats, "Every format needs an extractor");
+  std::array<Extractor, Utils::n_audio_formats> res{};
+  ((res[size_t(E::format)] = make_extractor<E>()), ...);
+  return res;
+}
+
+constexpr auto extractors = make_registry<
+    FlacExtractor, Mp3Extractor, OggVorbisExtractor, OggOpusExtractor, Mp4Extractor,
+    WavExtractor, AiffExtractor, WavPackExtractor, ApeExtractor>();
+
+static_assert(
+    std::ranges::all_of(extractors, [](const Extractor &e) { return e.open != nullptr; }),
+    "Every format needs exactly one extractor"
+);
+
+/**
+ * Size of the ID3v2 tag some files start with, 0 if there is none.
+ */
+uint64_t leading_id3v2_size(const std::string_view head) {
+  if (head.size() < 10 or not head.starts_with("ID3"))
+    return 0;
+  const auto *u = reinterpret_cast<const unsigned char *>(head.data());
+  const uint64_t size = (uint64_t(u[6] & 0x7f) << 21) | (uint64_t(u[7] & 0x7f) << 14) |
+                        (uint64_t(u[8] & 0x7f) << 7) | (u[9] & 0x7f);
+  return 10 + size + ((u[5] & 0x10) != 0 ? 10 : 0);
+}
+
+bool is_mpeg_frame_sync(const std::string_view head) {
+  return head.size() >= 2 and uint8_t(head[0]) == 0xff and (uint8_t(head[1]) & 0xe0) == 0xe0;
+}
+
+}  // namespace
+
+bool Utils::has_audio_extension(const string &path) {
+  static constexpr std::array<std::string_view, 13> exts{
+      ".flac", ".mp3", ".ogg", ".oga", ".opus", ".m4a", ".m4b",
+      ".mp4",  ".wav", ".aif", ".aiff", ".wv",  ".ape",
+  };
+  const auto dot = path.rfind('.');
+  if (dot == string::npos or path.size() - dot > 5)
+    return false;
+  string ext = path.substr(dot);
+  std::ranges::transform(ext, ext.begin(), [](const unsigned char c) {
+    return char(std::tolower(c));
+  });
+  return std::ranges::find(exts, ext) != exts.end();
+}
+
+optional<Utils::AudioFormat> Utils::sniff_format(const ReadAt &read_at) {
+  std::array<char, 64> buf{};
+  size_t n = buf.size();
+  // Files shorter than the buffer (which can't be valid) are sniffed from what they have
+  while (n > 0 and not read_at(0, n, buf.data()))
+    --n;
+  std::string_view head{buf.data(), n};
+
+  // FLAC and APE files can start with an ID3v2 tag, like MP3s
+  const uint64_t id3_size = leading_id3v2_size(head);
+  if (id3_size > 0) {
+    std::array<char, 4> after{};
+    if (not read_at(id3_size, after.size(), after.data()))
+      return AudioFormat::Mp3;
+    const std::string_view magic{after.data(), after.size()};
+    if (magic == "fLaC")
+      return AudioFormat::Flac;
+    if (magic == "MAC ")
+      return AudioFormat::Ape;
+    return AudioFormat::Mp3;
+  }
+
+  if (head.starts_with("fLaC"))
+    return AudioFormat::Flac;
+  if (head.starts_with("OggS") and head.size() > 27) {
+    // The first packet follows the page header and its segment table
+    const size_t packet = 27 + uint8_t(head[26]);
+    const std::string_view first = packet < head.size() ? head.substr(packet) : "";
+    if (first.starts_with("\x01vorbis"))
+      return AudioFormat::OggVorbis;
+    if (first.starts_with("OpusHead"))
+      return AudioFormat::OggOpus;
+    return nullopt;
+  }
+  if (head.size() >= 8 and head.substr(4, 4) == "ftyp")
+    return AudioFormat::Mp4;
+  if (head.size() >= 12 and head.starts_with("RIFF") and head.substr(8, 4) == "WAVE")
+    return AudioFormat::Wav;
+  if (head.size() >= 12 and head.starts_with("FORM") and
+      (head.substr(8, 4) == "AIFF" or head.substr(8, 4) == "AIFC"))
+    return AudioFormat::Aiff;
+  if (head.starts_with("wvpk"))
+    return AudioFormat::WavPack;
+  if (head.starts_with("MAC "))
+    return AudioFormat::Ape;
+  if (is_mpeg_frame_sync(head))
+    return AudioFormat::Mp3;
+  return nullopt;
+}
+
+optional<Utils::AudioFormat> Utils::sniff_format(const string &path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullopt;
+  const auto res = sniff_format(make_fd_reader(fd));
+  close(fd);
+  return res;
+}
+
+Utils::ReadAt Utils::make_fd_reader(const int fd) {
+  return [fd](const uint64_t offset, const size_t size, char *out) {
+    size_t done = 0;
+    while (done < size) {
+      const ssize_t n = pread(fd, out + done, size - done, off_t(offset + done));
+      if (n <= 0)
+        return false;
+      done += size_t(n);
+    }
+    return true;
+  };
+}
+
+Utils::FdStream::FdStream(const int fd, const string &path) : m_fd{fd}, m_path{path} {
+  struct stat st {};
+  if (fstat(fd, &st) == 0)
+    m_length = st.st_size;
+}
+
+ByteVector Utils::FdStream::readBlock(const Size length) {
+  // TagLib asks for whole blocks near the end of the file
+  const uint64_t left = m_length > m_pos ? uint64_t(m_length - m_pos) : 0;
+  const uint64_t size =
+      std::min<uint64_t>({length, left, std::numeric_limits<unsigned int>::max()});
+  ByteVector res(static_cast<unsigned int>(size));
+  size_t done = 0;
+  while (done < res.size()) {
+    const ssize_t n = pread(m_fd, res.data() + done, res.size() - done, m_pos + Offset(done));
+    if (n <= 0)
+      break;
+    done += size_t(n);
+  }
+  res.resize(static_cast<unsigned int>(done));
+  m_pos += Offset(done);
+  return res;
+}
+
+void Utils::FdStream::seek(const Offset offset, const Position p) {
+  switch (p) {
+    case Beginning:
+      m_pos = offset;
+      break;
+    case Current:
+      m_pos += offset;
+      break;
+    case End:
+      m_pos = m_length + offset;
+      break;
+  }
+  m_pos = std::max<Offset>(m_pos, 0);
+}
+
+std::unique_ptr<TagLib::File> Utils::open_audio_file(
+    TagLib::IOStream &stream, const AudioFormat format, const bool read_properties,
+    const ReadStyle read_style
+) {
+  TagLib::AudioProperties::ReadStyle taglib_style = TagLib::AudioProperties::Average;
+  switch (read_style) {
+    case ReadStyle::Fast:
+      taglib_style = TagLib::AudioProperties::Fast;
+      break;
+    case ReadStyle::Average:
+      taglib_style = TagLib::AudioProperties::Average;
+      break;
+    case ReadStyle::Accurate:
+      taglib_style = TagLib::AudioProperties::Accurate;
+      break;
+  }
+  return extractors[size_t(format)].open(&stream, read_properties, taglib_style);
+}
+
+string Utils::codec_name(TagLib::File &file, const AudioFormat format) {
+  return extractors[size_t(format)].codec(file);
+}
+
+optional<ByteVector> Utils::extract_album_art(TagLib::File &file, const AudioFormat format) {
+  return extractors[size_t(format)].album_art(file);
+}
+
+}  // namespace Midx
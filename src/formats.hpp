@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include <taglib/taglib.h>
+#include <taglib/tbytevector.h>
+#include <taglib/tfile.h>
+#include <taglib/tiostream.h>
+
+#include "./utils.hpp"
+
+/*
+ * Supported audio formats. The format of a file is found from its first bytes, each format has
+ * an extractor (see formats.cpp) opening it with the matching TagLib class and getting its
+ * album art.
+ */
+
+namespace Midx::Utils {
+
+enum class AudioFormat : uint8_t {
+  Flac,
+  Mp3,
+  OggVorbis,
+  OggOpus,
+  Mp4,
+  Wav,
+  Aiff,
+  WavPack,
+  Ape,
+};
+
+inline constexpr size_t n_audio_formats = size_t(AudioFormat::Ape) + 1;
+
+/**
+ * Reads `size` bytes at `offset` into `out`, returns false if they couldn't all be read.
+ */
+using ReadAt = std::function<bool(uint64_t offset, size_t size, char *out)>;
+
+/**
+ * `ReadAt` over a file descriptor.
+ */
+ReadAt make_fd_reader(const int fd);
+
+/**
+ * Read-only TagLib stream over a file descriptor, so TagLib parses a file that's already open
+ * instead of opening its path again. The descriptor isn't owned, it must stay open while the
+ * stream is used.
+ */
+class FdStream : public TagLib::IOStream {
+ public:
+  // TagLib 2 changed the types of offsets and sizes
+#if TAGLIB_MAJOR_VERSION >= 2
+  using Offset      = TagLib::offset_t;
+  using BlockOffset = TagLib::offset_t;
+  using Size        = size_t;
+#else
+  using Offset      = long;
+  using BlockOffset = unsigned long;
+  using Size        = unsigned long;
+#endif
+
+  FdStream(const int fd, const std::string &path);
+
+  TagLib::FileName name() const override { return m_path.c_str(); }
+  TagLib::ByteVector readBlock(const Size length) override;
+  void writeBlock(const TagLib::ByteVector &) override {}
+  void insert(const TagLib::ByteVector &, const BlockOffset, const Size) override {}
+  void removeBlock(const BlockOffset, const Size) override {}
+  bool readOnly() const override { return true; }
+  bool isOpen() const override { return m_fd >= 0; }
+  void seek(const Offset offset, const Position p = Beginning) override;
+  Offset tell() const override { return m_pos; }
+  Offset length() override { return m_length; }
+  void truncate(const Offset) override {}
+
+ private:
+  const int m_fd;
+  const std::string m_path;
+  Offset m_length = 0;
+  Offset m_pos    = 0;
+};
+
+/**
+ * Whether the file's extension (case-insensitive) is one of the supported formats', used to
+ * skip other files without opening them.
+ */
+bool has_audio_extension(const std::string &path);
+
+/**
+ * Find the format of a file from its first bytes.
+ */
+std::optional<AudioFormat> sniff_format(const ReadAt &read_at);
+std::optional<AudioFormat> sniff_format(const std::string &path);
+
+/**
+ * Open a file with the TagLib class of its format, its audio properties are read with
+ * `read_style` if `read_properties` is set. `stream` must outlive the returned file.
+ */
+std::unique_ptr<TagLib::File> open_audio_file(
+    TagLib::IOStream &stream, const AudioFormat format, const bool read_properties,
+    const ReadStyle read_style = ReadStyle::Average
+);
+
+/**
+ * Name of the codec of a file opened by `open_audio_file()`, e.g. "FLAC" or "AAC".
+ */
+std::string codec_name(TagLib::File &file, const AudioFormat format);
+
+/**
+ * Get the front cover (or the first picture) of a file opened by `open_audio_file()`.
+ */
+std::optional<TagLib::ByteVector> extract_album_art(TagLib::File &file, const AudioFormat format);
+
+}  // namespace Midx::Utils
@@ -0,0 +1,83 @@
+#include "./intern_table.hpp"
+
+#include "./midx.hpp"
+#include "./statement_cache.hpp"
+
+using std::nullopt;
+using std::optional;
+using std::string;
+
+namespace Midx {
+
+Utils::InternTable::InternTable(SQLite::Database &db, const bool preload)
+    : m_db{db}, m_preloaded{preload} {
+  if (not preload)
+    return;
+  for (const auto &artist : get_all_artists(db))
+    m_artists.emplace(artist.name, artist.id);
+  for (const auto &album : get_all_albums(db))
+    m_albums[album.artist_id].emplace(album.name, album.id);
+}
+
+optional<ArtistId> Utils::InternTable::artist_id(const string &name) {
+  if (const auto it = m_artists.find(name); it != m_artists.end())
+    return it->second;
+
+  optional<ArtistId> id = nullopt;
+  if (m_preloaded) {
+    // It's not in the database, unless another connection just added it
+    CachedStatement stmt{m_db, "INSERT OR IGNORE INTO t_artists (id, name) VALUES (NULL, ?)"};
+    stmt->bindNoCopy(1, name);
+    id = stmt->exec() == 1 ? optional<ArtistId>{size_t(m_db.getLastInsertRowid())}
+                           : get_artist_id(m_db, name);
+  } else {
+    id = insert_artist(m_db, name);
+  }
+  if (id.has_value()) {
+    m_artists.emplace(name, *id);
+    m_journal.push_back(JournalEntry{name, nullopt});
+  }
+  return id;
+}
+
+optional<AlbumId> Utils::InternTable::album_id(
+    const string &name, const optional<ArtistId> artist_id
+) {
+  auto &albums = m_albums[artist_id];
+  if (const auto it = albums.find(name); it != albums.end())
+    return it->second;
+
+  optional<AlbumId> id = nullopt;
+  if (m_preloaded) {
+    CachedStatement stmt{
+        m_db, "INSERT OR IGNORE INTO t_albums (id, name, artist_id) VALUES (NULL, ?, ?)"
+    };
+    stmt->bindNoCopy(1, name);
+    if (artist_id.has_value())
+      stmt->bind(2, uint32_t(*artist_id));
+    else
+      stmt->bind(2);
+    id = stmt->exec() == 1 ? optional<AlbumId>{size_t(m_db.getLastInsertRowid())}
+                           : get_album_id(m_db, name, artist_id);
+  } else {
+    id = insert_album(m_db, name, artist_id);
+  }
+  if (id.has_value()) {
+    albums.emplace(name, *id);
+    m_journal.push_back(JournalEntry{name, artist_id});
+  }
+  return id;
+}
+
+void Utils::InternTable::rollback(const size_t mark) {
+  while (m_journal.size() > mark) {
+    const JournalEntry &entry = m_journal.back();
+    if (entry.album_of.has_value())
+      m_albums[*entry.album_of].erase(entry.name);
+    else
+      m_artists.erase(entry.name);
+    m_journal.pop_back();
+  }
+}
+
+}  // namespace Midx
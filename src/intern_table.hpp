@@ -0,0 +1,80 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+#include "./utils.hpp"
+
+namespace Midx::Utils {
+
+/**
+ * Maps artist and album names to their ids while a scan runs, tracks usually share their
+ * artist and album with the previous one so most lookups don't need any query.
+ *
+ * Names that are not known yet are inserted in the database right away. If the transaction
+ * (or savepoint) they were inserted in is rolled back, `rollback()` must be called with the
+ * `mark()` taken before, so the table doesn't hand out ids of rows that no longer exist.
+ */
+class InternTable {
+ public:
+  /**
+   * With `preload` all the artists and albums are read at once, which is what a scan wants.
+   * Otherwise they are looked up the first time they are needed.
+   */
+  InternTable(SQLite::Database &db, const bool preload);
+
+  InternTable(const InternTable &)            = delete;
+  InternTable &operator=(const InternTable &) = delete;
+
+  std::optional<ArtistId> artist_id(const std::string &name);
+  std::optional<AlbumId> album_id(const std::string &name, const std::optional<ArtistId> artist_id);
+
+  size_t mark() const { return m_journal.size(); }
+
+  /**
+   * Forget the names added since `mark`.
+   */
+  void rollback(const size_t mark);
+
+  /**
+   * The names added so far are committed, they can't be rolled back anymore.
+   */
+  void commit() { m_journal.clear(); }
+
+ private:
+  struct StringHash {
+    using is_transparent = void;
+
+    size_t operator()(const std::string_view str) const {
+      return std::hash<std::string_view>{}(str);
+    }
+  };
+
+  template <class T>
+  using StringMap = std::unordered_map<std::string, T, StringHash, std::equal_to<>>;
+
+  /**
+   * A name added since the last commit, `album_of` is set for albums.
+   */
+  struct JournalEntry {
+    std::string name;
+    std::optional<std::optional<ArtistId>> album_of;
+  };
+
+ private:
+  SQLite::Database &m_db;
+  const bool m_preloaded;
+  StringMap<ArtistId> m_artists{};
+  /**
+   * Albums by artist then by name.
+   */
+  std::unordered_map<std::optional<ArtistId>, StringMap<AlbumId>> m_albums{};
+  std::vector<JournalEntry> m_journal{};
+};
+
+}  // namespace Midx::Utils
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+#include <taglib/tbytevector.h>
+
+#include "./embedded_art.hpp"
+#include "./intern_table.hpp"
+#include "./utils.hpp"
+
+/*
+ * Helpers shared between the library's translation units, they are not part of the public API.
+ */
+
+namespace Midx::Utils {
+
+class AlbumArtClaims;
+
+/**
+ * Tags read from an audio file, artists and albums are still names at this point.
+ */
+struct ParsedMetadata {
+  std::string title;
+  std::optional<size_t> track_number;
+  std::optional<std::string> artist;
+  std::optional<std::string> album;
+  std::optional<TagLib::ByteVector> album_art;
+  /**
+   * Set instead of `album_art` when the art is stored lazily.
+   */
+  std::optional<ArtLocation> album_art_location;
+};
+
+/**
+ * Audio properties read from an audio file.
+ */
+struct ParsedProperties {
+  size_t duration_ms;
+  size_t bitrate;
+  size_t sample_rate;
+  size_t channels;
+  std::string codec;
+};
+
+/**
+ * What identifies a version of a file, if it changes the file needs to be parsed again.
+ */
+struct FileFingerprint {
+  int64_t mtime_ns;
+  int64_t size;
+  uint64_t dev;
+  uint64_t inode;
+
+  bool operator==(const FileFingerprint &) const = default;
+};
+
+/**
+ * Everything that is read from an audio file before anything is written to the database.
+ */
+struct ParsedTrack {
+  /**
+   * Canonical path, as stored in `t_tracks`.
+   */
+  std::string file_path;
+  /**
+   * Taken before the tags are read.
+   */
+  std::optional<FileFingerprint> fingerprint;
+  std::optional<ParsedMetadata> metadata;
+  std::optional<ParsedProperties> properties;
+};
+
+/**
+ * How files are parsed, taken from `ScanOptions` or `WatcherOptions`.
+ */
+struct ParseOptions {
+  ArtMode art_mode     = ArtMode::Eager;
+  ReadStyle read_style = ReadStyle::Average;
+  /**
+   * Read FLAC and ID3v2 tags without TagLib when possible (see native_tags.hpp), only turned
+   * off to compare both.
+   */
+  bool native_tags = true;
+  /**
+   * Albums whose art is already extracted, shared by the parsers of a scan. Without it the
+   * picture is extracted from every track.
+   */
+  AlbumArtClaims *art_claims = nullptr;
+};
+
+/**
+ * Checks whether a file has the extension of a supported format (see formats.hpp), its
+ * content is checked when it's parsed.
+ */
+bool is_supported_file_type(const std::string &path);
+
+/**
+ * `stat()` a file, returns `nullopt` if it can't be accessed.
+ */
+std::optional<FileFingerprint> get_file_fingerprint(const std::string &path);
+
+/**
+ * Read the tags, album art and audio properties of a file, does not touch the database so it can
+ * be called from any thread.
+ */
+std::optional<ParsedTrack> parse_track(
+    const std::string &file_path, const ParseOptions &options = {}
+);
+
+/**
+ * Get a track's id given its canonical path.
+ */
+std::optional<TrackId> find_track_id(SQLite::Database &db, const std::string &abs_path);
+
+/**
+ * Ids a track ended up with in the database.
+ */
+struct StoredTrack {
+  TrackId id;
+  std::optional<AlbumId> album_id;
+  /**
+   * False if the track already existed and was updated.
+   */
+  bool inserted;
+};
+
+/**
+ * Insert a parsed track, its artist, album, metadata and audio properties into the database,
+ * album art is left to the caller (see `store_album_art()`).
+ * If the track already exists its fingerprint, metadata and properties are replaced.
+ * Artists and albums are resolved through `interned`.
+ */
+std::optional<StoredTrack> store_track(
+    SQLite::Database &db, const ParsedTrack &track, const MDirId parent_dir_id,
+    InternTable &interned
+);
+
+}  // namespace Midx::Utils
@@ -0,0 +1,409 @@
+#include "./library_view.hpp"
+
+#include <algorithm>
+#include <tuple>
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+#include "./statement_cache.hpp"
+
+using std::shared_ptr;
+using std::string_view;
+using std::vector;
+
+namespace Midx {
+
+namespace {
+
+using StringRef = LibrarySnapshot::StringRef;
+
+constexpr uint32_t none = LibrarySnapshot::none;
+
+constexpr std::array track_orders{
+    TrackOrder::Title, TrackOrder::Artist, TrackOrder::Album, TrackOrder::RecentlyAdded
+};
+
+/**
+ * Row of `id` in a column of ids sorted in ascending order.
+ */
+uint32_t find_row(const vector<uint32_t> &ids, const size_t id) {
+  const auto it = std::lower_bound(ids.begin(), ids.end(), id);
+  if (it == ids.end() or *it != id)
+    return none;
+  return uint32_t(it - ids.begin());
+}
+
+uint32_t get_id_column(SQLite::Statement &stmt, const int column) {
+  return stmt.isColumnNull(column) ? none : stmt.getColumn(column).getUInt();
+}
+
+StringRef add_string(LibrarySnapshot &snap, const string_view str) {
+  const StringRef ref{uint32_t(snap.strings.size()), uint32_t(str.size())};
+  snap.strings.append(str);
+  return ref;
+}
+
+StringRef get_string_column(SQLite::Statement &stmt, const int column, LibrarySnapshot &snap) {
+  if (stmt.isColumnNull(column))
+    return StringRef{};
+  const auto value = stmt.getColumn(column);
+  return add_string(snap, string_view{value.getText(), size_t(value.getBytes())});
+}
+
+/**
+ * Read all the artists and albums, the names of the previous ones become unused.
+ */
+void load_artists_and_albums(SQLite::Database &db, LibrarySnapshot &snap) {
+  for (const auto &name : snap.artists.name)
+    snap.unused_bytes += name.size;
+  for (const auto &name : snap.albums.name)
+    snap.unused_bytes += name.size;
+  snap.artists = {};
+  snap.albums  = {};
+
+  Utils::CachedStatement artists_stmt{db, "SELECT id, name FROM t_artists ORDER BY id"};
+  while (artists_stmt->executeStep()) {
+    snap.artists.id.push_back(artists_stmt->getColumn(0).getUInt());
+    snap.artists.name.push_back(get_string_column(*artists_stmt, 1, snap));
+  }
+  Utils::CachedStatement albums_stmt{db, "SELECT id, name, artist_id FROM t_albums ORDER BY id"};
+  while (albums_stmt->executeStep()) {
+    snap.albums.id.push_back(albums_stmt->getColumn(0).getUInt());
+    snap.albums.name.push_back(get_string_column(*albums_stmt, 1, snap));
+    snap.albums.artist_id.push_back(get_id_column(*albums_stmt, 2));
+  }
+}
+
+/**
+ * Append a track read by one of the tracks queries below.
+ */
+void push_track(SQLite::Statement &stmt, LibrarySnapshot &snap) {
+  auto &tracks = snap.tracks;
+  tracks.id.push_back(stmt.getColumn(0).getUInt());
+  tracks.music_dir_id.push_back(stmt.getColumn(1).getUInt());
+  tracks.file_path.push_back(get_string_column(stmt, 2, snap));
+  tracks.title.push_back(get_string_column(stmt, 3, snap));
+  tracks.track_number.push_back(get_id_column(stmt, 4));
+  tracks.artist_id.push_back(get_id_column(stmt, 5));
+  tracks.album_id.push_back(get_id_column(stmt, 6));
+  tracks.duration_ms.push_back(get_id_column(stmt, 7));
+}
+
+/**
+ * Append a row of another snapshot whose strings were copied along.
+ */
+void copy_track(const LibrarySnapshot &from, const uint32_t row, LibrarySnapshot &snap) {
+  auto &tracks = snap.tracks;
+  tracks.id.push_back(from.tracks.id[row]);
+  tracks.music_dir_id.push_back(from.tracks.music_dir_id[row]);
+  tracks.file_path.push_back(from.tracks.file_path[row]);
+  tracks.title.push_back(from.tracks.title[row]);
+  tracks.track_number.push_back(from.tracks.track_number[row]);
+  tracks.artist_id.push_back(from.tracks.artist_id[row]);
+  tracks.album_id.push_back(from.tracks.album_id[row]);
+  tracks.duration_ms.push_back(from.tracks.duration_ms[row]);
+}
+
+/**
+ * Sort keys of the tracks that need a lookup, done once per track instead of per comparison.
+ */
+struct TrackKeys {
+  vector<string_view> artist_name;
+  vector<string_view> album_name;
+};
+
+TrackKeys get_track_keys(const LibrarySnapshot &snap) {
+  TrackKeys res{};
+  res.artist_name.reserve(snap.n_tracks());
+  res.album_name.reserve(snap.n_tracks());
+  for (size_t row = 0; row < snap.n_tracks(); ++row) {
+    const uint32_t artist_row = snap.artist_row(snap.tracks.artist_id[row]);
+    res.artist_name.push_back(
+        artist_row == none ? string_view{} : snap.str(snap.artists.name[artist_row])
+    );
+    const uint32_t album_row = snap.album_row(snap.tracks.album_id[row]);
+    res.album_name.push_back(
+        album_row == none ? string_view{} : snap.str(snap.albums.name[album_row])
+    );
+  }
+  return res;
+}
+
+/**
+ * Whether a track is listed in `order`, like in `get_tracks_page()`.
+ */
+bool is_listed(const LibrarySnapshot &snap, const TrackOrder order, const uint32_t row) {
+  switch (order) {
+    case TrackOrder::Title:
+      return snap.tracks.title[row].offset != none;
+    case TrackOrder::Artist:
+      return snap.artist_row(snap.tracks.artist_id[row]) != none;
+    case TrackOrder::Album:
+      return snap.album_row(snap.tracks.album_id[row]) != none;
+    case TrackOrder::RecentlyAdded:
+      return true;
+  }
+  return false;
+}
+
+/**
+ * Compares rows like the `ORDER BY` of `get_tracks_page()`, rows are ordered like ids.
+ */
+auto track_less(const LibrarySnapshot &snap, const TrackKeys &keys, const TrackOrder order) {
+  return [&snap, &keys, order](const uint32_t a, const uint32_t b) {
+    const auto &tracks = snap.tracks;
+    const auto track_number = [&](const uint32_t row) {
+      return tracks.track_number[row] == none ? int64_t(-1) : int64_t(tracks.track_number[row]);
+    };
+    switch (order) {
+      case TrackOrder::Title:
+        return std::tuple{snap.str(tracks.title[a]), a} <
+               std::tuple{snap.str(tracks.title[b]), b};
+      case TrackOrder::Artist:
+        return std::tuple{keys.artist_name[a], snap.str(tracks.title[a]), a} <
+               std::tuple{keys.artist_name[b], snap.str(tracks.title[b]), b};
+      case TrackOrder::Album:
+        return std::tuple{keys.album_name[a], tracks.album_id[a], track_number(a), a} <
+               std::tuple{keys.album_name[b], tracks.album_id[b], track_number(b), b};
+      case TrackOrder::RecentlyAdded:
+        return a > b;
+    }
+    return false;
+  };
+}
+
+vector<uint32_t> sort_tracks(
+    const LibrarySnapshot &snap, const TrackKeys &keys, const TrackOrder order
+) {
+  vector<uint32_t> res{};
+  res.reserve(snap.n_tracks());
+  if (order == TrackOrder::RecentlyAdded) {
+    for (size_t row = snap.n_tracks(); row > 0; --row)
+      res.push_back(uint32_t(row - 1));
+    return res;
+  }
+  for (uint32_t row = 0; row < snap.n_tracks(); ++row) {
+    if (is_listed(snap, order, row))
+      res.push_back(row);
+  }
+  std::sort(res.begin(), res.end(), track_less(snap, keys, order));
+  return res;
+}
+
+/**
+ * Sort `added` rows and merge them with the rows of a previous order, `new_rows` maps the
+ * previous rows to the new ones (`none` for the dropped ones).
+ */
+vector<uint32_t> merge_tracks(
+    const LibrarySnapshot &snap, const TrackKeys &keys, const TrackOrder order,
+    const vector<uint32_t> &previous, const vector<uint32_t> &new_rows,
+    const vector<uint32_t> &added
+) {
+  vector<uint32_t> kept{};
+  kept.reserve(previous.size());
+  for (const uint32_t row : previous) {
+    if (new_rows[row] != none)
+      kept.push_back(new_rows[row]);
+  }
+  vector<uint32_t> sorted_added{};
+  for (const uint32_t row : added) {
+    if (is_listed(snap, order, row))
+      sorted_added.push_back(row);
+  }
+  const auto less = track_less(snap, keys, order);
+  std::sort(sorted_added.begin(), sorted_added.end(), less);
+  vector<uint32_t> res(kept.size() + sorted_added.size());
+  std::merge(
+      kept.begin(), kept.end(), sorted_added.begin(), sorted_added.end(), res.begin(), less
+  );
+  return res;
+}
+
+/**
+ * Rows of artists or albums by name then id, and most recent first.
+ */
+std::array<vector<uint32_t>, 2> sort_by_name(
+    const LibrarySnapshot &snap, const vector<StringRef> &names
+) {
+  vector<uint32_t> by_name(names.size());
+  for (uint32_t row = 0; row < names.size(); ++row)
+    by_name[row] = row;
+  vector<uint32_t> recent(by_name.rbegin(), by_name.rend());
+  std::sort(by_name.begin(), by_name.end(), [&](const uint32_t a, const uint32_t b) {
+    return std::tuple{snap.str(names[a]), a} < std::tuple{snap.str(names[b]), b};
+  });
+  return {std::move(by_name), std::move(recent)};
+}
+
+/**
+ * Whether an artist or album (`columns`) of `previous` was renamed or removed, the tracks then
+ * can't be merged in the previous orders.
+ */
+template <auto columns>
+bool names_changed(const LibrarySnapshot &previous, const LibrarySnapshot &snap) {
+  const auto &before = previous.*columns;
+  const auto &after  = snap.*columns;
+  for (size_t row = 0; row < before.id.size(); ++row) {
+    const uint32_t new_row = find_row(after.id, before.id[row]);
+    if (new_row == none or previous.str(before.name[row]) != snap.str(after.name[new_row]))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * Copy the strings rows refer to into a new buffer, dropping the unused ones.
+ */
+void compact_strings(LibrarySnapshot &snap) {
+  const std::string previous = std::exchange(snap.strings, {});
+  const auto copy = [&](vector<StringRef> &column) {
+    for (auto &ref : column) {
+      if (ref.offset != none)
+        ref = add_string(snap, string_view{previous}.substr(ref.offset, ref.size));
+    }
+  };
+  copy(snap.artists.name);
+  copy(snap.albums.name);
+  copy(snap.tracks.file_path);
+  copy(snap.tracks.title);
+  snap.unused_bytes = 0;
+}
+
+void sort_artists_and_albums(LibrarySnapshot &snap) {
+  snap.artist_orders = sort_by_name(snap, snap.artists.name);
+  snap.album_orders  = sort_by_name(snap, snap.albums.name);
+}
+
+shared_ptr<const LibrarySnapshot> load_library(SQLite::Database &db) {
+  auto snap = std::make_shared<LibrarySnapshot>();
+  load_artists_and_albums(db, *snap);
+  Utils::CachedStatement stmt{db, R"--(
+    SELECT t.id, t.parent_dir_id, t.file_path, tm.title, tm.track_num, tm.artist_id,
+           tm.album_id, tp.duration_ms
+    FROM t_tracks t
+    LEFT JOIN t_tracks_metadata tm ON tm.track_id = t.id
+    LEFT JOIN t_tracks_properties tp ON tp.track_id = t.id
+    ORDER BY t.id
+  )--"};
+  while (stmt->executeStep())
+    push_track(*stmt, *snap);
+
+  const TrackKeys keys = get_track_keys(*snap);
+  for (const auto order : track_orders)
+    snap->track_orders[size_t(order)] = sort_tracks(*snap, keys, order);
+  sort_artists_and_albums(*snap);
+  return snap;
+}
+
+/**
+ * Sorted and without duplicates.
+ */
+vector<uint32_t> to_sorted_ids(std::span<const TrackId> ids) {
+  vector<uint32_t> res{};
+  res.reserve(ids.size());
+  for (const auto id : ids)
+    res.push_back(uint32_t(id));
+  std::sort(res.begin(), res.end());
+  res.erase(std::unique(res.begin(), res.end()), res.end());
+  return res;
+}
+
+}  // namespace
+
+uint32_t LibrarySnapshot::artist_row(const ArtistId id) const { return find_row(artists.id, id); }
+
+uint32_t LibrarySnapshot::album_row(const AlbumId id) const { return find_row(albums.id, id); }
+
+uint32_t LibrarySnapshot::track_row(const TrackId id) const { return find_row(tracks.id, id); }
+
+LibraryView::LibraryView(SQLite::Database &db) : m_snapshot{load_library(db)} {}
+
+void LibraryView::reload(SQLite::Database &db) {
+  std::lock_guard lock{m_update_mutex};
+  m_snapshot.store(load_library(db));
+}
+
+void LibraryView::update(
+    SQLite::Database &db, std::span<const TrackId> changed_ids,
+    std::span<const TrackId> removed_ids
+) {
+  std::lock_guard lock{m_update_mutex};
+  const shared_ptr<const LibrarySnapshot> previous = m_snapshot.load();
+  const vector<uint32_t> changed = to_sorted_ids(changed_ids);
+  const vector<uint32_t> removed = to_sorted_ids(removed_ids);
+  // Merging many rows is slower than sorting everything again
+  if (changed.size() > previous->n_tracks() / 4) {
+    m_snapshot.store(load_library(db));
+    return;
+  }
+
+  auto snap          = std::make_shared<LibrarySnapshot>();
+  snap->strings      = previous->strings;
+  snap->unused_bytes = previous->unused_bytes;
+  snap->artists      = previous->artists;
+  snap->albums       = previous->albums;
+  load_artists_and_albums(db, *snap);
+
+  // Rows of the previous snapshot and changed tracks are merged by id
+  Utils::CachedStatement stmt{db, R"--(
+    SELECT t.id, t.parent_dir_id, t.file_path, tm.title, tm.track_num, tm.artist_id,
+           tm.album_id, tp.duration_ms
+    FROM t_tracks t
+    LEFT JOIN t_tracks_metadata tm ON tm.track_id = t.id
+    LEFT JOIN t_tracks_properties tp ON tp.track_id = t.id
+    WHERE t.id = ?
+  )--"};
+  vector<uint32_t> new_rows(previous->n_tracks(), none);
+  vector<uint32_t> added{};
+  size_t next_changed = 0;
+  const auto read_changed_until = [&](const uint64_t id) {
+    for (; next_changed < changed.size() and changed[next_changed] <= id; ++next_changed) {
+      if (std::binary_search(removed.begin(), removed.end(), changed[next_changed]))
+        continue;
+      stmt->bind(1, changed[next_changed]);
+      if (stmt->executeStep()) {
+        added.push_back(uint32_t(snap->n_tracks()));
+        push_track(*stmt, *snap);
+      }
+      stmt->reset();
+    }
+  };
+  for (uint32_t row = 0; row < previous->n_tracks(); ++row) {
+    const uint32_t id = previous->tracks.id[row];
+    read_changed_until(id);
+    if (std::binary_search(changed.begin(), changed.end(), id) or
+        std::binary_search(removed.begin(), removed.end(), id)) {
+      snap->unused_bytes += previous->tracks.file_path[row].size + previous->tracks.title[row].size;
+      continue;
+    }
+    new_rows[row] = uint32_t(snap->n_tracks());
+    copy_track(*previous, row, *snap);
+  }
+  read_changed_until(UINT64_MAX);
+
+  const TrackKeys keys       = get_track_keys(*snap);
+  const bool artists_renamed = names_changed<&LibrarySnapshot::artists>(*previous, *snap);
+  const bool albums_renamed  = names_changed<&LibrarySnapshot::albums>(*previous, *snap);
+  for (const auto order : track_orders) {
+    auto &rows = snap->track_orders[size_t(order)];
+    if ((order == TrackOrder::Artist and artists_renamed) or
+        (order == TrackOrder::Album and albums_renamed) or order == TrackOrder::RecentlyAdded) {
+      rows = sort_tracks(*snap, keys, order);
+    } else {
+      rows = merge_tracks(
+          *snap, keys, order, previous->track_orders[size_t(order)], new_rows, added
+      );
+    }
+  }
+  sort_artists_and_albums(*snap);
+  if (snap->unused_bytes > snap->strings.size() / 2)
+    compact_strings(*snap);
+
+  spdlog::debug(
+      "Library view updated: {} tracks read, {} tracks in total", added.size(), snap->n_tracks()
+  );
+  m_snapshot.store(std::move(snap));
+}
+
+}  // namespace Midx
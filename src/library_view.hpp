@@ -0,0 +1,163 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+#include "./midx.hpp"
+#include "./utils.hpp"
+
+namespace Midx {
+
+/**
+ * A copy of the library laid out in columns: the `i`-th row of a table is made of the `i`-th
+ * element of each of its columns, and rows are ordered by id. Strings are stored one after the
+ * other in `strings`. References to other tables are ids. Missing values are
+ * `LibrarySnapshot::none`.
+ *
+ * Snapshots are only read once published (see `LibraryView`), so any thread can use them
+ * without locking.
+ */
+class LibrarySnapshot {
+ public:
+  static constexpr uint32_t none = UINT32_MAX;
+
+  /**
+   * Where a string is in `strings`, its offset is `none` for a missing string.
+   */
+  struct StringRef {
+    uint32_t offset = none;
+    uint32_t size   = 0;
+  };
+
+  struct ArtistColumns {
+    std::vector<uint32_t> id;
+    std::vector<StringRef> name;
+  };
+
+  struct AlbumColumns {
+    std::vector<uint32_t> id;
+    std::vector<StringRef> name;
+    std::vector<uint32_t> artist_id;
+  };
+
+  struct TrackColumns {
+    std::vector<uint32_t> id;
+    std::vector<uint32_t> music_dir_id;
+    std::vector<StringRef> file_path;
+    /**
+     * Missing for tracks without metadata.
+     */
+    std::vector<StringRef> title;
+    std::vector<uint32_t> track_number;
+    std::vector<uint32_t> artist_id;
+    std::vector<uint32_t> album_id;
+    std::vector<uint32_t> duration_ms;
+  };
+
+  std::string_view str(const StringRef ref) const {
+    return ref.offset == none ? std::string_view{}
+                              : std::string_view{strings}.substr(ref.offset, ref.size);
+  }
+
+  size_t n_artists() const { return artists.id.size(); }
+  size_t n_albums() const { return albums.id.size(); }
+  size_t n_tracks() const { return tracks.id.size(); }
+
+  /**
+   * Row of an id, `none` if it's not in the snapshot.
+   */
+  uint32_t artist_row(const ArtistId id) const;
+  uint32_t album_row(const AlbumId id) const;
+  uint32_t track_row(const TrackId id) const;
+
+  /**
+   * Rows of the tracks in `order`, which lists the same tracks as `get_tracks_page()`.
+   */
+  std::span<const uint32_t> tracks_in(const TrackOrder order) const {
+    return track_orders[size_t(order)];
+  }
+  std::span<const uint32_t> albums_in(const ListOrder order) const {
+    return album_orders[size_t(order)];
+  }
+  std::span<const uint32_t> artists_in(const ListOrder order) const {
+    return artist_orders[size_t(order)];
+  }
+
+ public:
+  ArtistColumns artists;
+  AlbumColumns albums;
+  TrackColumns tracks;
+  std::string strings;
+  /**
+   * Bytes of `strings` no row refers to anymore, they are dropped when they make up half of it.
+   */
+  size_t unused_bytes = 0;
+
+  /**
+   * Rows sorted in each order, indexed by the order's value.
+   */
+  std::array<std::vector<uint32_t>, 4> track_orders;
+  std::array<std::vector<uint32_t>, 2> album_orders;
+  std::array<std::vector<uint32_t>, 2> artist_orders;
+};
+
+/**
+ * Publishes snapshots of the library that readers can sort, filter and scroll through without
+ * querying the database.
+ *
+ * `snapshot()` returns the current snapshot. It doesn't change while a reader holds it. An
+ * update builds a new snapshot from the previous one and swaps it in atomically. Snapshots a
+ * reader still holds are freed when the reader drops them.
+ */
+class LibraryView {
+ public:
+  /**
+   * Load the whole library.
+   */
+  explicit LibraryView(SQLite::Database &db);
+
+  LibraryView(const LibraryView &)            = delete;
+  LibraryView &operator=(const LibraryView &) = delete;
+
+  std::shared_ptr<const LibrarySnapshot> snapshot() const { return m_snapshot.load(); }
+
+  /**
+   * Load the whole library again.
+   */
+  void reload(SQLite::Database &db);
+
+  /**
+   * Read the tracks in `changed_ids` again and drop the ones in `removed_ids`. Only the changed
+   * tracks are read: the other rows are copied from the previous snapshot and merged into its
+   * sort orders. Artists and albums are read again.
+   */
+  void update(
+      SQLite::Database &db, std::span<const TrackId> changed_ids,
+      std::span<const TrackId> removed_ids
+  );
+
+  /**
+   * Apply what a scan did.
+   */
+  void update(SQLite::Database &db, const ScanReport &report) {
+    update(db, report.changed_ids, report.removed_ids);
+  }
+
+ private:
+  /**
+   * Serializes the updates, readers never wait on it.
+   */
+  std::mutex m_update_mutex;
+  std::atomic<std::shared_ptr<const LibrarySnapshot>> m_snapshot;
+};
+
+}  // namespace Midx
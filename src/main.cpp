@@ -1,12 +1,140 @@
 #include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
 #include <SQLiteCpp/SQLiteCpp.h>
 #include <spdlog/spdlog.h>
 
 #include "./midx.hpp"
+#include "./schema.hpp"
 
 using namespace Midx;
 
-int main() {
+/**
+ * Check that the queries filtering on a foreign key are answered with its index rather than by
+ * reading the whole table.
+ */
+static bool check_query_plans(SQLite::Database &db) {
+  const std::vector<std::pair<std::string, std::string>> expected{
+      {"SELECT id, file_path FROM t_tracks WHERE parent_dir_id = 1", "idx_tracks_parent_dir"},
+      {"DELETE FROM t_tracks WHERE parent_dir_id = 1 AND scan_gen IS NOT 2",
+       "idx_tracks_parent_dir"},
+      {"SELECT track_id FROM t_tracks_metadata WHERE artist_id = 1", "idx_tracks_metadata_artist"},
+      {"SELECT track_id FROM t_tracks_metadata WHERE album_id = 1", "idx_tracks_metadata_album"},
+      {"SELECT id, name FROM t_albums WHERE artist_id = 1", "idx_albums_artist"},
+      {"SELECT album_id FROM t_albums_art WHERE art_hash = 1", "idx_albums_art_hash"},
+      {"SELECT album_id FROM t_albums_embedded_art WHERE track_id = 1",
+       "idx_albums_embedded_art_track"},
+  };
+  bool ok = true;
+  for (const auto &[query, index] : expected) {
+    SQLite::Statement stmt{db, "EXPLAIN QUERY PLAN " + query};
+    std::string plan{};
+    while (stmt.executeStep())
+      plan += stmt.getColumn(3).getString() + "; ";
+    if (plan.find(index) == std::string::npos) {
+      spdlog::error("ERROR: `{}` doesn't use {}: {}", query, index, plan);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+/**
+ * Create a database with the schema of the library's first version, before it was versioned,
+ * then check that `init_database()` upgrades it in place: the new columns, tables and indexes
+ * are added, the existing tracks are kept and indexed for search.
+ */
+static bool check_upgrade(const std::string &path) {
+  std::filesystem::remove(path);
+  {
+    SQLite::Database db{path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE};
+    db.exec(R"--(
+      CREATE TABLE t_music_dirs (
+        id              INTEGER PRIMARY KEY AUTOINCREMENT,
+        path            TEXT NOT NULL UNIQUE
+      );
+      CREATE TABLE t_artists (
+        id              INTEGER PRIMARY KEY AUTOINCREMENT,
+        name            TEXT NOT NULL UNIQUE
+      );
+      CREATE TABLE t_albums (
+        id                         INTEGER PRIMARY KEY AUTOINCREMENT,
+        name                       TEXT NOT NULL,
+        artist_id                  INTEGER,
+        FOREIGN KEY(artist_id)     REFERENCES t_artists(id),
+        CONSTRAINT unique_artist_album UNIQUE (name, artist_id)
+      );
+      CREATE TABLE t_tracks (
+        id                         INTEGER PRIMARY KEY AUTOINCREMENT,
+        file_path                  TEXT NOT NULL UNIQUE,
+        parent_dir_id              INTEGER NOT NULL,
+        FOREIGN KEY(parent_dir_id) REFERENCES t_music_dirs(id)
+      );
+      CREATE TABLE t_tracks_metadata (
+        track_id                   INTEGER PRIMARY KEY,
+        title                      TEXT NOT NULL,
+        track_num                  INTEGER,
+        artist_id                  INTEGER,
+        album_id                   INTEGER,
+        FOREIGN KEY(track_id)      REFERENCES t_tracks(id),
+        FOREIGN KEY(artist_id)     REFERENCES t_artists(id),
+        FOREIGN KEY(album_id)      REFERENCES t_albums(id)
+      );
+      INSERT INTO t_music_dirs (path) VALUES ('/music');
+      INSERT INTO t_artists (name) VALUES ('Nina Simone');
+      INSERT INTO t_albums (name, artist_id) VALUES ('Pastel Blues', 1);
+      INSERT INTO t_tracks (file_path, parent_dir_id)
+        VALUES ('/music/01 Be My Husband.flac', 1), ('/music/02 Nobody.flac', 1);
+      INSERT INTO t_tracks_metadata (track_id, title, track_num, artist_id, album_id)
+        VALUES (1, 'Be My Husband', 1, 1, 1), (2, 'Nobody Knows You', 2, 1, 1);
+    )--");
+  }
+
+  SQLite::Database db{path, SQLite::OPEN_READWRITE};
+  Midx::init_database(db);
+  bool ok = true;
+  if (Utils::get_schema_version(db) != Utils::schema_version) {
+    spdlog::error("ERROR: The old database wasn't migrated to the current schema.");
+    ok = false;
+  }
+  const std::vector<std::pair<std::string, std::string>> columns{
+      {"t_music_dirs", "scan_gen"}, {"t_tracks", "mtime_ns"}, {"t_tracks", "size"},
+      {"t_tracks", "dev"},          {"t_tracks", "inode"},    {"t_tracks", "scan_gen"},
+  };
+  for (const auto &[table, column] : columns) {
+    SQLite::Statement stmt{db, "SELECT EXISTS(SELECT 1 FROM pragma_table_info(?) WHERE name = ?)"};
+    stmt.bind(1, table);
+    stmt.bind(2, column);
+    stmt.executeStep();
+    if (stmt.getColumn(0).getInt() == 0) {
+      spdlog::error("ERROR: The upgrade didn't add {}.{}", table, column);
+      ok = false;
+    }
+  }
+  for (const auto *table : {"t_tracks_properties", "t_art", "t_albums_art",
+                            "t_albums_embedded_art", "t_tracks_fts"}) {
+    if (not db.tableExists(table)) {
+      spdlog::error("ERROR: The upgrade didn't create {}", table);
+      ok = false;
+    }
+  }
+  if (get_all_tracks(db).size() != 2) {
+    spdlog::error("ERROR: The upgrade lost tracks.");
+    ok = false;
+  }
+  // The tracks stored before search existed are indexed
+  if (search(db, "nobody") != std::vector<TrackId>{2} or search(db, "simone").size() != 2) {
+    spdlog::error("ERROR: The upgrade didn't index the existing tracks for search.");
+    ok = false;
+  }
+  return check_query_plans(db) and ok;
+}
+
+/**
+ * Usage: test [music directory], the directory is scanned if given.
+ */
+int main(int argc, char **argv) {
   Midx::data_dir = "./midx-test/metadata";
   std::filesystem::create_directories(Midx::data_dir);
 
@@ -14,9 +142,21 @@ int main() {
 
   Midx::init_database(db);
 
-  auto mdir_id = insert_music_dir(db, "../../../../Music/");
+  if (Utils::get_schema_version(db) != Utils::schema_version) {
+    spdlog::error("ERROR: The database wasn't migrated to the current schema.");
+    return 1;
+  }
+  if (not check_query_plans(db))
+    return 1;
+  if (not check_upgrade("midx-test/old-db.sqlite"))
+    return 1;
+
+  if (argc < 2)
+    return 0;
+  auto mdir_id = insert_music_dir(db, argv[1]);
   if (! mdir_id.has_value()) {
     spdlog::error("ERROR: Failed to insert directory.");
+    return 1;
   }
 
   Midx::build_music_library(db);
@@ -0,0 +1,164 @@
+#include "./metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <format>
+
+namespace Midx {
+
+namespace {
+
+/**
+ * Each stage on its own cache lines, parsers and the writer don't slow each other down.
+ */
+struct alignas(64) StageCounters {
+  std::atomic<uint64_t> total_ns{0};
+  std::array<std::atomic<uint64_t>, n_histogram_buckets> histogram{};
+};
+
+std::array<StageCounters, n_scan_stages> stage_counters{};
+std::array<std::atomic<uint64_t>, n_scan_counters> counters{};
+
+double to_seconds(const std::chrono::nanoseconds duration) {
+  return std::chrono::duration<double>{duration}.count();
+}
+
+}  // namespace
+
+void Utils::record_duration(const ScanStage stage, const std::chrono::nanoseconds duration) {
+  const uint64_t ns = uint64_t(std::max<int64_t>(duration.count(), 0));
+  // Number of bits of the duration in microseconds
+  const int bucket = std::min(64 - std::countl_zero(ns / 1000), int(n_histogram_buckets) - 1);
+  StageCounters &c = stage_counters[size_t(stage)];
+  c.total_ns.fetch_add(ns, std::memory_order_relaxed);
+  c.histogram[size_t(bucket)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Utils::add_to_counter(const ScanCounter counter, const uint64_t n) {
+  counters[size_t(counter)].fetch_add(n, std::memory_order_relaxed);
+}
+
+Metrics metrics() {
+  Metrics res{};
+  for (size_t s = 0; s < n_scan_stages; ++s) {
+    const StageCounters &c = stage_counters[s];
+    StageMetrics &stage    = res.stages[s];
+    stage.total            = std::chrono::nanoseconds{c.total_ns.load(std::memory_order_relaxed)};
+    // Counted from the histogram so that both always agree
+    for (size_t b = 0; b < n_histogram_buckets; ++b) {
+      stage.histogram[b] = c.histogram[b].load(std::memory_order_relaxed);
+      stage.count += stage.histogram[b];
+    }
+  }
+  for (size_t i = 0; i < n_scan_counters; ++i)
+    res.counters[i] = counters[i].load(std::memory_order_relaxed);
+  return res;
+}
+
+void reset_metrics() {
+  for (auto &c : stage_counters) {
+    c.total_ns.store(0, std::memory_order_relaxed);
+    for (auto &n : c.histogram)
+      n.store(0, std::memory_order_relaxed);
+  }
+  for (auto &n : counters)
+    n.store(0, std::memory_order_relaxed);
+}
+
+const char *to_string(const ScanStage stage) {
+  switch (stage) {
+    case ScanStage::Walk:
+      return "walk";
+    case ScanStage::Stat:
+      return "stat";
+    case ScanStage::Parse:
+      return "parse";
+    case ScanStage::ArtWrite:
+      return "art_write";
+    case ScanStage::DbInsert:
+      return "db_insert";
+    case ScanStage::Commit:
+      return "commit";
+  }
+  return "";
+}
+
+const char *to_string(const ScanCounter counter) {
+  switch (counter) {
+    case ScanCounter::FilesSeen:
+      return "files_seen";
+    case ScanCounter::FilesSkipped:
+      return "files_skipped";
+    case ScanCounter::FilesParsed:
+      return "files_parsed";
+    case ScanCounter::ParseFailures:
+      return "parse_failures";
+    case ScanCounter::BytesParsed:
+      return "bytes_parsed";
+    case ScanCounter::TracksWritten:
+      return "tracks_written";
+    case ScanCounter::WriteFailures:
+      return "write_failures";
+    case ScanCounter::BatchesCommitted:
+      return "batches_committed";
+    case ScanCounter::BatchesRolledBack:
+      return "batches_rolled_back";
+  }
+  return "";
+}
+
+std::string Metrics::to_prometheus() const {
+  std::string res{};
+  res += "# HELP midx_scan_stage_seconds Time spent in each stage of the scans.\n";
+  res += "# TYPE midx_scan_stage_seconds histogram\n";
+  for (size_t s = 0; s < n_scan_stages; ++s) {
+    const char *name          = to_string(ScanStage(s));
+    const StageMetrics &stage = stages[s];
+    uint64_t cumulative       = 0;
+    for (size_t b = 0; b + 1 < n_histogram_buckets; ++b) {
+      cumulative += stage.histogram[b];
+      res += std::format(
+          "midx_scan_stage_seconds_bucket{{stage=\"{}\",le=\"{}\"}} {}\n", name,
+          double(uint64_t(1) << b) * 1e-6, cumulative
+      );
+    }
+    res += std::format(
+        "midx_scan_stage_seconds_bucket{{stage=\"{}\",le=\"+Inf\"}} {}\n", name, stage.count
+    );
+    res += std::format(
+        "midx_scan_stage_seconds_sum{{stage=\"{}\"}} {}\n", name, to_seconds(stage.total)
+    );
+    res += std::format("midx_scan_stage_seconds_count{{stage=\"{}\"}} {}\n", name, stage.count);
+  }
+  for (size_t i = 0; i < n_scan_counters; ++i) {
+    const char *name = to_string(ScanCounter(i));
+    res += std::format("# TYPE midx_scan_{}_total counter\n", name);
+    res += std::format("midx_scan_{}_total {}\n", name, counters[i]);
+  }
+  return res;
+}
+
+std::string Metrics::to_json() const {
+  std::string res = "{\"stages\": {";
+  for (size_t s = 0; s < n_scan_stages; ++s) {
+    const StageMetrics &stage = stages[s];
+    res += std::format(
+        "{}\"{}\": {{\"count\": {}, \"total_seconds\": {}, \"histogram\": [", s > 0 ? ", " : "",
+        to_string(ScanStage(s)), stage.count, to_seconds(stage.total)
+    );
+    for (size_t b = 0; b < n_histogram_buckets; ++b)
+      res += std::format("{}{}", b > 0 ? ", " : "", stage.histogram[b]);
+    res += "]}";
+  }
+  res += "}, \"counters\": {";
+  for (size_t i = 0; i < n_scan_counters; ++i) {
+    res += std::format(
+        "{}\"{}\": {}", i > 0 ? ", " : "", to_string(ScanCounter(i)), counters[i]
+    );
+  }
+  res += "}}";
+  return res;
+}
+
+}  // namespace Midx
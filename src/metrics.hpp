@@ -0,0 +1,143 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "./trace.hpp"
+
+namespace Midx {
+
+/**
+ * Timed parts of a scan.
+ */
+enum class ScanStage {
+  /**
+   * Moving to the next entry of the directory being walked.
+   */
+  Walk,
+  /**
+   * `stat()` of a file already in the database, to know if it changed.
+   */
+  Stat,
+  /**
+   * Reading the tags, album art and audio properties of a file.
+   */
+  Parse,
+  /**
+   * Writing the album art of a committed batch.
+   */
+  ArtWrite,
+  /**
+   * Writing a track, its artist, album, metadata and audio properties.
+   */
+  DbInsert,
+  Commit,
+};
+
+inline constexpr size_t n_scan_stages = 6;
+
+enum class ScanCounter {
+  /**
+   * Supported files walked, changed or not.
+   */
+  FilesSeen,
+  FilesSkipped,
+  FilesParsed,
+  ParseFailures,
+  /**
+   * Size of the files parsed.
+   */
+  BytesParsed,
+  TracksWritten,
+  WriteFailures,
+  BatchesCommitted,
+  BatchesRolledBack,
+};
+
+inline constexpr size_t n_scan_counters = 9;
+
+/**
+ * Bucket `i` of a latency histogram counts the durations shorter than 2^i microseconds that
+ * are not in a previous bucket, the last bucket counts all the longer ones too.
+ */
+inline constexpr size_t n_histogram_buckets = 32;
+
+struct StageMetrics {
+  uint64_t count = 0;
+  std::chrono::nanoseconds total{0};
+  std::array<uint64_t, n_histogram_buckets> histogram{};
+};
+
+/**
+ * What the scans did since the process started or `reset_metrics()` was called, indexed by the
+ * value of a `ScanStage` or a `ScanCounter`.
+ */
+struct Metrics {
+  std::array<StageMetrics, n_scan_stages> stages{};
+  std::array<uint64_t, n_scan_counters> counters{};
+
+  const StageMetrics &stage(const ScanStage stage) const { return stages[size_t(stage)]; }
+  uint64_t counter(const ScanCounter counter) const { return counters[size_t(counter)]; }
+
+  /**
+   * The Prometheus text exposition format, stages are `midx_scan_stage_seconds` histograms
+   * labelled by stage and counters are `midx_scan_<name>_total`.
+   */
+  std::string to_prometheus() const;
+  /**
+   * `{"stages": {"walk": {"count", "total_seconds", "histogram"}...}, "counters": {...}}`, the
+   * histograms are arrays of the bucket counts.
+   */
+  std::string to_json() const;
+};
+
+/**
+ * Read the scan metrics. They are always collected: updating them costs a few relaxed atomic
+ * increments and two clock reads per timed stage, which is little next to the I/O being timed.
+ * Concurrent scans are summed, a snapshot taken during a scan may be a few updates behind.
+ */
+Metrics metrics();
+
+void reset_metrics();
+
+const char *to_string(ScanStage stage);
+const char *to_string(ScanCounter counter);
+
+namespace Utils {
+
+void record_duration(const ScanStage stage, const std::chrono::nanoseconds duration);
+
+void add_to_counter(const ScanCounter counter, const uint64_t n = 1);
+
+/**
+ * Records the time from its construction to its destruction in the metrics of `stage`, and as
+ * a span of the trace (see trace.hpp) with `detail` if tracing is on.
+ */
+class StageTimer {
+ public:
+  explicit StageTimer(const ScanStage stage, const std::string_view detail = {})
+      : m_stage{stage}, m_detail{detail}, m_start{std::chrono::steady_clock::now()} {}
+  ~StageTimer() {
+    const auto end = std::chrono::steady_clock::now();
+    record_duration(m_stage, end - m_start);
+    // Walking is timed for each directory entry, too many tiny spans for the trace
+    if (m_stage != ScanStage::Walk and is_tracing())
+      record_span(to_string(m_stage), m_start, end, m_detail);
+  }
+
+  StageTimer(const StageTimer &)            = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+
+ private:
+  const ScanStage m_stage;
+  const std::string_view m_detail;
+  const std::chrono::steady_clock::time_point m_start;
+};
+
+}  // namespace Utils
+
+}  // namespace Midx
@@ -1,19 +1,32 @@
 #include "./midx.hpp"
 
+#include <algorithm>
 #include <array>
 #include <filesystem>
-#include <fstream>
+#include <limits>
+#include <map>
+#include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <spdlog/spdlog.h>
 
 #include <SQLiteCpp/SQLiteCpp.h>
+#include <SQLiteCpp/Savepoint.h>
+#include <sqlite3.h>
+
+#include <taglib/audioproperties.h>
+#include <taglib/tag.h>
 
-#include <taglib/fileref.h>
-#include <taglib/flacfile.h>
-#include <taglib/mpegfile.h>
-#include <taglib/id3v2tag.h>
-#include <taglib/attachedpictureframe.h>
+#include "./art_store.hpp"
+#include "./formats.hpp"
+#include "./internal.hpp"
+#include "./native_tags.hpp"
+#include "./schema.hpp"
+#include "./statement_cache.hpp"
 
 namespace fs = std::filesystem;
 
@@ -28,90 +41,96 @@ namespace Midx {
 namespace Utils {
 
 /**
- * Checks whether a file is of a supported format.
- * Currently only `.flac` and `.mp3` are supported.
+ * Open a file once to read its metadata and audio properties into `track`.
+ */
+static void read_audio_file(
+    const string &file_path, const ParseOptions &options, ParsedTrack &track
+);
+
+/**
+ * Fill `track` from the tags read by `read_native_tags()`, returns false if TagLib has to be
+ * used instead.
  */
-static bool is_supported_file_type(const string &path);
+static bool read_native_file(
+    const int fd, const AudioFormat format, const string &file_path, const ParseOptions &options,
+    ParsedTrack &track
+);
+
+/**
+ * Get metadata from an opened file, with its album art or where it is depending on
+ * `options.art_mode`.
+ */
+static optional<ParsedMetadata> load_metadata(
+    TagLib::File &file, const AudioFormat format, const string &file_path,
+    const ParseOptions &options
+);
 
 /**
- * Get metadata from a file.
+ * Read the audio properties columns `first` to `first + 4` of a row, `nullopt` if they are null.
  */
-static optional<TrackMetadata> load_metadata(
-    SQLite::Database &db, const TrackId track_id, const string &file_path
+static optional<AudioProperties> get_properties_columns(
+    SQLite::Statement &stmt, const int first, const TrackId track_id
 );
 
 /**
- * Extract album art from FLAC file.
+ * Queries listing whole tables, shared by the `get_all_*()` and `stream_all_*()` functions.
  */
-static optional<TagLib::ByteVector> get_flac_album_art(const string &filename);
+static constexpr const char *all_artists_query = "SELECT id, name FROM t_artists";
+static constexpr const char *all_albums_query  = "SELECT id, name, artist_id FROM t_albums";
+static constexpr const char *all_tracks_query  = R"--(
+  SELECT id, file_path, parent_dir_id, title, track_num, artist_id, album_id,
+         duration_ms, bitrate, sample_rate, channels, codec
+  FROM t_tracks t
+  LEFT JOIN t_tracks_metadata tm ON t.id = tm.track_id
+  LEFT JOIN t_tracks_properties tp ON t.id = tp.track_id
+)--";
 
 /**
- * Extract album art from MP3 file.
+ * Read an artist from a row whose columns are laid out like in `all_artists_query`.
  */
-static optional<TagLib::ByteVector> get_mp3_album_art(const string &filename);
+static Artist get_artist_columns(SQLite::Statement &stmt);
 
 /**
- * Extract album art from tags.
+ * Read an album from a row whose columns are laid out like in `all_albums_query`.
  */
-static optional<TagLib::ByteVector> get_album_art(const string &filename);
+static Album get_album_columns(SQLite::Statement &stmt);
+
+/**
+ * Read a track from a row whose columns are laid out like in `all_tracks_query`.
+ */
+static Track get_track_columns(SQLite::Statement &stmt);
+
+/**
+ * Cursor of a row of `get_tracks_page()`, the sort key of the artist and album orders is the
+ * last column.
+ */
+static PageCursor get_track_cursor(SQLite::Statement &stmt, const TrackOrder order);
+
+/**
+ * Bind the limit of a page query, its last parameter. One more row is fetched to know whether
+ * there is a next page.
+ */
+static void bind_page_limit(SQLite::Statement &stmt, const size_t limit);
 
 /**
  * Insert a TrackMetadata object into the database
  */
 static optional<TrackId> insert_metadata(SQLite::Database &db, const TrackMetadata &tm);
 
+/**
+ * Insert or replace a track's audio properties.
+ */
+static void insert_properties(
+    SQLite::Database &db, const TrackId track_id, const ParsedProperties &properties
+);
+
 }  // namespace Utils
 
 void init_database(SQLite::Database &db) {
   try {
     db.exec("PRAGMA foreign_keys = ON;");
-    // Create music directiries table
-    db.exec(R"--(
-      CREATE TABLE IF NOT EXISTS t_music_dirs (
-        id              INTEGER PRIMARY KEY AUTOINCREMENT,
-        path            TEXT NOT NULL UNIQUE
-      );
-    )--");
-    // Create artists table
-    db.exec(R"--(
-      CREATE TABLE IF NOT EXISTS t_artists (
-        id              INTEGER PRIMARY KEY AUTOINCREMENT,
-        name            TEXT NOT NULL UNIQUE
-      );
-    )--");
-    // Create albums table
-    db.exec(R"--(
-      CREATE TABLE IF NOT EXISTS t_albums (
-        id                         INTEGER PRIMARY KEY AUTOINCREMENT,
-        name                       TEXT NOT NULL,
-        artist_id                  INTEGER,
-        FOREIGN KEY(artist_id)     REFERENCES t_artists(id),
-        CONSTRAINT unique_artist_album UNIQUE (name, artist_id)
-      );
-    )--");
-    // Create tracks table
-    db.exec(R"--(
-      CREATE TABLE IF NOT EXISTS t_tracks (
-        id                         INTEGER PRIMARY KEY AUTOINCREMENT,
-        file_path                  TEXT NOT NULL UNIQUE,
-        parent_dir_id              INTEGER NOT NULL,
-        FOREIGN KEY(parent_dir_id) REFERENCES t_music_dirs(id)
-      );
-    )--");
-
-    // Create tracks' metadata table
-    db.exec(R"--(
-      CREATE TABLE IF NOT EXISTS t_tracks_metadata (
-        track_id                   INTEGER PRIMARY KEY,
-        title                      TEXT NOT NULL,
-        track_num                  INTEGER,
-        artist_id                  INTEGER,
-        album_id                   INTEGER,
-        FOREIGN KEY(track_id)      REFERENCES t_tracks(id),
-        FOREIGN KEY(artist_id)     REFERENCES t_artists(id),
-        FOREIGN KEY(album_id)      REFERENCES t_albums(id)
-      );
-    )--");
+    if (not Utils::migrate_database(db))
+      exit(1);
   } catch (SQLite::Exception &e) {
     spdlog::error("Error initialising the databases: {}", e.what());
     spdlog::error("Code: {}", e.getErrorCode());
@@ -125,10 +144,10 @@ void init_database(SQLite::Database &db) {
  */
 vector<MusicDir> get_all_music_dirs(SQLite::Database &db) {
   vector<MusicDir> res{};
-  SQLite::Statement stmt{db, "SELECT id, path FROM t_music_dirs"};
-  while (stmt.executeStep()) {
-    const MDirId id = stmt.getColumn(0).getUInt();
-    const string dir_name{stmt.getColumn(1).getString()};
+  Utils::CachedStatement stmt{db, "SELECT id, path FROM t_music_dirs"};
+  while (stmt->executeStep()) {
+    const MDirId id = stmt->getColumn(0).getUInt();
+    const string dir_name{stmt->getColumn(1).getString()};
     res.emplace_back(MusicDir{id, std::move(dir_name)});
   }
   return res;
@@ -139,12 +158,9 @@ vector<MusicDir> get_all_music_dirs(SQLite::Database &db) {
  */
 vector<Artist> get_all_artists(SQLite::Database &db) {
   vector<Artist> res{};
-  SQLite::Statement stmt{db, "SELECT id, name FROM t_artists"};
-  while (stmt.executeStep()) {
-    const ArtistId id = stmt.getColumn(0).getUInt();
-    const string artist_name{stmt.getColumn(1).getString()};
-    res.emplace_back(Artist{id, std::move(artist_name)});
-  }
+  Utils::CachedStatement stmt{db, Utils::all_artists_query};
+  while (stmt->executeStep())
+    res.push_back(Utils::get_artist_columns(*stmt));
   return res;
 }
 
@@ -153,166 +169,405 @@ vector<Artist> get_all_artists(SQLite::Database &db) {
  */
 vector<Album> get_all_albums(SQLite::Database &db) {
   vector<Album> res{};
-  SQLite::Statement stmt{db, "SELECT id, name, artist_id FROM t_albums"};
-  while (stmt.executeStep()) {
-    const AlbumId id = stmt.getColumn(0).getUInt();
-    const string album_name{stmt.getColumn(1).getString()};
-    const optional<ArtistId> artist_id =
-        stmt.isColumnNull(2) ? optional<ArtistId>{nullopt} : stmt.getColumn(2).getUInt();
-
-    res.emplace_back(Album{id, std::move(album_name), artist_id});
-  }
+  Utils::CachedStatement stmt{db, Utils::all_albums_query};
+  while (stmt->executeStep())
+    res.push_back(Utils::get_album_columns(*stmt));
   return res;
 }
 
 /**
- * Get all the tracks and their metadata if it exists.
+ * Get all the tracks and their metadata and audio properties if they exist.
  */
 vector<Track> get_all_tracks(SQLite::Database &db) {
   vector<Track> res{};
+  Utils::CachedStatement stmt{db, Utils::all_tracks_query};
+  while (stmt->executeStep())
+    res.push_back(Utils::get_track_columns(*stmt));
+  return res;
+}
 
-  SQLite::Statement stmt{db, R"--(
-    SELECT id, file_path, parent_dir_id, title, track_num, artist_id, album_id
-    FROM t_tracks t
-    LEFT JOIN t_tracks_metadata tm ON t.id = tm.track_id
-  )--"};
-  while (stmt.executeStep()) {
-    const TrackId id = stmt.getColumn(0).getUInt();
-    const string file_path{stmt.getColumn(1).getString()};
-    const MDirId parent_dir_id = stmt.getColumn(2).getUInt();
-    res.emplace_back(Track{id, file_path, parent_dir_id});
-    // Get metadata
-    auto title     = stmt.getColumn(3).getString();
-    auto track_num = stmt.isColumnNull(4) ? nullopt : optional<size_t>(stmt.getColumn(4).getUInt());
-    stmt.getColumn(4);
-    optional<ArtistId> artist_id =
-        stmt.isColumnNull(5) ? nullopt : optional<ArtistId>(stmt.getColumn(5).getUInt());
-    optional<AlbumId> album_id =
-        stmt.isColumnNull(6) ? nullopt : optional<AlbumId>(stmt.getColumn(6).getUInt());
+RowStream<Artist> stream_all_artists(SQLite::Database &db) {
+  return {
+      std::make_unique<SQLite::Statement>(db, Utils::all_artists_query), &Utils::get_artist_columns
+  };
+}
+
+RowStream<Album> stream_all_albums(SQLite::Database &db) {
+  return {
+      std::make_unique<SQLite::Statement>(db, Utils::all_albums_query), &Utils::get_album_columns
+  };
+}
 
-    res.back().update_metadata(TrackMetadata{id, std::move(title), track_num, artist_id, album_id});
+RowStream<Track> stream_all_tracks(SQLite::Database &db) {
+  return {
+      std::make_unique<SQLite::Statement>(db, Utils::all_tracks_query), &Utils::get_track_columns
+  };
+}
+
+Page<Track> get_tracks_page(
+    SQLite::Database &db, const TrackOrder order, const optional<PageCursor> &after,
+    const size_t limit
+) {
+  Page<Track> res{};
+  if (limit == 0)
+    return res;
+  // The artist and album orders start from the artists and albums, their tracks are then read
+  // in order from the indexes.
+  const char *sql = nullptr;
+  switch (order) {
+    case TrackOrder::Title:
+      sql = R"--(
+        SELECT t.id, t.file_path, t.parent_dir_id, tm.title, tm.track_num, tm.artist_id,
+               tm.album_id, tp.duration_ms, tp.bitrate, tp.sample_rate, tp.channels, tp.codec
+        FROM t_tracks_metadata tm
+        JOIN t_tracks t ON t.id = tm.track_id
+        LEFT JOIN t_tracks_properties tp ON tp.track_id = tm.track_id
+        WHERE (tm.title, tm.track_id) > (?1, ?2)
+        ORDER BY tm.title, tm.track_id
+        LIMIT ?3
+      )--";
+      break;
+    case TrackOrder::Artist:
+      sql = R"--(
+        SELECT t.id, t.file_path, t.parent_dir_id, tm.title, tm.track_num, tm.artist_id,
+               tm.album_id, tp.duration_ms, tp.bitrate, tp.sample_rate, tp.channels, tp.codec,
+               ar.name
+        FROM t_artists ar
+        JOIN t_tracks_metadata tm ON tm.artist_id = ar.id
+        JOIN t_tracks t ON t.id = tm.track_id
+        LEFT JOIN t_tracks_properties tp ON tp.track_id = tm.track_id
+        WHERE ar.name >= ?1 AND (ar.name > ?1 OR (tm.title, tm.track_id) > (?2, ?3))
+        ORDER BY ar.name, tm.title, tm.track_id
+        LIMIT ?4
+      )--";
+      break;
+    case TrackOrder::Album:
+      sql = R"--(
+        SELECT t.id, t.file_path, t.parent_dir_id, tm.title, tm.track_num, tm.artist_id,
+               tm.album_id, tp.duration_ms, tp.bitrate, tp.sample_rate, tp.channels, tp.codec,
+               al.name
+        FROM t_albums al
+        JOIN t_tracks_metadata tm ON tm.album_id = al.id
+        JOIN t_tracks t ON t.id = tm.track_id
+        LEFT JOIN t_tracks_properties tp ON tp.track_id = tm.track_id
+        WHERE al.name >= ?1 AND (
+          al.name > ?1 OR al.id > ?2 OR
+          (al.id = ?2 AND (IFNULL(tm.track_num, -1), tm.track_id) > (?3, ?4))
+        )
+        ORDER BY al.name, al.id, IFNULL(tm.track_num, -1), tm.track_id
+        LIMIT ?5
+      )--";
+      break;
+    case TrackOrder::RecentlyAdded:
+      sql = R"--(
+        SELECT t.id, t.file_path, t.parent_dir_id, tm.title, tm.track_num, tm.artist_id,
+               tm.album_id, tp.duration_ms, tp.bitrate, tp.sample_rate, tp.channels, tp.codec
+        FROM t_tracks t
+        LEFT JOIN t_tracks_metadata tm ON tm.track_id = t.id
+        LEFT JOIN t_tracks_properties tp ON tp.track_id = t.id
+        WHERE t.id < ?1
+        ORDER BY t.id DESC
+        LIMIT ?2
+      )--";
+      break;
+  }
+  const PageCursor start = after.value_or(PageCursor{});
+  Utils::CachedStatement stmt{db, sql};
+  switch (order) {
+    case TrackOrder::Title:
+      stmt->bind(1, start.title);
+      stmt->bind(2, start.id);
+      break;
+    case TrackOrder::Artist:
+      stmt->bind(1, start.name);
+      stmt->bind(2, start.title);
+      stmt->bind(3, start.id);
+      break;
+    case TrackOrder::Album:
+      stmt->bind(1, start.name);
+      stmt->bind(2, start.album_id);
+      stmt->bind(3, start.track_number);
+      stmt->bind(4, start.id);
+      break;
+    case TrackOrder::RecentlyAdded:
+      stmt->bind(1, after ? start.id : std::numeric_limits<int64_t>::max());
+      break;
+  }
+  Utils::bind_page_limit(*stmt, limit);
+  optional<PageCursor> last{};
+  while (stmt->executeStep()) {
+    if (res.items.size() == limit) {
+      res.next = std::move(last);
+      break;
+    }
+    res.items.push_back(Utils::get_track_columns(*stmt));
+    if (res.items.size() == limit)
+      last = Utils::get_track_cursor(*stmt, order);
+  }
+  return res;
+}
+
+Page<Album> get_albums_page(
+    SQLite::Database &db, const ListOrder order, const optional<PageCursor> &after,
+    const size_t limit
+) {
+  Page<Album> res{};
+  if (limit == 0)
+    return res;
+  const char *sql = nullptr;
+  switch (order) {
+    case ListOrder::Name:
+      sql = R"--(
+        SELECT id, name, artist_id FROM t_albums
+        WHERE (name, id) > (?1, ?2)
+        ORDER BY name, id
+        LIMIT ?3
+      )--";
+      break;
+    case ListOrder::RecentlyAdded:
+      sql = R"--(
+        SELECT id, name, artist_id FROM t_albums
+        WHERE id < ?1
+        ORDER BY id DESC
+        LIMIT ?2
+      )--";
+      break;
+  }
+  const PageCursor start = after.value_or(PageCursor{});
+  Utils::CachedStatement stmt{db, sql};
+  switch (order) {
+    case ListOrder::Name:
+      stmt->bind(1, start.name);
+      stmt->bind(2, start.id);
+      break;
+    case ListOrder::RecentlyAdded:
+      stmt->bind(1, after ? start.id : std::numeric_limits<int64_t>::max());
+      break;
+  }
+  Utils::bind_page_limit(*stmt, limit);
+  while (stmt->executeStep()) {
+    if (res.items.size() == limit) {
+      const Album &album = res.items.back();
+      res.next.emplace();
+      res.next->name = album.name;
+      res.next->id   = int64_t(album.id);
+      break;
+    }
+    res.items.push_back(Utils::get_album_columns(*stmt));
+  }
+  return res;
+}
+
+Page<Artist> get_artists_page(
+    SQLite::Database &db, const ListOrder order, const optional<PageCursor> &after,
+    const size_t limit
+) {
+  Page<Artist> res{};
+  if (limit == 0)
+    return res;
+  const char *sql = nullptr;
+  switch (order) {
+    case ListOrder::Name:
+      sql = R"--(
+        SELECT id, name FROM t_artists
+        WHERE (name, id) > (?1, ?2)
+        ORDER BY name, id
+        LIMIT ?3
+      )--";
+      break;
+    case ListOrder::RecentlyAdded:
+      sql = R"--(
+        SELECT id, name FROM t_artists
+        WHERE id < ?1
+        ORDER BY id DESC
+        LIMIT ?2
+      )--";
+      break;
+  }
+  const PageCursor start = after.value_or(PageCursor{});
+  Utils::CachedStatement stmt{db, sql};
+  switch (order) {
+    case ListOrder::Name:
+      stmt->bind(1, start.name);
+      stmt->bind(2, start.id);
+      break;
+    case ListOrder::RecentlyAdded:
+      stmt->bind(1, after ? start.id : std::numeric_limits<int64_t>::max());
+      break;
+  }
+  Utils::bind_page_limit(*stmt, limit);
+  while (stmt->executeStep()) {
+    if (res.items.size() == limit) {
+      const Artist &artist = res.items.back();
+      res.next.emplace();
+      res.next->name = artist.name;
+      res.next->id   = int64_t(artist.id);
+      break;
+    }
+    res.items.push_back(Utils::get_artist_columns(*stmt));
   }
   return res;
 }
 
 optional<Artist> get_artist(SQLite::Database &db, const ArtistId id) {
-  SQLite::Statement stmt{db, "SELECT id, name FROM t_artists WHERE id = ?"};
-  stmt.bind(1, uint32_t(id));
-  if (not stmt.executeStep()) {
+  Utils::CachedStatement stmt{db, "SELECT id, name FROM t_artists WHERE id = ?"};
+  stmt->bind(1, uint32_t(id));
+  if (not stmt->executeStep()) {
     return nullopt;
   }
-  return Artist{stmt.getColumn(0).getUInt(), stmt.getColumn(1).getString()};
+  return Artist{stmt->getColumn(0).getUInt(), stmt->getColumn(1).getString()};
 }
 
 optional<Album> get_album(SQLite::Database &db, const AlbumId id) {
-  SQLite::Statement stmt{db, "SELECT id, name, artist_id FROM t_albums WHERE id = ?"};
-  stmt.bind(1, uint32_t(id));
-  if (not stmt.executeStep()) {
+  Utils::CachedStatement stmt{db, "SELECT id, name, artist_id FROM t_albums WHERE id = ?"};
+  stmt->bind(1, uint32_t(id));
+  if (not stmt->executeStep()) {
     return nullopt;
   }
   return Album{
-      stmt.getColumn(0).getUInt(), stmt.getColumn(1).getString(),
-      stmt.isColumnNull(2) ? nullopt : optional<AlbumId>{stmt.getColumn(2).getUInt()}
+      stmt->getColumn(0).getUInt(), stmt->getColumn(1).getString(),
+      stmt->isColumnNull(2) ? nullopt : optional<AlbumId>{stmt->getColumn(2).getUInt()}
   };
 }
 
+optional<Track> get_track(SQLite::Database &db, const TrackId id) {
+  optional<Track> res{};
+  {
+    Utils::CachedStatement stmt{
+        db, "SELECT id, file_path, parent_dir_id FROM t_tracks WHERE id = ?"
+    };
+    stmt->bind(1, uint32_t(id));
+    if (not stmt->executeStep()) {
+      return nullopt;
+    }
+    res.emplace(
+        stmt->getColumn(0).getUInt(), stmt->getColumn(1).getString(), stmt->getColumn(2).getUInt()
+    );
+  }
+  if (auto metadata = get_track_metadata(db, id))
+    res->update_metadata(*metadata);
+  if (auto properties = get_audio_properties(db, id))
+    res->update_properties(*properties);
+  return res;
+}
+
+optional<string> get_album_art_path(SQLite::Database &db, const AlbumId id) {
+  Utils::CachedStatement stmt{db, "SELECT art_hash FROM t_albums_art WHERE album_id = ?"};
+  stmt->bind(1, uint32_t(id));
+  if (not stmt->executeStep()) {
+    return nullopt;
+  }
+  return Utils::get_art_file_path(uint64_t(stmt->getColumn(0).getInt64()));
+}
+
 optional<TrackMetadata> get_track_metadata(SQLite::Database &db, const TrackId id) {
-  SQLite::Statement stmt{
+  Utils::CachedStatement stmt{
       db,
-      "SELECT track_id, title, track_num, artist_id, album_id FROM t_tracks_metadata WHERE id = ?"
+      "SELECT track_id, title, track_num, artist_id, album_id FROM t_tracks_metadata "
+      "WHERE track_id = ?"
   };
-  stmt.bind(1, uint32_t(id));
-  if (not stmt.executeStep()) {
+  stmt->bind(1, uint32_t(id));
+  if (not stmt->executeStep()) {
     return nullopt;
   }
   return TrackMetadata{
-      stmt.getColumn(0).getUInt(), stmt.getColumn(1).getString(),
-      stmt.isColumnNull(2) ? nullopt : optional<size_t>{stmt.getColumn(2).getUInt()},
-      stmt.isColumnNull(3) ? nullopt : optional<ArtistId>{stmt.getColumn(3).getUInt()},
-      stmt.isColumnNull(4) ? nullopt : optional<AlbumId>{stmt.getColumn(4).getUInt()}
+      stmt->getColumn(0).getUInt(), stmt->getColumn(1).getString(),
+      stmt->isColumnNull(2) ? nullopt : optional<size_t>{stmt->getColumn(2).getUInt()},
+      stmt->isColumnNull(3) ? nullopt : optional<ArtistId>{stmt->getColumn(3).getUInt()},
+      stmt->isColumnNull(4) ? nullopt : optional<AlbumId>{stmt->getColumn(4).getUInt()}
   };
 }
 
+optional<AudioProperties> get_audio_properties(SQLite::Database &db, const TrackId id) {
+  Utils::CachedStatement stmt{db, R"--(
+    SELECT duration_ms, bitrate, sample_rate, channels, codec
+    FROM t_tracks_properties WHERE track_id = ?
+  )--"};
+  stmt->bind(1, uint32_t(id));
+  if (not stmt->executeStep()) {
+    return nullopt;
+  }
+  return Utils::get_properties_columns(*stmt, 0, id);
+}
+
 bool is_valid_music_dir_id(SQLite::Database &db, const MDirId id) {
-  SQLite::Statement stmt{db, "SELECT EXISTS(SELECT 1 FROM t_music_dirs WHERE id = ?)"};
-  stmt.bind(1, uint32_t(id));
-  stmt.executeStep();
-  return stmt.getColumn(0).getInt() == 1;
+  Utils::CachedStatement stmt{db, "SELECT EXISTS(SELECT 1 FROM t_music_dirs WHERE id = ?)"};
+  stmt->bind(1, uint32_t(id));
+  stmt->executeStep();
+  return stmt->getColumn(0).getInt() == 1;
 }
 
 bool is_valid_artist_id(SQLite::Database &db, const ArtistId id) {
-  SQLite::Statement stmt{db, "SELECT EXISTS(SELECT 1 FROM t_artists WHERE id = ?)"};
-  stmt.bind(1, uint32_t(id));
-  stmt.executeStep();
-  return stmt.getColumn(0).getInt() == 1;
+  Utils::CachedStatement stmt{db, "SELECT EXISTS(SELECT 1 FROM t_artists WHERE id = ?)"};
+  stmt->bind(1, uint32_t(id));
+  stmt->executeStep();
+  return stmt->getColumn(0).getInt() == 1;
 }
 
 bool is_valid_album_id(SQLite::Database &db, const AlbumId id) {
-  SQLite::Statement stmt{db, "SELECT EXISTS(SELECT 1 FROM t_albums WHERE id = ?)"};
-  stmt.bind(1, uint32_t(id));
-  stmt.executeStep();
-  return stmt.getColumn(0).getInt() == 1;
+  Utils::CachedStatement stmt{db, "SELECT EXISTS(SELECT 1 FROM t_albums WHERE id = ?)"};
+  stmt->bind(1, uint32_t(id));
+  stmt->executeStep();
+  return stmt->getColumn(0).getInt() == 1;
 }
 
 bool is_valid_track_id(SQLite::Database &db, const TrackId id) {
-  SQLite::Statement stmt{db, "SELECT EXISTS(SELECT 1 FROM t_tracks WHERE id = ?)"};
-  stmt.bind(1, uint32_t(id));
-  stmt.executeStep();
-  return stmt.getColumn(0).getInt() == 1;
+  Utils::CachedStatement stmt{db, "SELECT EXISTS(SELECT 1 FROM t_tracks WHERE id = ?)"};
+  stmt->bind(1, uint32_t(id));
+  stmt->executeStep();
+  return stmt->getColumn(0).getInt() == 1;
 }
 
 optional<MDirId> get_music_dir_id(SQLite::Database &db, const string &path) {
-  SQLite::Statement stmt{db, "SELECT id FROM t_music_dirs WHERE path = ?"};
-  stmt.bindNoCopy(1, path);
-  stmt.executeStep();
-  return stmt.hasRow() ? optional<MDirId>{stmt.getColumn(0).getUInt()} : nullopt;
+  Utils::CachedStatement stmt{db, "SELECT id FROM t_music_dirs WHERE path = ?"};
+  stmt->bindNoCopy(1, path);
+  stmt->executeStep();
+  return stmt->hasRow() ? optional<MDirId>{stmt->getColumn(0).getUInt()} : nullopt;
 }
 
 optional<ArtistId> get_artist_id(SQLite::Database &db, const string &name) {
-  SQLite::Statement stmt{db, "SELECT id FROM t_artists WHERE name = ?"};
-  stmt.bindNoCopy(1, name);
-  stmt.executeStep();
-  return stmt.hasRow() ? optional<ArtistId>{stmt.getColumn(0).getUInt()} : nullopt;
+  Utils::CachedStatement stmt{db, "SELECT id FROM t_artists WHERE name = ?"};
+  stmt->bindNoCopy(1, name);
+  stmt->executeStep();
+  return stmt->hasRow() ? optional<ArtistId>{stmt->getColumn(0).getUInt()} : nullopt;
 }
 
 optional<AlbumId> get_album_id(
     SQLite::Database &db, const string &name, const optional<ArtistId> artist_id
 ) {
-  SQLite::Statement stmt{db, "SELECT id FROM t_albums WHERE name = ? AND artist_id = ?"};
-  stmt.bindNoCopy(1, name);
+  Utils::CachedStatement stmt{db, "SELECT id FROM t_albums WHERE name = ? AND artist_id IS ?"};
+  stmt->bindNoCopy(1, name);
   if (artist_id.has_value()) {
-    stmt.bind(2, uint32_t(*artist_id));
+    stmt->bind(2, uint32_t(*artist_id));
   } else
-    stmt.bind(2);
-  stmt.executeStep();
-  return stmt.hasRow() ? optional<AlbumId>{stmt.getColumn(0).getUInt()} : nullopt;
+    stmt->bind(2);
+  stmt->executeStep();
+  return stmt->hasRow() ? optional<AlbumId>{stmt->getColumn(0).getUInt()} : nullopt;
 }
 
 optional<TrackId> get_track_id(SQLite::Database &db, const string &file_path) {
-  SQLite::Statement stmt{db, "SELECT id FROM t_tracks WHERE file_path = ?"};
   const auto abs_path = fs::canonical(file_path);
   if (not abs_path.has_filename()) {
     spdlog::error("File does not exist: {}", abs_path.c_str());
     return nullopt;
   }
-  stmt.bindNoCopy(1, abs_path.c_str());
-  stmt.executeStep();
-  return stmt.hasRow() ? optional<TrackId>{stmt.getColumn(0).getUInt()} : nullopt;
+  return Utils::find_track_id(db, abs_path);
 }
 
 optional<MDirId> insert_music_dir(SQLite::Database &db, const string &path) {
-  if (not fs::exists(path) or not fs::is_directory(path)) {
+  std::error_code ec;
+  const string abs_path = fs::canonical(path, ec);
+  if (ec or not fs::is_directory(abs_path, ec)) {
     spdlog::error("Path doesn't exists or is not a directory: {}", path);
     return nullopt;
   }
-  const string abs_path = fs::canonical(path);
   const auto id         = get_music_dir_id(db, abs_path);
   if (id.has_value()) {
     return id;
   }
-  SQLite::Statement stmt{db, "INSERT OR IGNORE INTO t_music_dirs (id, path) VALUES (NULL, ?)"};
-  stmt.bindNoCopy(1, abs_path);
-  stmt.exec();
+  Utils::CachedStatement stmt{db, "INSERT OR IGNORE INTO t_music_dirs (id, path) VALUES (NULL, ?)"};
+  stmt->bindNoCopy(1, abs_path);
+  stmt->exec();
   return get_music_dir_id(db, abs_path);
 }
 
@@ -321,9 +576,9 @@ optional<ArtistId> insert_artist(SQLite::Database &db, const string &name) {
   if (id.has_value()) {
     return id;
   }
-  SQLite::Statement stmt{db, "INSERT OR IGNORE INTO t_artists (id, name) VALUES (NULL, ?)"};
-  stmt.bindNoCopy(1, name);
-  stmt.exec();
+  Utils::CachedStatement stmt{db, "INSERT OR IGNORE INTO t_artists (id, name) VALUES (NULL, ?)"};
+  stmt->bindNoCopy(1, name);
+  stmt->exec();
   return get_artist_id(db, name);
 }
 
@@ -337,15 +592,15 @@ optional<AlbumId> insert_album(
   if (id.has_value()) {
     return id;
   }
-  SQLite::Statement stmt{
+  Utils::CachedStatement stmt{
       db, "INSERT OR IGNORE INTO t_albums (id, name, artist_id) VALUES (NULL, ?, ?)"
   };
-  stmt.bindNoCopy(1, name);
+  stmt->bindNoCopy(1, name);
   if (artist_id.has_value())
-    stmt.bind(2, uint32_t(*artist_id));
+    stmt->bind(2, uint32_t(*artist_id));
   else
-    stmt.bind(2);
-  stmt.exec();
+    stmt->bind(2);
+  stmt->exec();
 
   return get_album_id(db, name, artist_id);
 }
@@ -361,48 +616,109 @@ optional<TrackId> insert_track(
     spdlog::error("Path doesn't exists or is not a directory: {}", abs_path);
     return nullopt;
   }
-  const auto id = get_track_id(db, abs_path);
+  const auto id = Utils::find_track_id(db, abs_path);
   if (id.has_value()) {
     return id;
   }
-  SQLite::Statement stmt{
-      db, "INSERT OR IGNORE INTO t_tracks (id, file_path, parent_dir_id) VALUES (NULL, ?, ?)"
-  };
-  stmt.bindNoCopy(1, abs_path);
-  stmt.bind(2, uint32_t(*parent_dir_id));
-  stmt.exec();
-  const optional<TrackId> trk_id = get_track_id(db, abs_path);
-  // Metadata
-  optional<TrackMetadata> tm = Utils::load_metadata(db, *trk_id, file_path);
-  if (tm.has_value())
-    Utils::insert_metadata(db, tm.value());
+  const auto track = Utils::parse_track(file_path);
+  if (not track.has_value())
+    return nullopt;
+  Utils::InternTable interned{db, false};
+  const auto stored = Utils::store_track(db, *track, *parent_dir_id, interned);
+  if (not stored.has_value())
+    return nullopt;
+  if (stored->album_id.has_value() and track->metadata and track->metadata->album_art)
+    Utils::store_album_art(db, {{*stored->album_id, *track->metadata->album_art}});
+  return stored->id;
+}
 
-  return trk_id;
+vector<optional<TrackId>> insert_tracks(
+    SQLite::Database &db, std::span<const string> file_paths, const MDirId parent_dir_id
+) {
+  vector<optional<TrackId>> res(file_paths.size(), nullopt);
+  if (not is_valid_music_dir_id(db, parent_dir_id)) {
+    return res;
+  }
+  // Index in `res` of the first occurrence of each file
+  std::unordered_map<string, size_t> first_index{};
+  vector<std::pair<size_t, size_t>> duplicates{};
+  std::map<AlbumId, TagLib::ByteVector> album_art{};
+  try {
+    SQLite::Transaction transaction{db};
+    Utils::InternTable interned{db, false};
+    for (size_t i = 0; i < file_paths.size(); ++i) {
+      std::error_code ec;
+      const string abs_path = fs::canonical(file_paths[i], ec);
+      if (ec or not fs::is_regular_file(abs_path, ec)) {
+        spdlog::error("Path doesn't exists or is not a file: {}", file_paths[i]);
+        continue;
+      }
+      const auto [it, is_new] = first_index.try_emplace(abs_path, i);
+      if (not is_new) {
+        duplicates.emplace_back(i, it->second);
+        continue;
+      }
+      res[i] = Utils::find_track_id(db, abs_path);
+      if (res[i].has_value())
+        continue;
+      const auto track = Utils::parse_track(abs_path);
+      if (not track.has_value())
+        continue;
+      const size_t interned_mark = interned.mark();
+      try {
+        SQLite::Savepoint savepoint{db, "midx_track"};
+        const auto stored = Utils::store_track(db, *track, parent_dir_id, interned);
+        savepoint.release();
+        if (not stored.has_value())
+          continue;
+        res[i] = stored->id;
+        if (stored->album_id.has_value() and track->metadata and track->metadata->album_art)
+          album_art.try_emplace(*stored->album_id, *track->metadata->album_art);
+      } catch (SQLite::Exception &e) {
+        spdlog::error("Failed to insert {}: {}", abs_path, e.what());
+        interned.rollback(interned_mark);
+        // Some errors (e.g. SQLITE_FULL) make SQLite roll back the whole transaction
+        if (sqlite3_get_autocommit(db.getHandle()) != 0) {
+          spdlog::error("Insertion of {} files was rolled back", file_paths.size());
+          interned.rollback(0);
+          return vector<optional<TrackId>>(file_paths.size(), nullopt);
+        }
+      }
+    }
+    transaction.commit();
+  } catch (SQLite::Exception &e) {
+    spdlog::error("Failed to insert {} files: {}", file_paths.size(), e.what());
+    return vector<optional<TrackId>>(file_paths.size(), nullopt);
+  }
+  for (const auto &[i, first] : duplicates)
+    res[i] = res[first];
+  Utils::store_album_art(db, album_art);
+  return res;
 }
 
 bool remove_track(SQLite::Database &db, const TrackId track_id) {
-  SQLite::Statement del_metadata_stmt{db, "DELETE FROM t_tracks_metadata WHERE track_id = ?"};
-  SQLite::Statement stmt{db, "DELETE FROM t_tracks WHERE id = ?"};
+  Utils::CachedStatement del_metadata_stmt{db, "DELETE FROM t_tracks_metadata WHERE track_id = ?"};
+  Utils::CachedStatement stmt{db, "DELETE FROM t_tracks WHERE id = ?"};
 
-  del_metadata_stmt.bind(1, uint32_t(track_id));
-  stmt.bind(1, uint32_t(track_id));
+  del_metadata_stmt->bind(1, uint32_t(track_id));
+  stmt->bind(1, uint32_t(track_id));
 
-  del_metadata_stmt.exec();
-  stmt.exec();
+  del_metadata_stmt->exec();
+  stmt->exec();
 
   return true;
 }
 
 vector<TrackId> get_ids_of_tracks_of_music_dir(SQLite::Database &db, const MDirId mdir_id) {
   vector<TrackId> res{};
-  SQLite::Statement stmt{db, R"--(
+  Utils::CachedStatement stmt{db, R"--(
     SELECT t_tracks.id FROM t_tracks
     JOIN t_music_dirs ON t_tracks.parent_dir_id = t_music_dirs.id
     WHERE t_music_dirs.id = ?;
   )--"};
-  stmt.bind(1, uint32_t(mdir_id));
-  while (stmt.executeStep()) {
-    res.push_back(stmt.getColumn(0).getUInt());
+  stmt->bind(1, uint32_t(mdir_id));
+  while (stmt->executeStep()) {
+    res.push_back(stmt->getColumn(0).getUInt());
   }
   return res;
 }
@@ -419,7 +735,7 @@ bool remove_music_dir(SQLite::Database &db, const string &path) {
     return false;
   }
 
-  SQLite::Statement del_tracks_metadata_stmt = {db, R"--(
+  Utils::CachedStatement del_tracks_metadata_stmt{db, R"--(
     DELETE FROM t_tracks_metadata
     WHERE track_id in (
       SELECT track_id FROM t_tracks_metadata
@@ -427,167 +743,379 @@ bool remove_music_dir(SQLite::Database &db, const string &path) {
       JOIN t_music_dirs ON t_music_dirs.id = t_tracks.parent_dir_id
       WHERE t_music_dirs.id = ?)
   )--"};
-  del_tracks_metadata_stmt.bind(1, uint32_t(*dir_id));
+  del_tracks_metadata_stmt->bind(1, uint32_t(*dir_id));
 
-  SQLite::Statement del_tracks_stmt = {db, R"--(
+  Utils::CachedStatement del_tracks_stmt{db, R"--(
     DELETE FROM t_tracks
     WHERE t_tracks.id IN (
       SELECT t_tracks.id FROM t_tracks
       JOIN t_music_dirs ON t_music_dirs.id = t_tracks.parent_dir_id
       WHERE t_music_dirs.id = ?)
   )--"};
-  del_tracks_stmt.bind(1, uint32_t(*dir_id));
+  del_tracks_stmt->bind(1, uint32_t(*dir_id));
 
-  SQLite::Statement stmt{db, "DELETE FROM t_music_dirs WHERE id = ?"};
-  stmt.bind(1, uint32_t(*dir_id));
+  Utils::CachedStatement stmt{db, "DELETE FROM t_music_dirs WHERE id = ?"};
+  stmt->bind(1, uint32_t(*dir_id));
 
-  del_tracks_metadata_stmt.exec();
-  del_tracks_stmt.exec();
-  stmt.exec();
+  del_tracks_metadata_stmt->exec();
+  del_tracks_stmt->exec();
+  stmt->exec();
   return true;
 }
 
-optional<MDirId> scan_directory(SQLite::Database &db, const string &path) {
-  const string abs_path{fs::canonical(path)};
-  if (not fs::exists(abs_path) or not fs::is_directory(abs_path)) {
-    spdlog::error("Path doesn't exists or is not a directory: {}", path);
-    return nullopt;
-  }
-  const optional<MDirId> id = insert_music_dir(db, abs_path);
-  int i                  = 1;
-  for (const auto &dir_entry : fs::recursive_directory_iterator(abs_path)) {
-    if (dir_entry.is_regular_file() && Utils::is_supported_file_type(dir_entry.path())) {
-      insert_track(db, dir_entry.path(), id);
-      spdlog::info("{} - INSERTED: {}", i, dir_entry.path().c_str());
-      ++i;
-    }
-  }
-  return id;
-}
-
-void build_music_library(SQLite::Database &db) {
-  const auto mdirs = get_all_music_dirs(db);
-  for (const auto &mdir : mdirs)
-    scan_directory(db, mdir.path);
-}
-
 /******************************************************************************/
 /************************** --| Static Functions |-- **************************/
 /******************************************************************************/
 
-static bool Utils::is_supported_file_type(const string &path) {
-  static constexpr std::array<std::string_view, 2> exts{".flac", ".mp3"};
-  return std::ranges::any_of(exts, [&](const auto &ext) { return path.ends_with(ext); });
+bool Utils::is_supported_file_type(const string &path) { return has_audio_extension(path); }
+
+optional<Utils::FileFingerprint> Utils::get_file_fingerprint(const string &path) {
+  struct stat st {};
+  if (::stat(path.c_str(), &st) != 0)
+    return nullopt;
+  return FileFingerprint{
+      st.st_mtim.tv_sec * 1'000'000'000 + st.st_mtim.tv_nsec, st.st_size, st.st_dev, st.st_ino
+  };
 }
 
-static optional<TrackMetadata> Utils::load_metadata(
-    SQLite::Database &db, const TrackId track_id, const string &file_path
+optional<Utils::ParsedTrack> Utils::parse_track(
+    const string &file_path, const ParseOptions &options
 ) {
-  if (not is_valid_track_id(db, track_id))
-    return nullopt;
-  TagLib::FileRef fref{file_path.c_str()};
-  if (fref.isNull() or fref.tag()->isEmpty())
+  std::error_code ec;
+  const string abs_path = fs::canonical(file_path, ec);
+  if (ec) {
+    spdlog::error("Failed to resolve path {}: {}", file_path, ec.message());
     return nullopt;
+  }
+  ParsedTrack track{abs_path, get_file_fingerprint(abs_path), nullopt, nullopt};
+  read_audio_file(file_path, options, track);
+  return track;
+}
 
-  string title;
-  if (not fref.tag()->title().isEmpty())
-    title = fref.tag()->title().to8Bit(true);
-  else
-    title = fs::path{file_path}.filename().replace_extension("");
+optional<Utils::StoredTrack> Utils::store_track(
+    SQLite::Database &db, const ParsedTrack &track, const MDirId parent_dir_id,
+    InternTable &interned
+) {
+  const auto bind_fingerprint = [&](SQLite::Statement &stmt, const int first) {
+    if (track.fingerprint.has_value()) {
+      stmt.bind(first, track.fingerprint->mtime_ns);
+      stmt.bind(first + 1, track.fingerprint->size);
+      stmt.bind(first + 2, int64_t(track.fingerprint->dev));
+      stmt.bind(first + 3, int64_t(track.fingerprint->inode));
+    } else {
+      for (int i = first; i < first + 4; ++i)
+        stmt.bind(i);
+    }
+  };
 
-  optional<size_t> trk_num = fref.tag()->track();
-  if (trk_num.value() == 0)
-    trk_num = nullopt;
+  optional<TrackId> trk_id = find_track_id(db, track.file_path);
+  const bool inserted      = not trk_id.has_value();
+  if (inserted) {
+    Utils::CachedStatement stmt{db, R"--(
+      INSERT OR IGNORE INTO t_tracks (id, file_path, parent_dir_id, mtime_ns, size, dev, inode)
+      VALUES (NULL, ?, ?, ?, ?, ?, ?)
+    )--"};
+    stmt->bindNoCopy(1, track.file_path);
+    stmt->bind(2, uint32_t(parent_dir_id));
+    bind_fingerprint(*stmt, 3);
+    stmt->exec();
+    trk_id = find_track_id(db, track.file_path);
+    if (not trk_id.has_value())
+      return nullopt;
+  } else {
+    Utils::CachedStatement stmt{
+        db, "UPDATE t_tracks SET mtime_ns = ?, size = ?, dev = ?, inode = ? WHERE id = ?"
+    };
+    bind_fingerprint(*stmt, 1);
+    stmt->bind(5, uint32_t(*trk_id));
+    stmt->exec();
+  }
 
-  optional<ArtistId> artist_id = nullopt;
-  if (not fref.tag()->artist().isEmpty()) {
-    const string artist = fref.tag()->artist().to8Bit(true);
-    artist_id           = insert_artist(db, artist);
+  if (track.properties.has_value()) {
+    insert_properties(db, *trk_id, *track.properties);
+  } else if (not inserted) {
+    Utils::CachedStatement stmt{db, "DELETE FROM t_tracks_properties WHERE track_id = ?"};
+    stmt->bind(1, uint32_t(*trk_id));
+    stmt->exec();
   }
 
-  optional<AlbumId> album_id = nullopt;
-  if (not fref.tag()->album().isEmpty()) {
-    const string album = fref.tag()->album().to8Bit(true);
-    album_id           = insert_album(db, album, artist_id);
-  }
-  // Extract album art and store it in a file
-  const string album_art_filename = std::format("{}/{}", data_dir, album_id.value());
-  spdlog::info("{}", album_art_filename);
-  if (not fs::exists(album_art_filename)) {
-    optional<TagLib::ByteVector> pic = get_album_art(file_path);
-    if (pic.has_value()) {
-      std::ofstream album_art_file{album_art_filename};
-      for (const auto b : pic.value()) {
-        album_art_file << b;
-      }
+  if (not track.metadata.has_value()) {
+    // The file lost its tags
+    if (not inserted) {
+      Utils::CachedStatement stmt{db, "DELETE FROM t_tracks_metadata WHERE track_id = ?"};
+      stmt->bind(1, uint32_t(*trk_id));
+      stmt->exec();
     }
+    return StoredTrack{*trk_id, nullopt, inserted};
   }
-  return TrackMetadata(track_id, title, trk_num, artist_id, album_id);
+
+  // Metadata
+  const ParsedMetadata &pm     = *track.metadata;
+  optional<ArtistId> artist_id = nullopt;
+  if (pm.artist.has_value())
+    artist_id = interned.artist_id(*pm.artist);
+
+  optional<AlbumId> album_id = nullopt;
+  if (pm.album.has_value())
+    album_id = interned.album_id(*pm.album, artist_id);
+
+  insert_metadata(db, TrackMetadata{*trk_id, pm.title, pm.track_number, artist_id, album_id});
+  if (album_id.has_value() and pm.album_art_location.has_value())
+    set_embedded_album_art(db, *album_id, *trk_id, *pm.album_art_location);
+  return StoredTrack{*trk_id, album_id, inserted};
 }
 
-static optional<TagLib::ByteVector> Utils::get_flac_album_art(const string &filename) {
-  if (not is_supported_file_type(filename))
-    return nullopt;
+optional<TrackId> Utils::find_track_id(SQLite::Database &db, const string &abs_path) {
+  Utils::CachedStatement stmt{db, "SELECT id FROM t_tracks WHERE file_path = ?"};
+  stmt->bindNoCopy(1, abs_path);
+  stmt->executeStep();
+  return stmt->hasRow() ? optional<TrackId>{stmt->getColumn(0).getUInt()} : nullopt;
+}
 
-  TagLib::FLAC::File f{filename.c_str()};
-  if (not f.isValid() or f.pictureList().isEmpty())
-    return nullopt;
-  return f.pictureList().front()->data();
+static void Utils::read_audio_file(
+    const string &file_path, const ParseOptions &options, ParsedTrack &track
+) {
+  // The extension isn't trusted, the file is opened with the class matching its content
+  const int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  const auto format = sniff_format(make_fd_reader(fd));
+  // Most files are plain FLAC or ID3v2 MP3s, TagLib is only needed for the others and to read
+  // the whole stream when accurate properties are requested
+  const bool read_natively = format.has_value() and options.native_tags and
+                             options.read_style != ReadStyle::Accurate and
+                             read_native_file(fd, *format, file_path, options, track);
+  if (not format.has_value() or read_natively) {
+    close(fd);
+    return;
+  }
+  // Tags, album art and audio properties are read from the same file, TagLib parses it once
+  // through the descriptor that was sniffed rather than opening the path again
+  {
+    FdStream stream{fd, file_path};
+    const auto file = open_audio_file(stream, *format, true, options.read_style);
+    if (file->isValid()) {
+      if (const auto *properties = file->audioProperties(); properties != nullptr) {
+        track.properties = ParsedProperties{
+            size_t(std::max(properties->lengthInMilliseconds(), 0)),
+            size_t(std::max(properties->bitrate(), 0)),
+            size_t(std::max(properties->sampleRate(), 0)),
+            size_t(std::max(properties->channels(), 0)), codec_name(*file, *format)
+        };
+      }
+      track.metadata = load_metadata(*file, *format, file_path, options);
+    }
+  }
+  close(fd);
 }
 
-static optional<TagLib::ByteVector> Utils::get_mp3_album_art(const string &filename) {
-  if (not is_supported_file_type(filename) or not filename.ends_with(".mp3"))
-    return nullopt;
+static bool Utils::read_native_file(
+    const int fd, const AudioFormat format, const string &file_path, const ParseOptions &options,
+    ParsedTrack &track
+) {
+  struct stat st {};
+  if (fstat(fd, &st) != 0)
+    return false;
+  // Reused by each file parsed by the thread
+  thread_local NativeTags tags{};
+  const ReadAt read_at = make_fd_reader(fd);
+  if (not read_native_tags(format, read_at, uint64_t(st.st_size), tags))
+    return false;
 
-  TagLib::MPEG::File f{filename.c_str()};
-  if (not f.isValid() or not f.hasID3v2Tag())
-    return nullopt;
-  auto *tags      = f.ID3v2Tag();
-  auto &framelist = tags->frameList("APIC");
-  if (framelist.isEmpty())
-    return nullopt;
-  auto *pic = static_cast<TagLib::ID3v2::AttachedPictureFrame *>(framelist.front());
-  return pic->picture();
+  track.properties = tags.properties;
+  if (tags.is_empty)
+    return true;
+  ParsedMetadata pm{};
+  if (not tags.title.empty())
+    pm.title = tags.title;
+  else
+    pm.title = fs::path{file_path}.filename().replace_extension("");
+  pm.track_number = tags.track_number;
+  if (not tags.artist.empty())
+    pm.artist = tags.artist;
+  if (not tags.album.empty()) {
+    pm.album = tags.album;
+    AlbumArtClaims *claims = options.art_claims;
+    if (options.art_mode == ArtMode::Lazy) {
+      pm.album_art_location = tags.album_art_location;
+    } else if (tags.album_art_location.has_value() and
+               (claims == nullptr or not claims->is_claimed(pm.artist, *pm.album))) {
+      const ArtLocation &loc = *tags.album_art_location;
+      // The picture must be in the file, a corrupt tag mustn't make the parser allocate more
+      const auto file_size = uint64_t(st.st_size);
+      if (loc.offset > file_size or loc.length > file_size - loc.offset or
+          loc.length > std::numeric_limits<unsigned int>::max())
+        return false;
+      TagLib::ByteVector art(static_cast<unsigned int>(loc.length));
+      if (not read_at(loc.offset, art.size(), art.data()))
+        return false;
+      if (claims == nullptr or claims->claim(pm.artist, *pm.album))
+        pm.album_art = std::move(art);
+    }
+  }
+  track.metadata = std::move(pm);
+  return true;
 }
 
-static optional<TagLib::ByteVector> Utils::get_album_art(const string &filename) {
-  if (not is_supported_file_type(filename))
+static optional<Utils::ParsedMetadata> Utils::load_metadata(
+    TagLib::File &file, const AudioFormat format, const string &file_path,
+    const ParseOptions &options
+) {
+  if (file.tag() == nullptr or file.tag()->isEmpty())
     return nullopt;
-  else if (filename.ends_with(".flac"))
-    return get_flac_album_art(filename);
-  else  // .mp3
-    return get_mp3_album_art(filename);
+  const TagLib::Tag &tag = *file.tag();
+
+  ParsedMetadata pm{};
+  if (not tag.title().isEmpty())
+    pm.title = tag.title().to8Bit(true);
+  else
+    pm.title = fs::path{file_path}.filename().replace_extension("");
+
+  if (tag.track() != 0)
+    pm.track_number = tag.track();
+
+  if (not tag.artist().isEmpty())
+    pm.artist = tag.artist().to8Bit(true);
+
+  if (not tag.album().isEmpty()) {
+    pm.album = tag.album().to8Bit(true);
+    // Album art is stored per album, no need to extract it otherwise
+    const ReadAt read_at = [&file](const uint64_t offset, const size_t size, char *out) {
+      file.seek(long(offset));
+      const TagLib::ByteVector block = file.readBlock(size);
+      if (block.size() != size)
+        return false;
+      std::copy(block.begin(), block.end(), out);
+      return true;
+    };
+    if (options.art_mode == ArtMode::Lazy and
+        locate_embedded_art(format, read_at, pm.album_art_location))
+      return pm;
+    // Another track of the album has its picture
+    AlbumArtClaims *claims = options.art_claims;
+    if (claims != nullptr and claims->is_claimed(pm.artist, *pm.album))
+      return pm;
+    pm.album_art = extract_album_art(file, format);
+    if (pm.album_art.has_value() and claims != nullptr and not claims->claim(pm.artist, *pm.album))
+      pm.album_art = nullopt;
+  }
+  return pm;
 }
 
 static optional<TrackId> Utils::insert_metadata(SQLite::Database &db, const TrackMetadata &tm) {
-  SQLite::Statement stmt{db, R"--(
+  Utils::CachedStatement stmt{db, R"--(
       INSERT OR REPLACE INTO t_tracks_metadata (track_id, title, track_num, artist_id, album_id)
       VALUES (?, ?, ?, ?, ?);
   )--"};
-  stmt.bind(1, uint32_t(tm.track_id));
+  stmt->bind(1, uint32_t(tm.track_id));
   if (tm.title.empty())
-    stmt.bind(2);
+    stmt->bind(2);
   else
-    stmt.bindNoCopy(2, tm.title);
+    stmt->bindNoCopy(2, tm.title);
 
   if (tm.track_number.has_value())
-    stmt.bind(3, uint32_t(*tm.track_number));
+    stmt->bind(3, uint32_t(*tm.track_number));
   else
-    stmt.bind(3);
+    stmt->bind(3);
 
   if (tm.artist_id.has_value())
-    stmt.bind(4, uint32_t(*tm.artist_id));
+    stmt->bind(4, uint32_t(*tm.artist_id));
   else
-    stmt.bind(4);
+    stmt->bind(4);
 
   if (tm.album_id.has_value())
-    stmt.bind(5, uint32_t(*tm.album_id));
+    stmt->bind(5, uint32_t(*tm.album_id));
   else
-    stmt.bind(5);
+    stmt->bind(5);
 
-  stmt.exec();
+  stmt->exec();
 
   return tm.track_id;
 }
 
+static void Utils::insert_properties(
+    SQLite::Database &db, const TrackId track_id, const ParsedProperties &properties
+) {
+  Utils::CachedStatement stmt{db, R"--(
+      INSERT OR REPLACE INTO t_tracks_properties
+        (track_id, duration_ms, bitrate, sample_rate, channels, codec)
+      VALUES (?, ?, ?, ?, ?, ?);
+  )--"};
+  stmt->bind(1, uint32_t(track_id));
+  stmt->bind(2, int64_t(properties.duration_ms));
+  stmt->bind(3, uint32_t(properties.bitrate));
+  stmt->bind(4, uint32_t(properties.sample_rate));
+  stmt->bind(5, uint32_t(properties.channels));
+  stmt->bindNoCopy(6, properties.codec);
+  stmt->exec();
+}
+
+static Artist Utils::get_artist_columns(SQLite::Statement &stmt) {
+  return Artist{stmt.getColumn(0).getUInt(), stmt.getColumn(1).getString()};
+}
+
+static Album Utils::get_album_columns(SQLite::Statement &stmt) {
+  const optional<ArtistId> artist_id =
+      stmt.isColumnNull(2) ? optional<ArtistId>{nullopt} : stmt.getColumn(2).getUInt();
+  return Album{stmt.getColumn(0).getUInt(), stmt.getColumn(1).getString(), artist_id};
+}
+
+static Track Utils::get_track_columns(SQLite::Statement &stmt) {
+  const TrackId id = stmt.getColumn(0).getUInt();
+  Track res{id, stmt.getColumn(1).getString(), stmt.getColumn(2).getUInt()};
+  if (not stmt.isColumnNull(3)) {
+    const optional<size_t> track_num =
+        stmt.isColumnNull(4) ? nullopt : optional<size_t>(stmt.getColumn(4).getUInt());
+    const optional<ArtistId> artist_id =
+        stmt.isColumnNull(5) ? nullopt : optional<ArtistId>(stmt.getColumn(5).getUInt());
+    const optional<AlbumId> album_id =
+        stmt.isColumnNull(6) ? nullopt : optional<AlbumId>(stmt.getColumn(6).getUInt());
+    res.update_metadata(
+        TrackMetadata{id, stmt.getColumn(3).getString(), track_num, artist_id, album_id}
+    );
+  }
+  if (auto properties = get_properties_columns(stmt, 7, id))
+    res.update_properties(*properties);
+  return res;
+}
+
+static void Utils::bind_page_limit(SQLite::Statement &stmt, const size_t limit) {
+  const auto max = size_t(std::numeric_limits<int64_t>::max() - 1);
+  stmt.bind(stmt.getBindParameterCount(), int64_t(std::min(limit, max)) + 1);
+}
+
+static PageCursor Utils::get_track_cursor(SQLite::Statement &stmt, const TrackOrder order) {
+  PageCursor res{};
+  res.id = stmt.getColumn(0).getInt64();
+  switch (order) {
+    case TrackOrder::Title:
+      res.title = stmt.getColumn(3).getString();
+      break;
+    case TrackOrder::Artist:
+      res.name  = stmt.getColumn(12).getString();
+      res.title = stmt.getColumn(3).getString();
+      break;
+    case TrackOrder::Album:
+      res.name         = stmt.getColumn(12).getString();
+      res.album_id     = stmt.getColumn(6).getInt64();
+      res.track_number = stmt.isColumnNull(4) ? -1 : stmt.getColumn(4).getInt64();
+      break;
+    case TrackOrder::RecentlyAdded:
+      break;
+  }
+  return res;
+}
+
+static optional<AudioProperties> Utils::get_properties_columns(
+    SQLite::Statement &stmt, const int first, const TrackId track_id
+) {
+  if (stmt.isColumnNull(first))
+    return nullopt;
+  return AudioProperties{
+      track_id, size_t(stmt.getColumn(first).getInt64()), stmt.getColumn(first + 1).getUInt(),
+      stmt.getColumn(first + 2).getUInt(), stmt.getColumn(first + 3).getUInt(),
+      stmt.getColumn(first + 4).getString()
+  };
+}
+
 }  // namespace Midx
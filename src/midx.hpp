@@ -1,10 +1,21 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include <SQLiteCpp/SQLiteCpp.h>
 
+#include "./album_art.hpp"
+#include "./metrics.hpp"
+#include "./row_stream.hpp"
 #include "./utils.hpp"
 
 namespace Midx {
@@ -20,13 +31,15 @@ namespace Midx {
  *
  * @todo modify default value to work on other platforms.
  *
- * Album art is stored in the file `Midx::data_dir/id_of_corresponding_album`.
+ * Album art is stored in `Midx::data_dir/art`, one file per distinct picture named after the
+ * hash of its content, use `Midx::get_album_art_path()` to find an album's picture.
  */
 inline std::string data_dir;
 
 /**
- * Initialise database and tables, this function also enables foreign keys check so it is
- * preferred to call it before any operations are done.
+ * Initialise database and tables, or upgrade the ones made by an older version in place. This
+ * function also enables foreign keys check so it is preferred to call it before any operations
+ * are done.
  */
 void init_database(SQLite::Database &db);
 
@@ -35,10 +48,64 @@ std::vector<Artist> get_all_artists(SQLite::Database &db);
 std::vector<Album> get_all_albums(SQLite::Database &db);
 std::vector<Track> get_all_tracks(SQLite::Database &db);
 
+/**
+ * Like the `get_all_*()` functions, the rows are read one at a time while the stream is
+ * iterated instead of all at once (see `RowStream`).
+ */
+RowStream<Artist> stream_all_artists(SQLite::Database &db);
+RowStream<Album> stream_all_albums(SQLite::Database &db);
+RowStream<Track> stream_all_tracks(SQLite::Database &db);
+
+/**
+ * At most `limit` tracks, with their metadata and audio properties, in `order` starting after
+ * `after` (from the beginning if it's `nullopt`).
+ */
+Page<Track> get_tracks_page(
+    SQLite::Database &db, const TrackOrder order,
+    const std::optional<PageCursor> &after = std::nullopt, const size_t limit = 100
+);
+/**
+ * Like `get_tracks_page()`, for albums.
+ */
+Page<Album> get_albums_page(
+    SQLite::Database &db, const ListOrder order,
+    const std::optional<PageCursor> &after = std::nullopt, const size_t limit = 100
+);
+/**
+ * Like `get_tracks_page()`, for artists.
+ */
+Page<Artist> get_artists_page(
+    SQLite::Database &db, const ListOrder order,
+    const std::optional<PageCursor> &after = std::nullopt, const size_t limit = 100
+);
+
 std::optional<Artist> get_artist(SQLite::Database &db, const ArtistId id);
 std::optional<Album> get_album(SQLite::Database &db, const AlbumId id);
 std::optional<Track> get_track(SQLite::Database &db, const TrackId id);
 std::optional<TrackMetadata> get_track_metadata(SQLite::Database &db, const TrackId id);
+/**
+ * Duration, bitrate... of a track, as read when the file was indexed.
+ */
+std::optional<AudioProperties> get_audio_properties(SQLite::Database &db, const TrackId id);
+
+/**
+ * Path of the album's picture, albums sharing a cover share the file.
+ */
+std::optional<std::string> get_album_art_path(SQLite::Database &db, const AlbumId id);
+
+/**
+ * The album's picture, mapped from the audio file it's embedded in if it was stored lazily
+ * (`ArtMode::Lazy`), from `Midx::data_dir` otherwise.
+ */
+std::optional<AlbumArt> get_album_art(SQLite::Database &db, const AlbumId id);
+
+/**
+ * Ids of the tracks whose title, artist or album contain words starting with each word of
+ * `query`, ignoring case and accents, best matches first.
+ */
+std::vector<TrackId> search(
+    SQLite::Database &db, const std::string &query, const size_t limit = 50
+);
 
 bool is_valid_music_dir_id(SQLite::Database &db, const MDirId id);
 bool is_valid_artist_id(SQLite::Database &db, const ArtistId id);
@@ -61,6 +128,15 @@ std::optional<TrackId> insert_track(
     SQLite::Database &db, const std::string &file_path, const std::optional<MDirId> parent_dir_id
 );
 
+/**
+ * Insert many tracks of the same music directory in one transaction.
+ * Returns the Ids in the same order as `file_paths`, `nullopt` for the files that couldn't be
+ * inserted. Like `insert_track()`, tracks already in the database are not parsed again.
+ */
+std::vector<std::optional<TrackId>> insert_tracks(
+    SQLite::Database &db, std::span<const std::string> file_paths, const MDirId parent_dir_id
+);
+
 /**
  * Delete a track (and its metadata) from the database.
  */
@@ -76,16 +152,151 @@ std::vector<TrackId> get_ids_of_tracks_of_music_dir(SQLite::Database &db, const
  */
 bool remove_music_dir(SQLite::Database &db, const std::string &path);
 
+/**
+ * What a scan is doing.
+ */
+enum class ScanPhase {
+  /**
+   * Counting the files to scan, to estimate how long it will take.
+   */
+  Counting,
+  /**
+   * Reading and writing the new and changed files.
+   */
+  Scanning,
+  /**
+   * Removing the tracks whose file is gone.
+   */
+  Removing,
+  Done,
+};
+
+/**
+ * How far a scan of a music directory is, see `ScanOptions::on_progress`.
+ */
+struct ScanProgress {
+  std::string path;
+  ScanPhase phase = ScanPhase::Counting;
+  /**
+   * Supported files under `path` counted before scanning, changed or not.
+   */
+  size_t n_files = 0;
+  /**
+   * Supported files walked so far, changed or not.
+   */
+  size_t n_seen = 0;
+  /**
+   * New and changed files whose tags were read.
+   */
+  size_t n_parsed = 0;
+  /**
+   * Files written to the database, the last batch may not be committed yet.
+   */
+  size_t n_written = 0;
+  /**
+   * Size of the files whose tags were read.
+   */
+  uint64_t n_bytes = 0;
+  /**
+   * Time left if the remaining files go as fast as the ones seen so far, `nullopt` until a
+   * file was seen.
+   */
+  std::optional<std::chrono::milliseconds> eta = std::nullopt;
+};
+
+/**
+ * Options controlling how directories are scanned.
+ */
+struct ScanOptions {
+  /**
+   * Number of threads reading tags. With `0` everything runs serially in the calling thread,
+   * otherwise one thread walks the directory, `n_workers` threads parse the files and the
+   * calling thread is the only one writing to the database.
+   */
+  size_t n_workers = std::max(1u, std::thread::hardware_concurrency());
+  /**
+   * Maximum number of files waiting between two stages of the pipeline, and of parsed files
+   * waiting for an earlier one to be written.
+   */
+  size_t queue_capacity = 256;
+  /**
+   * Number of files written per transaction.
+   */
+  size_t batch_size = 500;
+  /**
+   * Maximum time a transaction is kept open, checked after each file. A batch is committed
+   * as soon as either limit is reached, if the commit fails only that batch is lost.
+   */
+  std::chrono::milliseconds batch_interval{1000};
+  ArtMode art_mode = ArtMode::Eager;
+  /**
+   * How thoroughly audio properties (duration, bitrate...) are read.
+   */
+  ReadStyle read_style = ReadStyle::Average;
+  /**
+   * Called by the thread running the scan when the phase changes and at most every
+   * `progress_interval` in between. The files are only counted beforehand if it's set.
+   */
+  std::function<void(const ScanProgress &)> on_progress{};
+  std::chrono::milliseconds progress_interval{100};
+  /**
+   * Once a stop is requested the files already written are committed and the scan returns,
+   * tracks whose file wasn't found are kept since the walk didn't finish.
+   * `build_music_library()` doesn't scan the remaining directories.
+   */
+  std::stop_token stop_token{};
+};
+
+/**
+ * What a scan did to a music directory.
+ */
+struct ScanReport {
+  MDirId mdir_id;
+  /**
+   * Files that were not in the database.
+   */
+  size_t n_new = 0;
+  /**
+   * Files whose modification time, size or inode changed since they were stored.
+   */
+  size_t n_updated = 0;
+  /**
+   * Unchanged files, their tags were not read.
+   */
+  size_t n_skipped = 0;
+  /**
+   * Files that couldn't be read or written.
+   */
+  size_t n_failed = 0;
+  /**
+   * Tracks whose file no longer exists, they were removed along with their metadata.
+   */
+  std::vector<TrackId> removed_ids{};
+  /**
+   * The new and updated tracks.
+   */
+  std::vector<TrackId> changed_ids{};
+  /**
+   * The scan was stopped through `ScanOptions::stop_token`.
+   */
+  bool cancelled = false;
+};
+
 /**
  * Recursively scan a directory given its relative or absolute path.
- * Returns its Id.
+ * Files already in the database are only parsed again if they changed since the last scan,
+ * tracks whose file wasn't found are removed (unless the directory couldn't be fully walked).
+ * Returns what was done, including the directory's Id.
  */
-std::optional<MDirId> scan_directory(SQLite::Database &db, const std::string &path);
+std::optional<ScanReport> scan_directory(
+    SQLite::Database &db, const std::string &path, const ScanOptions &options = {}
+);
 
 /**
  * Scan all directories present in the database and add all the existing tracks,
  * artists...
+ * Returns one report per directory.
  */
-void build_music_library(SQLite::Database &db);
+std::vector<ScanReport> build_music_library(SQLite::Database &db, const ScanOptions &options = {});
 
 }  // namespace Midx
@@ -1,15 +1,178 @@
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <unordered_map>
+
+#include <pybind11/chrono.h>
+#include <pybind11/functional.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
 namespace py = pybind11;
 
+#include "./library_view.hpp"
 #include "./midx.hpp"
+#include "./watcher.hpp"
+
+using Midx::AlbumId;
+using Midx::ArtistId;
+using Midx::MDirId;
+using Midx::TrackId;
+
+/**
+ * Bound functions release the GIL, so Python threads sharing a connection can call them at the
+ * same time, which SQLiteCpp's `Database` isn't made for: a scan's transaction would also take
+ * in the writes of another thread. Calls are serialized per connection with this mutex, it's
+ * recursive so that Python code called back from a locked call can use the same connection.
+ */
+static std::mutex connection_mutexes_mutex;
+static std::unordered_map<sqlite3 *, std::unique_ptr<std::recursive_mutex>> connection_mutexes;
+
+static std::recursive_mutex &connection_mutex(sqlite3 *handle) {
+  std::lock_guard lock{connection_mutexes_mutex};
+  auto &mutex = connection_mutexes[handle];
+  if (not mutex)
+    mutex = std::make_unique<std::recursive_mutex>();
+  return *mutex;
+}
+
+static void forget_connection_mutex(sqlite3 *handle) {
+  std::lock_guard lock{connection_mutexes_mutex};
+  connection_mutexes.erase(handle);
+}
+
+/**
+ * `Locked<&f>::call` calls `f(db, args...)` holding `db`'s connection mutex.
+ */
+template <auto function, typename = decltype(function)>
+struct Locked;
+
+template <auto function, typename R, typename... Args>
+struct Locked<function, R (*)(SQLite::Database &, Args...)> {
+  static R call(SQLite::Database &db, Args... args) {
+    std::lock_guard lock{connection_mutex(db.getHandle())};
+    return function(db, std::forward<Args>(args)...);
+  }
+};
+
+template <auto function>
+static constexpr auto locked = &Locked<function>::call;
+
+/**
+ * A `RowStream<T>` and the connection its statement belongs to, which is locked while stepping.
+ */
+template <typename T>
+struct LockedRowStream {
+  Midx::RowStream<T> stream;
+  sqlite3 *connection;
+};
+
+/**
+ * Bind `stream(db)` as a function returning a Python iterator over its rows.
+ */
+template <typename T>
+static void bind_row_stream(
+    py::module_ &handle, const char *class_name, const char *function_name,
+    Midx::RowStream<T> (*const stream)(SQLite::Database &), const char *doc = ""
+) {
+  using Stream = LockedRowStream<T>;
+  py::class_<Stream>(
+      handle, class_name,
+      "Iterator over rows read one at a time from the database, it can only be iterated once.")
+      .def("__iter__", [](Stream &s) -> Stream & { return s; })
+      .def("__next__", [](Stream &s) {
+        bool has_row = false;
+        {
+          py::gil_scoped_release release{};
+          std::lock_guard lock{connection_mutex(s.connection)};
+          has_row = s.stream.step();
+        }
+        if (not has_row)
+          throw py::stop_iteration();
+        return s.stream.current();
+      });
+  // The stream keeps the database alive
+  handle.def(
+      function_name,
+      [stream](SQLite::Database &db) {
+        std::lock_guard lock{connection_mutex(db.getHandle())};
+        return Stream{stream(db), db.getHandle()};
+      },
+      doc, py::keep_alive<0, 1>(), py::call_guard<py::gil_scoped_release>());
+}
+
+/**
+ * A column of a `LibrarySnapshot` exposed through the buffer protocol without copying it, the
+ * snapshot lives as long as the column or the arrays made from it. String columns are
+ * `(offset, size)` pairs of uint32 into the snapshot's `strings`.
+ */
+struct SnapshotColumn {
+  std::shared_ptr<const Midx::LibrarySnapshot> snapshot;
+  const void *data;
+  py::ssize_t n_rows;
+  py::ssize_t item_size;
+  std::string format;
+  /**
+   * 2 for string columns.
+   */
+  py::ssize_t n_fields = 1;
+};
+
+static SnapshotColumn make_column(
+    const std::shared_ptr<const Midx::LibrarySnapshot> &snap, const std::span<const uint32_t> rows
+) {
+  return {snap, rows.data(), py::ssize_t(rows.size()), sizeof(uint32_t),
+          py::format_descriptor<uint32_t>::format()};
+}
+
+static SnapshotColumn make_column(
+    const std::shared_ptr<const Midx::LibrarySnapshot> &snap,
+    const std::vector<Midx::LibrarySnapshot::StringRef> &refs
+) {
+  static_assert(sizeof(Midx::LibrarySnapshot::StringRef) == 2 * sizeof(uint32_t));
+  return {snap, refs.data(), py::ssize_t(refs.size()), sizeof(uint32_t),
+          py::format_descriptor<uint32_t>::format(), 2};
+}
+
+/**
+ * The columns of a row of a `LibrarySnapshot`'s tracks, names of artists and albums included.
+ */
+static py::dict snapshot_track(const Midx::LibrarySnapshot &snap, const uint32_t row) {
+  using Snapshot = Midx::LibrarySnapshot;
+  if (row >= snap.n_tracks())
+    throw py::index_error();
+  const auto value = [](const uint32_t n) {
+    return n == Snapshot::none ? std::nullopt : std::optional<uint32_t>{n};
+  };
+  const auto str = [&](const Snapshot::StringRef ref) {
+    return ref.offset == Snapshot::none ? std::nullopt
+                                        : std::optional<std::string_view>{snap.str(ref)};
+  };
+  const auto &tracks        = snap.tracks;
+  const uint32_t artist_row = snap.artist_row(tracks.artist_id[row]);
+  const uint32_t album_row  = snap.album_row(tracks.album_id[row]);
+  py::dict res{};
+  res["id"]           = tracks.id[row];
+  res["music_dir_id"] = tracks.music_dir_id[row];
+  res["file_path"]    = snap.str(tracks.file_path[row]);
+  res["title"]        = str(tracks.title[row]);
+  res["track_number"] = value(tracks.track_number[row]);
+  res["artist"] =
+      str(artist_row == Snapshot::none ? Snapshot::StringRef{} : snap.artists.name[artist_row]);
+  res["album"] =
+      str(album_row == Snapshot::none ? Snapshot::StringRef{} : snap.albums.name[album_row]);
+  res["duration_ms"] = value(tracks.duration_ms[row]);
+  return res;
+}
 
 PYBIND11_MODULE(midx, handle) {
   handle.doc() =
       "Library to index music files and their metadata, with the intention to be used as a backend "
       "for a music player.";
 
+  // Every call using a connection releases the GIL while it holds the connection's mutex
+  const py::call_guard<py::gil_scoped_release> release_gil{};
+
   // Global variables
   handle.attr("SQLite_OPEN_READWRITE") = &SQLite::OPEN_READWRITE;
   handle.attr("SQLite_OPEN_READONLY")  = &SQLite::OPEN_READONLY;
@@ -17,7 +180,16 @@ PYBIND11_MODULE(midx, handle) {
   // TODO: find some way to define docstring for global variable
   handle.attr("DATA_DIR") = &Midx::data_dir;
 
-  py::class_<SQLite::Database>(handle, "SQLiteDB").def(py::init<char *, int>());
+  // The connection's lock is only needed while it's open
+  struct DatabaseDeleter {
+    void operator()(SQLite::Database *db) const {
+      forget_connection_mutex(db->getHandle());
+      delete db;
+    }
+  };
+  py::class_<SQLite::Database, std::unique_ptr<SQLite::Database, DatabaseDeleter>>(
+      handle, "SQLiteDB")
+      .def(py::init<char *, int>());
 
   py::class_<Midx::MusicDir>(handle, "MusicDir")
       .def(py::init<const MDirId, const std::string &>())
@@ -66,61 +238,450 @@ PYBIND11_MODULE(midx, handle) {
                ")";
       });
 
+  py::class_<Midx::AudioProperties>(
+      handle, "AudioProperties", "Represents a track's audio properties, read when it was indexed.")
+      .def(py::init<const TrackId, const size_t, const size_t, const size_t, const size_t,
+                    const std::string &>(),
+           py::arg("track_id_"), py::arg("duration_ms_"), py::arg("bitrate_"),
+           py::arg("sample_rate_"), py::arg("channels_"), py::arg("codec_"))
+      .def_readonly("track_id", &Midx::AudioProperties::track_id)
+      .def_readonly("duration_ms", &Midx::AudioProperties::duration_ms)
+      .def_readonly("bitrate", &Midx::AudioProperties::bitrate, "Average bitrate in kb/s.")
+      .def_readonly("sample_rate", &Midx::AudioProperties::sample_rate, "Sample rate in Hz.")
+      .def_readonly("channels", &Midx::AudioProperties::channels)
+      .def_readonly("codec", &Midx::AudioProperties::codec)
+      .def("__str__", [&](Midx::AudioProperties &ap) {
+        return "AudioProperties(track_id=" + std::to_string(ap.track_id) +
+               ", duration_ms=" + std::to_string(ap.duration_ms) +
+               ", bitrate=" + std::to_string(ap.bitrate) +
+               ", sample_rate=" + std::to_string(ap.sample_rate) +
+               ", channels=" + std::to_string(ap.channels) + ", codec='" + ap.codec + "')";
+      });
+
   py::class_<Midx::Track>(handle, "Track")
       .def(py::init<const TrackId, const std::string &, const MDirId>(),
-           "The constructor, it does not initialise the `metadata` field, call "
-           "`Track::update_metadata()` for that.")
+           "The constructor, it does not initialise the `metadata` and `properties` fields, call "
+           "`Track::update_metadata()` and `Track::update_properties()` for that.")
       .def("update_metadata", &Midx::Track::update_metadata)
+      .def("update_properties", &Midx::Track::update_properties)
       .def_readonly("id", &Midx::Track::id)
       .def_readonly("file_path", &Midx::Track::file_path)
       .def_readonly("parent_dir_id", &Midx::Track::parent_dir_id)
+      .def_property_readonly("metadata", &Midx::Track::get_metadata)
+      .def_property_readonly("properties", &Midx::Track::get_properties)
       .def("__str__", [&](Midx::Track &t) {
         return "Track(id=" + std::to_string(t.id) + ", file_path='" + t.file_path +
                "', parent_dir_id=" + std::to_string(t.parent_dir_id) +
-               ", track_metadata?=" + (t.get_metadata() ? "True" : "None") + ")";
+               ", track_metadata?=" + (t.get_metadata() ? "True" : "None") +
+               ", properties?=" + (t.get_properties() ? "True" : "None") + ")";
+      });
+
+  py::enum_<Midx::ArtMode>(handle, "ArtMode", "How scans handle album art.")
+      .value("Eager", Midx::ArtMode::Eager, "Pictures are copied to DATA_DIR while scanning.")
+      .value("Lazy", Midx::ArtMode::Lazy,
+             "Only where the picture is in the audio file is stored, it's read when requested.");
+
+  py::enum_<Midx::ReadStyle>(
+      handle, "ReadStyle", "How much of a file is read to find its audio properties.")
+      .value("Fast", Midx::ReadStyle::Fast)
+      .value("Average", Midx::ReadStyle::Average)
+      .value("Accurate", Midx::ReadStyle::Accurate);
+
+  py::enum_<Midx::TrackOrder>(handle, "TrackOrder", "Orders tracks can be listed in.")
+      .value("Title", Midx::TrackOrder::Title, "Tracks without metadata are not listed.")
+      .value("Artist", Midx::TrackOrder::Artist,
+             "By artist then title, tracks without an artist are not listed.")
+      .value("Album", Midx::TrackOrder::Album,
+             "By album then track number, tracks without an album are not listed.")
+      .value("RecentlyAdded", Midx::TrackOrder::RecentlyAdded);
+
+  py::enum_<Midx::ListOrder>(handle, "ListOrder", "Orders artists and albums can be listed in.")
+      .value("Name", Midx::ListOrder::Name)
+      .value("RecentlyAdded", Midx::ListOrder::RecentlyAdded);
+
+  py::class_<Midx::PageCursor>(
+      handle, "PageCursor",
+      "Where a page ended, pass it to get the next page with the same order.")
+      .def_readonly("name", &Midx::PageCursor::name)
+      .def_readonly("title", &Midx::PageCursor::title)
+      .def_readonly("album_id", &Midx::PageCursor::album_id)
+      .def_readonly("track_number", &Midx::PageCursor::track_number)
+      .def_readonly("id", &Midx::PageCursor::id);
+
+  py::class_<Midx::Page<Midx::Track>>(handle, "TrackPage")
+      .def_readonly("items", &Midx::Page<Midx::Track>::items)
+      .def_readonly("next", &Midx::Page<Midx::Track>::next, "None on the last page.");
+  py::class_<Midx::Page<Midx::Album>>(handle, "AlbumPage")
+      .def_readonly("items", &Midx::Page<Midx::Album>::items)
+      .def_readonly("next", &Midx::Page<Midx::Album>::next, "None on the last page.");
+  py::class_<Midx::Page<Midx::Artist>>(handle, "ArtistPage")
+      .def_readonly("items", &Midx::Page<Midx::Artist>::items)
+      .def_readonly("next", &Midx::Page<Midx::Artist>::next, "None on the last page.");
+
+  py::class_<Midx::AlbumArt>(
+      handle, "AlbumArt",
+      "Read-only view of an album's picture, supports the buffer protocol (e.g. "
+      "`memoryview(art)` or `bytes(art)`) without copying.",
+      py::buffer_protocol())
+      .def_buffer([](Midx::AlbumArt &art) {
+        return py::buffer_info(
+            const_cast<std::byte *>(art.data().data()), 1,
+            py::format_descriptor<uint8_t>::format(), 1, {py::ssize_t(art.size())}, {1}, true);
+      })
+      .def("__len__", &Midx::AlbumArt::size)
+      .def_property_readonly("mime_type", &Midx::AlbumArt::mime_type,
+                             "MIME type of the picture, empty if unknown.");
+
+  py::enum_<Midx::ScanPhase>(handle, "ScanPhase", "What a scan is doing.")
+      .value("Counting", Midx::ScanPhase::Counting,
+             "Counting the files to scan, to estimate how long it will take.")
+      .value("Scanning", Midx::ScanPhase::Scanning)
+      .value("Removing", Midx::ScanPhase::Removing, "Removing the tracks whose file is gone.")
+      .value("Done", Midx::ScanPhase::Done);
+
+  py::class_<Midx::ScanProgress>(handle, "ScanProgress", "How far a scan of a music directory is.")
+      .def_readonly("path", &Midx::ScanProgress::path)
+      .def_readonly("phase", &Midx::ScanProgress::phase)
+      .def_readonly("n_files", &Midx::ScanProgress::n_files,
+                    "Supported files counted before scanning, changed or not.")
+      .def_readonly("n_seen", &Midx::ScanProgress::n_seen)
+      .def_readonly("n_parsed", &Midx::ScanProgress::n_parsed)
+      .def_readonly("n_written", &Midx::ScanProgress::n_written)
+      .def_readonly("n_bytes", &Midx::ScanProgress::n_bytes)
+      .def_readonly("eta", &Midx::ScanProgress::eta,
+                    "Estimated time left (a timedelta), None until a file was seen.");
+
+  py::class_<std::stop_source>(
+      handle, "CancelHandle",
+      "Stops the scans given it through `ScanOptions.cancel_handle`, from any thread.")
+      .def(py::init<>())
+      .def("cancel", &std::stop_source::request_stop)
+      .def("is_cancelled", &std::stop_source::stop_requested);
+
+  py::enum_<Midx::ScanStage>(handle, "ScanStage", "Timed parts of a scan.")
+      .value("Walk", Midx::ScanStage::Walk)
+      .value("Stat", Midx::ScanStage::Stat, "Checking if a file already stored changed.")
+      .value("Parse", Midx::ScanStage::Parse)
+      .value("ArtWrite", Midx::ScanStage::ArtWrite)
+      .value("DbInsert", Midx::ScanStage::DbInsert)
+      .value("Commit", Midx::ScanStage::Commit);
+
+  py::enum_<Midx::ScanCounter>(handle, "ScanCounter")
+      .value("FilesSeen", Midx::ScanCounter::FilesSeen)
+      .value("FilesSkipped", Midx::ScanCounter::FilesSkipped)
+      .value("FilesParsed", Midx::ScanCounter::FilesParsed)
+      .value("ParseFailures", Midx::ScanCounter::ParseFailures)
+      .value("BytesParsed", Midx::ScanCounter::BytesParsed)
+      .value("TracksWritten", Midx::ScanCounter::TracksWritten)
+      .value("WriteFailures", Midx::ScanCounter::WriteFailures)
+      .value("BatchesCommitted", Midx::ScanCounter::BatchesCommitted)
+      .value("BatchesRolledBack", Midx::ScanCounter::BatchesRolledBack);
+
+  py::class_<Midx::StageMetrics>(handle, "StageMetrics")
+      .def_readonly("count", &Midx::StageMetrics::count)
+      .def_readonly("total", &Midx::StageMetrics::total, "Time spent in the stage (a timedelta).")
+      .def_readonly("histogram", &Midx::StageMetrics::histogram,
+                    "Bucket i counts the durations shorter than 2^i microseconds that are not in "
+                    "a previous bucket, the last one counts the longer ones too.");
+
+  py::class_<Midx::Metrics>(
+      handle, "Metrics", "What the scans did since the start or the last `reset_metrics()`.")
+      .def("stage", &Midx::Metrics::stage)
+      .def("counter", &Midx::Metrics::counter)
+      .def("to_prometheus", &Midx::Metrics::to_prometheus)
+      .def("to_json", &Midx::Metrics::to_json);
+
+  handle.def("metrics", &Midx::metrics);
+  handle.def("reset_metrics", &Midx::reset_metrics);
+
+  handle.def("start_tracing", &Midx::start_tracing,
+             "Start recording the spans of the scans, in a ring buffer of `events_per_thread` "
+             "events per thread. Not to be called while a scan is running.",
+             py::arg("events_per_thread") = 1 << 15);
+  handle.def("stop_tracing", &Midx::stop_tracing,
+             "Stop recording and write the spans to `path` as Chrome trace JSON (opened by "
+             "Perfetto), returns False if it couldn't be written.",
+             py::arg("path"), release_gil);
+
+  py::class_<Midx::ScanOptions>(
+      handle, "ScanOptions", "Options controlling how directories are scanned.")
+      .def(py::init<>())
+      .def_readwrite("n_workers", &Midx::ScanOptions::n_workers,
+                     "Number of threads reading tags, 0 scans serially in the calling thread.")
+      .def_readwrite("queue_capacity", &Midx::ScanOptions::queue_capacity,
+                     "Maximum number of files waiting between two stages of the pipeline.")
+      .def_readwrite("batch_size", &Midx::ScanOptions::batch_size,
+                     "Number of files written per transaction.")
+      .def_readwrite("batch_interval", &Midx::ScanOptions::batch_interval,
+                     "Maximum time (a timedelta) a transaction is kept open.")
+      .def_readwrite("art_mode", &Midx::ScanOptions::art_mode)
+      .def_readwrite("read_style", &Midx::ScanOptions::read_style,
+                     "How thoroughly audio properties (duration, bitrate...) are read.")
+      .def_readwrite("on_progress", &Midx::ScanOptions::on_progress,
+                     "Called with a ScanProgress when the phase changes and at most every "
+                     "`progress_interval` in between, from the thread running the scan.")
+      .def_readwrite("progress_interval", &Midx::ScanOptions::progress_interval)
+      .def_property(
+          "cancel_handle", nullptr,
+          [](Midx::ScanOptions &options, const std::stop_source &source) {
+            options.stop_token = source.get_token();
+          },
+          "Once the handle is cancelled, the files already written are committed and the scan "
+          "returns without removing missing tracks.");
+
+  py::class_<Midx::ScanReport>(handle, "ScanReport", "What a scan did to a music directory.")
+      .def_readonly("mdir_id", &Midx::ScanReport::mdir_id)
+      .def_readonly("n_new", &Midx::ScanReport::n_new)
+      .def_readonly("n_updated", &Midx::ScanReport::n_updated)
+      .def_readonly("n_skipped", &Midx::ScanReport::n_skipped)
+      .def_readonly("n_failed", &Midx::ScanReport::n_failed)
+      .def_readonly("removed_ids", &Midx::ScanReport::removed_ids)
+      .def_readonly("changed_ids", &Midx::ScanReport::changed_ids)
+      .def_readonly("cancelled", &Midx::ScanReport::cancelled)
+      .def("__str__", [&](Midx::ScanReport &r) {
+        return "ScanReport(mdir_id=" + std::to_string(r.mdir_id) +
+               ", n_new=" + std::to_string(r.n_new) + ", n_updated=" + std::to_string(r.n_updated) +
+               ", n_skipped=" + std::to_string(r.n_skipped) +
+               ", n_failed=" + std::to_string(r.n_failed) +
+               ", n_removed=" + std::to_string(r.removed_ids.size()) +
+               (r.cancelled ? ", cancelled" : "") + ")";
       });
 
+  py::class_<Midx::WatcherOptions>(
+      handle, "WatcherOptions", "Options controlling how `Watcher` groups file system events.")
+      .def(py::init<>())
+      .def_readwrite("debounce", &Midx::WatcherOptions::debounce,
+                     "Changes are applied once no event was received for this long (a timedelta).")
+      .def_readwrite("max_delay", &Midx::WatcherOptions::max_delay,
+                     "Upper bound on how long a change waits while events keep coming.")
+      .def_readwrite("art_mode", &Midx::WatcherOptions::art_mode)
+      .def_readwrite("read_style", &Midx::WatcherOptions::read_style);
+
+  py::class_<Midx::Watcher>(
+      handle, "Watcher",
+      "Keeps the database in sync with the music directories using inotify, in a background "
+      "thread with its own connection to the database file.")
+      .def(py::init<const SQLite::Database &, const Midx::WatcherOptions &>(), py::arg("db"),
+           py::arg("options") = Midx::WatcherOptions{})
+      .def("start", &Midx::Watcher::start,
+           "Put watches on every music directory and start applying changes. Returns False if the "
+           "watcher couldn't be started or is already running.",
+           py::call_guard<py::gil_scoped_release>())
+      .def("stop", &Midx::Watcher::stop, "Apply the pending changes then stop watching.",
+           py::call_guard<py::gil_scoped_release>())
+      .def("is_running", &Midx::Watcher::is_running);
+
   handle.def(
-      "init_database", &Midx::init_database,
+      "init_database", locked<&Midx::init_database>,
       "Initialise the database and tables, this function also enables foreign keys checks so it is "
-      "preferred to call it before any operations are done.");
+      "preferred to call it before any operations are done.",
+      release_gil);
 
-  handle.def("get_all_music_dirs", &Midx::get_all_music_dirs);
-  handle.def("get_all_artists", &Midx::get_all_artists);
-  handle.def("get_all_albums", &Midx::get_all_albums);
-  handle.def("get_all_tracks", &Midx::get_all_tracks);
+  handle.def("get_all_music_dirs", locked<&Midx::get_all_music_dirs>, release_gil);
+  handle.def("get_all_artists", locked<&Midx::get_all_artists>, release_gil);
+  handle.def("get_all_albums", locked<&Midx::get_all_albums>, release_gil);
+  handle.def("get_all_tracks", locked<&Midx::get_all_tracks>, release_gil);
 
-  handle.def("get_artist", &Midx::get_artist);
-  handle.def("get_album", &Midx::get_album);
-  handle.def("get_track_metadata", &Midx::get_track_metadata);
+  bind_row_stream(handle, "ArtistStream", "stream_all_artists", &Midx::stream_all_artists);
+  bind_row_stream(handle, "AlbumStream", "stream_all_albums", &Midx::stream_all_albums);
+  bind_row_stream(handle, "TrackStream", "stream_all_tracks", &Midx::stream_all_tracks,
+                  "Like `get_all_tracks()`, the tracks are read one at a time while iterating.");
 
-  handle.def("is_valid_music_dir_id", &Midx::is_valid_music_dir_id);
-  handle.def("is_valid_artist_id", &Midx::is_valid_artist_id);
-  handle.def("is_valid_album_id", &Midx::is_valid_album_id);
-  handle.def("is_valid_track_id", &Midx::is_valid_track_id);
+  handle.def("get_tracks_page", locked<&Midx::get_tracks_page>,
+             "At most `limit` tracks in `order`, starting after `after` (from the beginning if "
+             "it's None).",
+             py::arg("db"), py::arg("order"), py::arg("after") = py::none(),
+             py::arg("limit") = 100, release_gil);
+  handle.def("get_albums_page", locked<&Midx::get_albums_page>, py::arg("db"), py::arg("order"),
+             py::arg("after") = py::none(), py::arg("limit") = 100, release_gil);
+  handle.def("get_artists_page", locked<&Midx::get_artists_page>, py::arg("db"), py::arg("order"),
+             py::arg("after") = py::none(), py::arg("limit") = 100, release_gil);
 
-  handle.def("get_music_dir_id", &Midx::get_music_dir_id);
-  handle.def("get_artist_id", &Midx::get_artist_id);
-  handle.def("get_album_id", &Midx::get_album_id);
-  handle.def("get_track_id", &Midx::get_track_id);
+  handle.def("get_artist", locked<&Midx::get_artist>, release_gil);
+  handle.def("get_album", locked<&Midx::get_album>, release_gil);
+  handle.def("get_track", locked<&Midx::get_track>, release_gil);
+  handle.def("get_track_metadata", locked<&Midx::get_track_metadata>, release_gil);
+  handle.def("get_audio_properties", locked<&Midx::get_audio_properties>,
+             "Duration, bitrate... of a track, as read when the file was indexed.", release_gil);
+  handle.def("get_album_art_path", locked<&Midx::get_album_art_path>,
+             "Path of the album's picture, albums sharing a cover share the file.", release_gil);
+  handle.def("get_album_art", locked<&Midx::get_album_art>,
+             "The album's picture, read from the audio file it's embedded in if it was stored "
+             "lazily.", release_gil);
+  handle.def("search", locked<&Midx::search>,
+             "Ids of the tracks whose title, artist or album contain words starting with each "
+             "word of the query, ignoring case and accents, best matches first.",
+             py::arg("db"), py::arg("query"), py::arg("limit") = 50, release_gil);
 
-  handle.def("insert_music_dir", &Midx::insert_music_dir);
-  handle.def("insert_artist", &Midx::insert_artist);
-  handle.def("insert_album", &Midx::insert_album);
-  handle.def("insert_track", &Midx::insert_track);
+  handle.def("is_valid_music_dir_id", locked<&Midx::is_valid_music_dir_id>, release_gil);
+  handle.def("is_valid_artist_id", locked<&Midx::is_valid_artist_id>, release_gil);
+  handle.def("is_valid_album_id", locked<&Midx::is_valid_album_id>, release_gil);
+  handle.def("is_valid_track_id", locked<&Midx::is_valid_track_id>, release_gil);
 
-  handle.def("get_ids_of_tracks_of_music_dir", &Midx::get_ids_of_tracks_of_music_dir,
-             "Get ids of the tracks that are inside (and bound to) a certain music directory.");
+  handle.def("get_music_dir_id", locked<&Midx::get_music_dir_id>, release_gil);
+  handle.def("get_artist_id", locked<&Midx::get_artist_id>, release_gil);
+  handle.def("get_album_id", locked<&Midx::get_album_id>, release_gil);
+  handle.def("get_track_id", locked<&Midx::get_track_id>, release_gil);
 
-  handle.def("remove_music_dir", &Midx::remove_music_dir);
+  handle.def("insert_music_dir", locked<&Midx::insert_music_dir>, release_gil);
+  handle.def("insert_artist", locked<&Midx::insert_artist>, release_gil);
+  handle.def("insert_album", locked<&Midx::insert_album>, release_gil);
+  handle.def("insert_track", locked<&Midx::insert_track>, release_gil);
+  handle.def(
+      "insert_tracks",
+      [](SQLite::Database &db, const std::vector<std::string> &file_paths,
+         const MDirId parent_dir_id) {
+        std::lock_guard lock{connection_mutex(db.getHandle())};
+        return Midx::insert_tracks(db, file_paths, parent_dir_id);
+      },
+      "Insert many tracks of the same music directory in one transaction, returns their Ids in "
+      "the same order (None for the files that couldn't be inserted).",
+      py::arg("db"), py::arg("file_paths"), py::arg("parent_dir_id"), release_gil
+  );
+
+  handle.def("get_ids_of_tracks_of_music_dir", locked<&Midx::get_ids_of_tracks_of_music_dir>,
+             "Get ids of the tracks that are inside (and bound to) a certain music directory.",
+             release_gil);
+
+  handle.def("remove_music_dir", locked<&Midx::remove_music_dir>, release_gil);
 
-  handle.def("remove_track", &Midx::remove_track,
-             "Delete a track (and its metadata) from the database.");
+  handle.def("remove_track", locked<&Midx::remove_track>,
+             "Delete a track (and its metadata) from the database.", release_gil);
 
-  handle.def("scan_directory", &Midx::scan_directory,
-             "Recursively scan a directory given its relative or absolute path.");
+  handle.def("scan_directory", locked<&Midx::scan_directory>,
+             "Recursively scan a directory given its relative or absolute path, unchanged files "
+             "are skipped.",
+             py::arg("db"),
+             py::arg("path"), py::arg("options") = Midx::ScanOptions{}, release_gil);
 
   handle.def(
-      "build_music_library", &Midx::build_music_library,
-      "Scan all directories present in the database and add all the existing tracks, artists...");
+      "build_music_library", locked<&Midx::build_music_library>,
+      "Scan all directories present in the database and add all the existing tracks, artists...",
+      py::arg("db"), py::arg("options") = Midx::ScanOptions{}, release_gil);
+
+  py::class_<SnapshotColumn>(
+      handle, "SnapshotColumn",
+      "Read-only column of a library snapshot, supports the buffer protocol (e.g. "
+      "`numpy.asarray(column)` or `memoryview(column)`) without copying.",
+      py::buffer_protocol())
+      .def_buffer([](SnapshotColumn &column) {
+        if (column.n_fields == 1)
+          return py::buffer_info(
+              const_cast<void *>(column.data), column.item_size, column.format, 1,
+              {column.n_rows}, {column.item_size}, true);
+        const py::ssize_t row_size = column.item_size * column.n_fields;
+        return py::buffer_info(
+            const_cast<void *>(column.data), column.item_size, column.format, 2,
+            {column.n_rows, column.n_fields}, {row_size, column.item_size}, true);
+      })
+      .def("__len__", [](const SnapshotColumn &column) { return column.n_rows; });
+
+  // Snapshots are immutable, only their accessors are bound
+  using SnapshotPtr = std::shared_ptr<Midx::LibrarySnapshot>;
+  py::class_<Midx::LibrarySnapshot, SnapshotPtr>(
+      handle, "LibrarySnapshot", "Copy of the library read without querying the database.")
+      .def_property_readonly("n_artists", &Midx::LibrarySnapshot::n_artists)
+      .def_property_readonly("n_albums", &Midx::LibrarySnapshot::n_albums)
+      .def_property_readonly("n_tracks", &Midx::LibrarySnapshot::n_tracks)
+      .def("track_row", &Midx::LibrarySnapshot::track_row,
+           "Row of a track, `LibrarySnapshot.NONE` if it's not in the snapshot.")
+      .def(
+          "tracks_in",
+          [](const SnapshotPtr &snap, const Midx::TrackOrder order) {
+            return make_column(snap, snap->tracks_in(order));
+          },
+          "Rows of the tracks in `order`, as a column.", py::arg("order"))
+      .def(
+          "albums_in",
+          [](const SnapshotPtr &snap, const Midx::ListOrder order) {
+            return make_column(snap, snap->albums_in(order));
+          },
+          py::arg("order"))
+      .def(
+          "artists_in",
+          [](const SnapshotPtr &snap, const Midx::ListOrder order) {
+            return make_column(snap, snap->artists_in(order));
+          },
+          py::arg("order"))
+      .def(
+          "track_columns",
+          [](const SnapshotPtr &snap) {
+            const auto &tracks = snap->tracks;
+            py::dict res{};
+            res["id"]           = make_column(snap, tracks.id);
+            res["music_dir_id"] = make_column(snap, tracks.music_dir_id);
+            res["file_path"]    = make_column(snap, tracks.file_path);
+            res["title"]        = make_column(snap, tracks.title);
+            res["track_number"] = make_column(snap, tracks.track_number);
+            res["artist_id"]    = make_column(snap, tracks.artist_id);
+            res["album_id"]     = make_column(snap, tracks.album_id);
+            res["duration_ms"]  = make_column(snap, tracks.duration_ms);
+            return res;
+          },
+          "The tracks' columns by name, e.g. `numpy.asarray(snapshot.track_columns()['id'])`.")
+      .def(
+          "album_columns",
+          [](const SnapshotPtr &snap) {
+            py::dict res{};
+            res["id"]        = make_column(snap, snap->albums.id);
+            res["name"]      = make_column(snap, snap->albums.name);
+            res["artist_id"] = make_column(snap, snap->albums.artist_id);
+            return res;
+          })
+      .def(
+          "artist_columns",
+          [](const SnapshotPtr &snap) {
+            py::dict res{};
+            res["id"]   = make_column(snap, snap->artists.id);
+            res["name"] = make_column(snap, snap->artists.name);
+            return res;
+          })
+      .def_property_readonly(
+          "strings",
+          [](const SnapshotPtr &snap) {
+            return SnapshotColumn{snap, snap->strings.data(), py::ssize_t(snap->strings.size()), 1,
+                                  py::format_descriptor<uint8_t>::format()};
+          },
+          "UTF-8 bytes of all the strings, string columns give the offset and size of each.")
+      .def("track", &snapshot_track, "The columns of a track's row as a dict.", py::arg("row"))
+      .def_property_readonly_static(
+          "NONE", [](py::object) { return Midx::LibrarySnapshot::none; });
+
+  py::class_<Midx::LibraryView>(
+      handle, "LibraryView",
+      "Publishes snapshots of the library, updates swap in a new snapshot without changing the "
+      "ones being read.")
+      .def(py::init([](SQLite::Database &db) {
+             py::gil_scoped_release release{};
+             std::lock_guard lock{connection_mutex(db.getHandle())};
+             return std::make_unique<Midx::LibraryView>(db);
+           }),
+           "Load the whole library.", py::arg("db"))
+      .def("snapshot",
+           [](const Midx::LibraryView &view) {
+             return std::const_pointer_cast<Midx::LibrarySnapshot>(view.snapshot());
+           })
+      .def(
+          "reload",
+          [](Midx::LibraryView &view, SQLite::Database &db) {
+            std::lock_guard lock{connection_mutex(db.getHandle())};
+            view.reload(db);
+          },
+          "Load the whole library again.", release_gil)
+      .def(
+          "update",
+          [](Midx::LibraryView &view, SQLite::Database &db, const Midx::ScanReport &report) {
+            std::lock_guard lock{connection_mutex(db.getHandle())};
+            view.update(db, report);
+          },
+          "Apply what a scan did.", py::arg("db"), py::arg("report"), release_gil)
+      .def(
+          "update",
+          [](Midx::LibraryView &view, SQLite::Database &db,
+             const std::vector<TrackId> &changed_ids, const std::vector<TrackId> &removed_ids) {
+            std::lock_guard lock{connection_mutex(db.getHandle())};
+            view.update(db, changed_ids, removed_ids);
+          },
+          "Read the changed tracks again and drop the removed ones.", py::arg("db"),
+          py::arg("changed_ids"), py::arg("removed_ids"), release_gil);
 }
@@ -0,0 +1,575 @@
+#include "./native_tags.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <string_view>
+
+using std::nullopt;
+using std::optional;
+using std::string;
+using std::string_view;
+
+namespace Midx {
+
+namespace {
+
+using Utils::AudioFormat;
+
+/**
+ * Bytes read at once from the beginning of the file, enough for the tags of most files that
+ * don't embed a big picture before them.
+ */
+constexpr size_t head_size = 64 * 1024;
+/**
+ * Bigger text frames and comment blocks are left to TagLib.
+ */
+constexpr uint32_t max_field_size = 1024 * 1024;
+
+uint32_t read_be32(const char *p) {
+  const auto *u = reinterpret_cast<const unsigned char *>(p);
+  return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | u[3];
+}
+
+uint32_t read_le32(const char *p) {
+  const auto *u = reinterpret_cast<const unsigned char *>(p);
+  return (uint32_t(u[3]) << 24) | (uint32_t(u[2]) << 16) | (uint32_t(u[1]) << 8) | u[0];
+}
+
+uint32_t read_syncsafe32(const char *p) {
+  const auto *u = reinterpret_cast<const unsigned char *>(p);
+  return (uint32_t(u[0] & 0x7f) << 21) | (uint32_t(u[1] & 0x7f) << 14) |
+         (uint32_t(u[2] & 0x7f) << 7) | (u[3] & 0x7f);
+}
+
+/**
+ * Serves reads from the beginning of the file kept in `NativeTags::head`, reads the file
+ * otherwise.
+ */
+class Reader {
+ public:
+  Reader(const Utils::ReadAt &read_at, const uint64_t file_size, Utils::NativeTags &tags)
+      : m_read_at{read_at}, m_file_size{file_size}, m_head{tags.head}, m_scratch{tags.scratch} {
+    m_head.resize(size_t(std::min<uint64_t>(file_size, head_size)));
+    if (not read_at(0, m_head.size(), m_head.data()))
+      m_head.clear();
+  }
+
+  /**
+   * `size` bytes at `offset`, valid until the next call. `nullptr` if they can't be read.
+   */
+  const char *view(const uint64_t offset, const size_t size) {
+    if (offset <= m_head.size() and size <= m_head.size() - offset)
+      return m_head.data() + offset;
+    if (offset > m_file_size or size > m_file_size - offset)
+      return nullptr;
+    m_scratch.resize(size);
+    return m_read_at(offset, size, m_scratch.data()) ? m_scratch.data() : nullptr;
+  }
+
+  Utils::ReadAt as_read_at() {
+    return [this](const uint64_t offset, const size_t size, char *out) {
+      const char *p = view(offset, size);
+      if (p == nullptr)
+        return false;
+      std::copy_n(p, size, out);
+      return true;
+    };
+  }
+
+ private:
+  const Utils::ReadAt &m_read_at;
+  const uint64_t m_file_size;
+  std::vector<char> &m_head;
+  std::vector<char> &m_scratch;
+};
+
+/**
+ * Fields with several values are joined with a space, like TagLib's `StringList::toString()`.
+ */
+void append_value(string &field, const string_view value) {
+  if (value.empty())
+    return;
+  if (not field.empty())
+    field += ' ';
+  field += value;
+}
+
+void append_utf8(string &out, const uint32_t cp) {
+  if (cp < 0x80) {
+    out += char(cp);
+  } else if (cp < 0x800) {
+    out += char(0xc0 | (cp >> 6));
+    out += char(0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    out += char(0xe0 | (cp >> 12));
+    out += char(0x80 | ((cp >> 6) & 0x3f));
+    out += char(0x80 | (cp & 0x3f));
+  } else {
+    out += char(0xf0 | (cp >> 18));
+    out += char(0x80 | ((cp >> 12) & 0x3f));
+    out += char(0x80 | ((cp >> 6) & 0x3f));
+    out += char(0x80 | (cp & 0x3f));
+  }
+}
+
+void append_utf16(string &out, const char *p, const size_t size, const bool big_endian) {
+  const auto *u      = reinterpret_cast<const unsigned char *>(p);
+  const auto unit_at = [&](const size_t i) -> uint32_t {
+    return big_endian ? (uint32_t(u[i]) << 8) | u[i + 1] : (uint32_t(u[i + 1]) << 8) | u[i];
+  };
+  for (size_t i = 0; i + 1 < size; i += 2) {
+    const uint32_t unit = unit_at(i);
+    if (unit >= 0xd800 and unit < 0xdc00 and i + 3 < size) {
+      const uint32_t low = unit_at(i + 2);
+      if (low >= 0xdc00 and low < 0xe000) {
+        append_utf8(out, 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00));
+        i += 2;
+        continue;
+      }
+    }
+    append_utf8(out, unit >= 0xd800 and unit < 0xe000 ? 0xfffd : unit);
+  }
+}
+
+/**
+ * Decode the values of an ID3v2 text frame (an encoding byte then null separated strings) to
+ * UTF-8, returns false for unknown encodings.
+ */
+bool decode_id3v2_text(const char *p, const size_t size, string &out) {
+  out.clear();
+  if (size == 0)
+    return true;
+  const char encoding = p[0];
+  if (encoding < 0 or encoding > 3)
+    return false;
+  // UTF-16 strings are terminated by two null bytes
+  const size_t step = encoding == 1 or encoding == 2 ? 2 : 1;
+  string value{};
+  for (size_t begin = 1; begin < size;) {
+    size_t end = begin;
+    while (end + step <= size and not(p[end] == 0 and (step == 1 or p[end + 1] == 0)))
+      end += step;
+    const string_view raw{p + begin, std::min(end, size) - begin};
+    value.clear();
+    if (encoding == 0) {
+      for (const char c : raw)
+        append_utf8(value, uint8_t(c));
+    } else if (encoding == 3) {
+      value = raw;
+    } else if (raw.starts_with("\xff\xfe")) {
+      append_utf16(value, raw.data() + 2, raw.size() - 2, false);
+    } else {
+      // UTF-16 without a BOM, or UTF-16BE
+      const bool has_bom = encoding == 1 and raw.starts_with("\xfe\xff");
+      append_utf16(value, raw.data() + (has_bom ? 2 : 0), raw.size() - (has_bom ? 2 : 0), true);
+    }
+    append_value(out, value);
+    begin = end + step;
+  }
+  return true;
+}
+
+/**
+ * Like TagLib's `String::toInt()`, the leading number is used so "3/12" is 3.
+ * 0 is not a track number.
+ */
+optional<size_t> parse_track_number(const string_view text) {
+  const size_t begin = std::min(text.find_first_not_of(" \t+"), text.size());
+  size_t res         = 0;
+  const auto [_, ec] = std::from_chars(text.data() + begin, text.data() + text.size(), res);
+  if (ec != std::errc{} or res == 0)
+    return nullopt;
+  return res;
+}
+
+bool iequals(const string_view a, const string_view b) {
+  return std::ranges::equal(a, b, [](const char x, const char y) {
+    return (x >= 'a' and x <= 'z' ? char(x - 'a' + 'A') : x) == y;
+  });
+}
+
+/**
+ * Whether the file ends with an ID3v1 or APE tag, TagLib merges them with the other tags.
+ */
+bool has_trailing_tags(Reader &reader, const uint64_t file_size) {
+  const size_t size = size_t(std::min<uint64_t>(file_size, 160));
+  const char *tail  = reader.view(file_size - size, size);
+  if (tail == nullptr)
+    return true;
+  const string_view end{tail, size};
+  const bool has_id3v1      = size >= 128 and end.substr(size - 128, 3) == "TAG";
+  const size_t before_id3v1 = size - (has_id3v1 ? 128 : 0);
+  const bool has_ape = before_id3v1 >= 32 and end.substr(before_id3v1 - 32, 8) == "APETAGEX";
+  return has_id3v1 or has_ape;
+}
+
+/**
+ * Properties of a stream of `n_samples` samples per channel taking `stream_size` bytes, the
+ * bitrate is the average over the whole stream.
+ */
+Utils::ParsedProperties make_properties(
+    const uint64_t n_samples, const uint32_t sample_rate, const uint32_t channels,
+    const uint64_t stream_size, const char *codec
+) {
+  const uint64_t duration_ms =
+      sample_rate == 0 ? 0 : (n_samples * 1000 + sample_rate / 2) / sample_rate;
+  // kb/s are bits per millisecond
+  const uint64_t bitrate =
+      duration_ms == 0 ? 0 : (stream_size * 8 + duration_ms / 2) / duration_ms;
+  return Utils::ParsedProperties{duration_ms, bitrate, sample_rate, channels, codec};
+}
+
+/**
+ * Fields of a Vorbis comment block (little-endian lengths, "KEY=value" fields), keys are
+ * case-insensitive.
+ */
+bool read_vorbis_comment(const char *p, const size_t size, Utils::NativeTags &tags) {
+  size_t pos           = 0;
+  const auto next_size = [&](uint32_t &value) {
+    if (pos + 4 > size)
+      return false;
+    value = read_le32(p + pos);
+    pos += 4;
+    return true;
+  };
+  uint32_t vendor_size = 0;
+  if (not next_size(vendor_size) or vendor_size > size - pos)
+    return false;
+  pos += vendor_size;
+  uint32_t n_fields = 0;
+  if (not next_size(n_fields))
+    return false;
+
+  // TagLib falls back to TRACKNUM if there is no TRACKNUMBER
+  optional<string_view> track_number{};
+  optional<string_view> track_num{};
+  for (uint32_t i = 0; i < n_fields; ++i) {
+    uint32_t field_size = 0;
+    if (not next_size(field_size) or field_size > size - pos)
+      return false;
+    const string_view field{p + pos, field_size};
+    pos += field_size;
+    const size_t eq = field.find('=');
+    // TagLib drops empty values
+    if (eq == string_view::npos or eq + 1 == field.size())
+      continue;
+    const string_view key   = field.substr(0, eq);
+    const string_view value = field.substr(eq + 1);
+    tags.is_empty           = false;
+    if (iequals(key, "TITLE"))
+      append_value(tags.title, value);
+    else if (iequals(key, "ARTIST"))
+      append_value(tags.artist, value);
+    else if (iequals(key, "ALBUM"))
+      append_value(tags.album, value);
+    else if (iequals(key, "TRACKNUMBER") and not track_number.has_value())
+      track_number = value;
+    else if (iequals(key, "TRACKNUM") and not track_num.has_value())
+      track_num = value;
+  }
+  if (track_number.has_value() or track_num.has_value())
+    tags.track_number = parse_track_number(track_number.value_or(*track_num));
+  return true;
+}
+
+bool read_flac(Reader &reader, const uint64_t file_size, Utils::NativeTags &tags) {
+  // FLAC files starting with an ID3v2 tag are left to TagLib, it merges both tags
+  const char *magic = reader.view(0, 4);
+  if (magic == nullptr or string_view{magic, 4} != "fLaC")
+    return false;
+
+  bool has_stream_info = false;
+  uint32_t sample_rate = 0;
+  uint32_t channels    = 0;
+  uint64_t n_samples   = 0;
+  bool has_comment     = false;
+  uint64_t pos         = 4;
+  bool is_last         = false;
+  while (not is_last) {
+    const char *header = reader.view(pos, 4);
+    if (header == nullptr)
+      return false;
+    is_last                = (header[0] & 0x80) != 0;
+    const int type         = header[0] & 0x7f;
+    const uint32_t length  = read_be32(header) & 0xffffff;
+    const uint64_t content = pos + 4;
+    pos                    = content + length;
+    if (type == 127 or pos > file_size)
+      return false;
+
+    if (type == 0 and length >= 34) {
+      // STREAMINFO: 20 bits of sample rate, 3 of channels - 1, 5 of bits per sample - 1 and 36
+      // of samples, from the 11th byte
+      const char *info = reader.view(content, 34);
+      if (info == nullptr)
+        return false;
+      const auto *u   = reinterpret_cast<const unsigned char *>(info);
+      sample_rate     = (uint32_t(u[10]) << 12) | (uint32_t(u[11]) << 4) | (u[12] >> 4);
+      channels        = ((u[12] >> 1) & 7) + 1;
+      n_samples       = (uint64_t(u[13] & 0x0f) << 32) | read_be32(info + 14);
+      has_stream_info = true;
+    } else if (type == 4 and not has_comment) {
+      // TagLib only reads the first VORBIS_COMMENT block
+      has_comment = true;
+      if (length > max_field_size)
+        return false;
+      const char *comment = reader.view(content, length);
+      if (comment == nullptr or not read_vorbis_comment(comment, length, tags))
+        return false;
+    }
+  }
+  if (not has_stream_info)
+    return false;
+  // The audio frames follow the last metadata block
+  tags.properties = make_properties(n_samples, sample_rate, channels, file_size - pos, "FLAC");
+  return true;
+}
+
+/**
+ * Text fields of an ID3v2.3/2.4 tag at the beginning of the file, `tag_end` is set to where
+ * the audio starts.
+ */
+bool read_id3v2(Reader &reader, Utils::NativeTags &tags, uint64_t &tag_end) {
+  // Without an ID3v2 tag TagLib looks for ID3v1 and APE tags
+  const char *header = reader.view(0, 10);
+  if (header == nullptr or string_view{header, 3} != "ID3")
+    return false;
+  const int version = header[3];
+  const int flags   = header[5];
+  // ID3v2.2 uses other frame ids, a whole unsynchronised tag has to be decoded first
+  if (version < 3 or version > 4 or (flags & 0x80) != 0)
+    return false;
+  const uint64_t end = 10 + uint64_t(read_syncsafe32(&header[6]));
+  tag_end            = end + ((flags & 0x10) != 0 ? 10 : 0);
+  uint64_t pos       = 10;
+  if ((flags & 0x40) != 0) {
+    const char *ext_size = reader.view(pos, 4);
+    if (ext_size == nullptr)
+      return false;
+    // The size of the extended header excludes itself in v2.3, not in v2.4
+    pos += version == 3 ? 4 + uint64_t(read_be32(ext_size)) : uint64_t(read_syncsafe32(ext_size));
+  }
+
+  // TagLib uses the first frame of each kind
+  std::array<bool, 4> seen{};
+  string track_text{};
+  while (pos + 10 <= end) {
+    const char *frame_header = reader.view(pos, 10);
+    if (frame_header == nullptr)
+      return false;
+    if (frame_header[0] == 0)
+      break;  // Padding
+    const string_view id{frame_header, 4};
+    const uint64_t size =
+        version == 4 ? read_syncsafe32(&frame_header[4]) : read_be32(&frame_header[4]);
+    const int format_flags = frame_header[9];
+    uint64_t content       = pos + 10;
+    uint64_t content_size  = size;
+    pos                    = content + size;
+    if (pos > end)
+      return false;
+
+    constexpr std::array<string_view, 4> fields{"TIT2", "TPE1", "TALB", "TRCK"};
+    const size_t field = size_t(std::ranges::find(fields, id) - fields.begin());
+    if (field == fields.size()) {
+      // Fields TagLib's `Tag::isEmpty()` looks at
+      if (id == "COMM" or id == "TCON" or id == "TDRC" or id == "TYER")
+        tags.is_empty = false;
+      continue;
+    }
+    if (seen[field])
+      continue;
+    seen[field] = true;
+
+    if (version == 3) {
+      // Compression, encryption
+      if ((format_flags & 0xc0) != 0)
+        return false;
+      if ((format_flags & 0x20) != 0)
+        ++content, --content_size;  // Group id
+    } else {
+      // Compression, encryption, unsynchronisation
+      if ((format_flags & 0x0e) != 0)
+        return false;
+      if ((format_flags & 0x40) != 0)
+        ++content, --content_size;
+      if ((format_flags & 0x01) != 0)
+        content += 4, content_size -= 4;  // Data length indicator
+    }
+    if (content_size > max_field_size)
+      return false;
+    const char *text = reader.view(content, content_size);
+    std::array<string *, 4> outputs{&tags.title, &tags.artist, &tags.album, &track_text};
+    if (text == nullptr or not decode_id3v2_text(text, content_size, *outputs[field]))
+      return false;
+  }
+  tags.track_number = parse_track_number(track_text);
+  if (not tags.title.empty() or not tags.artist.empty() or not tags.album.empty() or
+      tags.track_number.has_value())
+    tags.is_empty = false;
+  return true;
+}
+
+struct MpegHeader {
+  /**
+   * 0 for MPEG-1, 1 for MPEG-2 and 2 for MPEG-2.5.
+   */
+  int version;
+  int layer;
+  uint32_t bitrate;
+  uint32_t sample_rate;
+  uint32_t channels;
+  uint32_t samples_per_frame;
+  uint32_t frame_size;
+};
+
+optional<MpegHeader> parse_mpeg_header(const char *p) {
+  static constexpr std::array<std::array<uint16_t, 15>, 5> bitrates{{
+      // MPEG-1 layers I, II and III
+      {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+      {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+      {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+      // MPEG-2 and 2.5 layer I, then layers II and III
+      {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+      {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+  }};
+  static constexpr std::array<uint32_t, 3> sample_rates{44100, 48000, 32000};
+
+  const auto *u = reinterpret_cast<const unsigned char *>(p);
+  if (u[0] != 0xff or (u[1] & 0xe0) != 0xe0)
+    return nullopt;
+  const int version_bits  = (u[1] >> 3) & 3;
+  const int layer_bits    = (u[1] >> 1) & 3;
+  const int bitrate_index = u[2] >> 4;
+  const int rate_index    = (u[2] >> 2) & 3;
+  // Reserved values, and free format streams whose bitrate isn't in the header
+  if (version_bits == 1 or layer_bits == 0 or bitrate_index == 0 or bitrate_index == 15 or
+      rate_index == 3)
+    return nullopt;
+
+  MpegHeader h{};
+  h.version     = version_bits == 3 ? 0 : (version_bits == 2 ? 1 : 2);
+  h.layer       = 4 - layer_bits;
+  const int row = h.version == 0 ? h.layer - 1 : (h.layer == 1 ? 3 : 4);
+  h.bitrate     = bitrates[size_t(row)][size_t(bitrate_index)];
+  h.sample_rate = sample_rates[size_t(rate_index)] >> h.version;
+  h.channels    = (u[3] >> 6) == 3 ? 1 : 2;
+  h.samples_per_frame = h.layer == 1 ? 384 : (h.layer == 3 and h.version != 0 ? 576 : 1152);
+  // Layer I frames are made of 4 bytes slots
+  const uint32_t padding = (u[2] >> 1) & 1;
+  if (h.layer == 1)
+    h.frame_size = (12 * h.bitrate * 1000 / h.sample_rate + padding) * 4;
+  else
+    h.frame_size = h.samples_per_frame / 8 * h.bitrate * 1000 / h.sample_rate + padding;
+  return h;
+}
+
+/**
+ * Properties of the MPEG stream starting around `start`, from the first frame and its Xing or
+ * VBRI header if it has one.
+ */
+bool read_mpeg_properties(
+    Reader &reader, const uint64_t start, const uint64_t file_size, Utils::NativeTags &tags
+) {
+  if (start >= file_size)
+    return false;
+  // The first frame may come after some padding
+  const size_t search_size = size_t(std::min<uint64_t>(file_size - start, 16 * 1024));
+  const char *area         = reader.view(start, search_size);
+  if (area == nullptr)
+    return false;
+  optional<MpegHeader> header{};
+  uint64_t frame_pos = 0;
+  for (size_t i = 0; i + 4 <= search_size and not header.has_value(); ++i) {
+    header = parse_mpeg_header(area + i);
+    if (not header.has_value())
+      continue;
+    // A frame sync can appear by chance, the next frame has to follow
+    const size_t next = i + header->frame_size;
+    if (next + 4 <= search_size) {
+      const auto next_header = parse_mpeg_header(area + next);
+      if (not next_header.has_value() or next_header->version != header->version or
+          next_header->layer != header->layer or next_header->sample_rate != header->sample_rate)
+        header.reset();
+    }
+    frame_pos = start + i;
+  }
+  if (not header.has_value())
+    return false;
+
+  const uint64_t stream_size = file_size - frame_pos;
+  const size_t frame_size    = size_t(std::min<uint64_t>(header->frame_size, stream_size));
+  const char *frame          = reader.view(frame_pos, frame_size);
+  if (frame == nullptr)
+    return false;
+  // Variable bitrate files have a header with their number of frames in their first frame
+  uint32_t n_frames = 0;
+  uint32_t n_bytes  = 0;
+  const size_t xing = 4 + (header->version == 0 ? (header->channels == 1 ? 17 : 32)
+                                                 : (header->channels == 1 ? 9 : 17));
+  const string_view frame_data{frame, frame_size};
+  if (xing + 16 <= frame_size and
+      (frame_data.substr(xing, 4) == "Xing" or frame_data.substr(xing, 4) == "Info")) {
+    const uint32_t xing_flags = read_be32(frame + xing + 4);
+    size_t field              = xing + 8;
+    if ((xing_flags & 1) != 0) {
+      n_frames = read_be32(frame + field);
+      field += 4;
+    }
+    if ((xing_flags & 2) != 0)
+      n_bytes = read_be32(frame + field);
+  } else if (36 + 18 <= frame_size and frame_data.substr(36, 4) == "VBRI") {
+    n_bytes  = read_be32(frame + 36 + 10);
+    n_frames = read_be32(frame + 36 + 14);
+  }
+
+  if (n_frames > 0) {
+    tags.properties = make_properties(
+        uint64_t(n_frames) * header->samples_per_frame, header->sample_rate, header->channels,
+        n_bytes > 0 ? n_bytes : stream_size, "MP3"
+    );
+  } else {
+    // Constant bitrate, kb/s are bits per millisecond
+    tags.properties = Utils::ParsedProperties{
+        stream_size * 8 / header->bitrate, header->bitrate, header->sample_rate,
+        header->channels, "MP3"
+    };
+  }
+  return true;
+}
+
+}  // namespace
+
+bool Utils::read_native_tags(
+    const AudioFormat format, const ReadAt &read_at, const uint64_t file_size, NativeTags &tags
+) {
+  tags.title.clear();
+  tags.artist.clear();
+  tags.album.clear();
+  tags.track_number.reset();
+  tags.is_empty = true;
+  tags.album_art_location.reset();
+  tags.properties.reset();
+  if (format != AudioFormat::Flac and format != AudioFormat::Mp3)
+    return false;
+
+  Reader reader{read_at, file_size, tags};
+  if (has_trailing_tags(reader, file_size))
+    return false;
+  if (format == AudioFormat::Flac) {
+    if (not read_flac(reader, file_size, tags))
+      return false;
+  } else {
+    uint64_t tag_end = 0;
+    if (not read_id3v2(reader, tags, tag_end) or
+        not read_mpeg_properties(reader, tag_end, file_size, tags))
+      return false;
+  }
+  // Album art is stored per album, no need to look for it otherwise
+  if (tags.album.empty())
+    return true;
+  return locate_embedded_art(format, reader.as_read_at(), tags.album_art_location);
+}
+
+}  // namespace Midx
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "./embedded_art.hpp"
+#include "./formats.hpp"
+#include "./internal.hpp"
+
+/*
+ * Reads the tags of the most common files, FLAC files and MP3 files starting with an
+ * ID3v2.3/2.4 tag, without TagLib: only the region holding the tags is read and only the fields
+ * Midx stores are decoded. Anything unusual is left to TagLib.
+ */
+
+namespace Midx::Utils {
+
+/**
+ * What `read_native_tags()` found. The strings and buffers keep their capacity when it's
+ * reused, keeping one per thread avoids allocating for each file.
+ */
+struct NativeTags {
+  std::string title;
+  std::string artist;
+  std::string album;
+  std::optional<size_t> track_number;
+  /**
+   * Whether TagLib would consider the tag empty, it may have fields that aren't read (genre,
+   * comment...).
+   */
+  bool is_empty = true;
+  std::optional<ArtLocation> album_art_location;
+  std::optional<ParsedProperties> properties;
+
+  /**
+   * The beginning of the file, where the tags usually are.
+   */
+  std::vector<char> head;
+  /**
+   * Holds what is read outside of `head`.
+   */
+  std::vector<char> scratch;
+};
+
+/**
+ * Read the tags and audio properties of a file of `file_size` bytes, and where its album art is
+ * if it has an album.
+ *
+ * Returns false if the file has something the parser doesn't handle: other formats, ID3v2.2 or
+ * unsynchronised tags, compressed frames, ID3v1 or APE tags TagLib would merge, MP3s without
+ * an ID3v2 tag... The file must then be parsed with TagLib.
+ */
+bool read_native_tags(
+    const AudioFormat format, const ReadAt &read_at, const uint64_t file_size, NativeTags &tags
+);
+
+}  // namespace Midx::Utils
@@ -0,0 +1,130 @@
+"""Stress test of the Python bindings' threading: one thread keeps scanning a music directory
+while the main thread keeps querying the same connection, and a third thread measures how long
+the GIL is held.
+
+The scans must not freeze the other threads (the bindings release the GIL) and the shared
+connection must stay usable (calls on a connection are serialized by its lock).
+
+Usage: python3 python_bindings_stress_test.py <music directory> [seconds]
+
+`midx` has to be importable (built with -DMIDX_PYTHON_BINDINGS=ON). A music directory can be
+generated with `midx_bench --generate-only --dir <directory>`, the files are in its `corpus`.
+"""
+
+import os
+import sys
+import tempfile
+import threading
+import time
+
+import midx
+
+# Longest time the GIL may be held while scans run, a scan holding it would stall for seconds
+MAX_STALL = 0.25
+
+
+def count_music_files(root):
+    extensions = (".flac", ".mp3")
+    return sum(
+        name.lower().endswith(extensions) for _, _, names in os.walk(root) for name in names
+    )
+
+
+def scan_repeatedly(db, root, deadline, errors, n_scans):
+    """Alternate full scans and removals of the directory until `deadline`."""
+    options = midx.ScanOptions()
+    options.art_mode = midx.ArtMode.Lazy
+    try:
+        while time.monotonic() < deadline:
+            report = midx.scan_directory(db, root, options)
+            if report is None or report.n_failed > 0:
+                errors.append(f"scan failed: {report}")
+                return
+            n_scans[0] += 1
+            midx.remove_music_dir(db, root)
+        midx.scan_directory(db, root, options)
+    except Exception as e:  # Reported by the main thread
+        errors.append(f"scanning thread: {e!r}")
+
+
+def measure_stalls(stop, stalls):
+    """Sleep in short steps, oversleeping means another thread held the GIL."""
+    step = 0.005
+    while not stop.is_set():
+        start = time.monotonic()
+        time.sleep(step)
+        stalls.append(time.monotonic() - start - step)
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        return 2
+    root = os.path.realpath(sys.argv[1])
+    duration = float(sys.argv[2]) if len(sys.argv) > 2 else 10.0
+    n_files = count_music_files(root)
+    if n_files == 0:
+        print(f"No music files in {root}")
+        return 2
+
+    with tempfile.TemporaryDirectory() as tmp:
+        db = midx.SQLiteDB(
+            os.path.join(tmp, "stress.db"), midx.SQLite_OPEN_READWRITE | midx.SQLite_CREATE
+        )
+        midx.init_database(db)
+        midx.insert_music_dir(db, root)
+
+        errors = []
+        n_scans = [0]
+        stalls = []
+        stop = threading.Event()
+        deadline = time.monotonic() + duration
+        scanner = threading.Thread(
+            target=scan_repeatedly, args=(db, root, deadline, errors, n_scans)
+        )
+        ticker = threading.Thread(target=measure_stalls, args=(stop, stalls))
+        scanner.start()
+        ticker.start()
+
+        # Queries of every kind on the connection the scans are using
+        n_queries = 0
+        try:
+            while scanner.is_alive():
+                tracks = midx.get_all_tracks(db)
+                n_streamed = sum(1 for _ in midx.stream_all_tracks(db))
+                if n_streamed > n_files:
+                    errors.append(f"streamed {n_streamed} tracks out of {n_files} files")
+                for track in tracks[:20]:
+                    midx.get_track(db, track.id)
+                midx.get_tracks_page(db, midx.TrackOrder.Title, limit=50)
+                midx.get_all_artists(db)
+                midx.search(db, "a")
+                n_queries += 1
+        except Exception as e:
+            errors.append(f"querying thread: {e!r}")
+        scanner.join()
+        stop.set()
+        ticker.join()
+
+        n_tracks = len(midx.get_all_tracks(db))
+        if n_tracks != n_files:
+            errors.append(f"{n_tracks} tracks stored for {n_files} files")
+        if n_scans[0] == 0 or n_queries == 0:
+            errors.append(f"{n_scans[0]} scans and {n_queries} query rounds, nothing overlapped")
+        max_stall = max(stalls, default=0.0)
+        if max_stall > MAX_STALL:
+            errors.append(f"the GIL was held for {max_stall:.3f} s")
+
+        print(
+            f"{n_scans[0]} scans of {n_files} files, {n_queries} query rounds, "
+            f"longest GIL stall {max_stall * 1e3:.1f} ms"
+        )
+        del db
+
+    for error in errors:
+        print(f"ERROR: {error}")
+    return 1 if errors else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <optional>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+namespace Midx {
+
+/**
+ * The rows of a query read one at a time as they are iterated, going through the whole library
+ * only takes the memory of one row. It's a `std::ranges::input_range`:
+ *
+ *     for (const Midx::Track &track : Midx::stream_all_tracks(db)) { ... }
+ *
+ * The statement is prepared for the stream instead of being borrowed from the statement cache.
+ * It holds a read transaction until the last row is read or the stream is destroyed, which must
+ * happen before `db` is closed. Like its connection, a stream can't be used by two threads at
+ * once.
+ */
+template <typename T>
+class RowStream {
+ public:
+  using Reader = T (*)(SQLite::Statement &stmt);
+
+  class Iterator {
+   public:
+    using value_type      = T;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() = default;
+    explicit Iterator(RowStream *stream) : m_stream{stream} {}
+
+    const T &operator*() const { return *m_stream->m_current; }
+    const T *operator->() const { return &*m_stream->m_current; }
+
+    Iterator &operator++() {
+      m_stream->step();
+      return *this;
+    }
+    void operator++(int) { m_stream->step(); }
+
+    bool operator==(std::default_sentinel_t) const {
+      return m_stream == nullptr or not m_stream->m_current;
+    }
+
+   private:
+    RowStream *m_stream = nullptr;
+  };
+
+  RowStream(std::unique_ptr<SQLite::Statement> stmt, const Reader read)
+      : m_stmt{std::move(stmt)}, m_read{read} {}
+
+  /**
+   * Read the next row into `current()`, returns false once there are no more rows.
+   * The statement is finalized after the last row, ending its read transaction.
+   */
+  bool step() {
+    if (m_stmt and m_stmt->executeStep()) {
+      m_current.emplace(m_read(*m_stmt));
+      return true;
+    }
+    m_current.reset();
+    m_stmt.reset();
+    return false;
+  }
+
+  /**
+   * The row read by the last successful `step()`.
+   */
+  const T &current() const { return *m_current; }
+
+  /**
+   * Reads the first row, a stream can only be iterated once.
+   */
+  Iterator begin() {
+    step();
+    return Iterator{this};
+  }
+  std::default_sentinel_t end() const { return {}; }
+
+ private:
+  std::unique_ptr<SQLite::Statement> m_stmt;
+  Reader m_read;
+  std::optional<T> m_current = std::nullopt;
+};
+
+}  // namespace Midx
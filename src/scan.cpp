@@ -0,0 +1,757 @@
+#include "./midx.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+#include <SQLiteCpp/Savepoint.h>
+#include <sqlite3.h>
+
+#include "./art_store.hpp"
+#include "./bounded_queue.hpp"
+#include "./internal.hpp"
+#include "./metrics.hpp"
+#include "./statement_cache.hpp"
+#include "./trace.hpp"
+
+namespace fs = std::filesystem;
+
+using std::nullopt;
+using std::optional;
+using std::string;
+using std::vector;
+
+namespace Midx {
+
+namespace {
+
+/**
+ * A file found by the walker, `seq` is its position in the walk and is used to store
+ * the tracks in the same order as a serial scan would.
+ */
+struct ScanItem {
+  size_t seq;
+  string file_path;
+};
+
+/**
+ * A file after it went through a parser.
+ */
+struct ScanResult {
+  size_t seq;
+  optional<Utils::ParsedTrack> track;
+};
+
+/**
+ * Limits how far ahead of the writer the parsers go. Results are written in walk order, so
+ * while an early file is slow to parse every later result waits in memory: a parser only
+ * starts a file once it is less than `size` files after the next one to write, which keeps
+ * the results waiting to at most `size`. The next file to write is always in the window, its
+ * parser never waits.
+ */
+class ReorderWindow {
+ public:
+  explicit ReorderWindow(const size_t size) : m_size{size > 0 ? size : 1} {}
+
+  ReorderWindow(const ReorderWindow &)            = delete;
+  ReorderWindow &operator=(const ReorderWindow &) = delete;
+
+  /**
+   * Wait until the file `seq` is in the window, returns false if the window was closed.
+   */
+  bool wait_for(const size_t seq) {
+    std::unique_lock lock{m_mutex};
+    m_moved.wait(lock, [&] { return m_closed or seq < m_next_seq + m_size; });
+    return not m_closed;
+  }
+
+  /**
+   * All the files before `next_seq` were written.
+   */
+  void advance(const size_t next_seq) {
+    {
+      std::lock_guard lock{m_mutex};
+      m_next_seq = next_seq;
+    }
+    m_moved.notify_all();
+  }
+
+  void close() {
+    {
+      std::lock_guard lock{m_mutex};
+      m_closed = true;
+    }
+    m_moved.notify_all();
+  }
+
+ private:
+  const size_t m_size;
+  size_t m_next_seq = 0;
+  bool m_closed     = false;
+  std::mutex m_mutex{};
+  std::condition_variable m_moved{};
+};
+
+/**
+ * A track already in the database.
+ */
+struct KnownTrack {
+  TrackId id;
+  optional<Utils::FileFingerprint> fingerprint;
+};
+
+using KnownTracks = std::unordered_map<string, KnownTrack>;
+
+/**
+ * Tracks already stored under a music directory, by path.
+ */
+KnownTracks get_known_tracks(SQLite::Database &db, const MDirId mdir_id) {
+  KnownTracks res{};
+  Utils::CachedStatement stmt{db, R"--(
+    SELECT file_path, id, mtime_ns, size, dev, inode FROM t_tracks WHERE parent_dir_id = ?
+  )--"};
+  stmt->bind(1, uint32_t(mdir_id));
+  while (stmt->executeStep()) {
+    KnownTrack track{stmt->getColumn(1).getUInt(), nullopt};
+    // Tracks stored by older versions have no fingerprint
+    if (not stmt->isColumnNull(2)) {
+      track.fingerprint = Utils::FileFingerprint{
+          stmt->getColumn(2).getInt64(), stmt->getColumn(3).getInt64(),
+          uint64_t(stmt->getColumn(4).getInt64()), uint64_t(stmt->getColumn(5).getInt64())
+      };
+    }
+    res.emplace(stmt->getColumn(0).getString(), track);
+  }
+  return res;
+}
+
+const KnownTrack *find_known_track(const KnownTracks &known, const fs::path &path) {
+  if (known.empty())
+    return nullptr;
+  // Stored paths are canonical, only resolve the path if it isn't already one of them
+  if (const auto it = known.find(path.native()); it != known.end())
+    return &it->second;
+  std::error_code ec;
+  const auto abs_path = fs::canonical(path, ec);
+  if (ec)
+    return nullptr;
+  const auto it = known.find(abs_path.native());
+  return it != known.end() ? &it->second : nullptr;
+}
+
+/**
+ * Counts what the stages of a scan did and passes it to `options.on_progress`. The counters can
+ * be updated by any stage, `report()` is only called by the thread running the scan.
+ */
+class ProgressReporter {
+ public:
+  ProgressReporter(const string &path, const ScanOptions &options) : m_options{options} {
+    m_progress.path = path;
+  }
+
+  ProgressReporter(const ProgressReporter &)            = delete;
+  ProgressReporter &operator=(const ProgressReporter &) = delete;
+
+  bool enabled() const { return bool(m_options.on_progress); }
+
+  void set_n_files(const size_t n_files) { m_progress.n_files = n_files; }
+
+  void parsed(const uint64_t n_bytes) {
+    ++m_n_parsed;
+    m_n_bytes += n_bytes;
+  }
+
+  /**
+   * Call `on_progress` if the phase changed or `progress_interval` passed since the last call.
+   */
+  void report(const ScanPhase phase, const size_t n_written) {
+    if (not enabled())
+      return;
+    const auto now = std::chrono::steady_clock::now();
+    if (phase == m_progress.phase and now - m_last_report < m_options.progress_interval)
+      return;
+    if (phase == ScanPhase::Scanning and m_progress.phase != phase)
+      m_scan_start = now;
+    m_last_report        = now;
+    m_progress.phase     = phase;
+    m_progress.n_seen    = n_seen;
+    m_progress.n_parsed  = m_n_parsed;
+    m_progress.n_bytes   = m_n_bytes;
+    m_progress.n_written = n_written;
+    m_progress.eta       = nullopt;
+    if (phase == ScanPhase::Scanning and m_progress.n_seen > 0) {
+      const size_t n_left = m_progress.n_files - std::min(m_progress.n_seen, m_progress.n_files);
+      m_progress.eta      = std::chrono::duration_cast<std::chrono::milliseconds>(
+          (now - m_scan_start) * double(n_left) / double(m_progress.n_seen)
+      );
+    } else if (phase == ScanPhase::Done) {
+      m_progress.eta = std::chrono::milliseconds{0};
+    }
+    m_options.on_progress(m_progress);
+  }
+
+  /**
+   * Incremented by the walker.
+   */
+  std::atomic<size_t> n_seen{0};
+
+ private:
+  const ScanOptions &m_options;
+  std::atomic<size_t> m_n_parsed{0};
+  std::atomic<uint64_t> m_n_bytes{0};
+  ScanProgress m_progress{};
+  std::chrono::steady_clock::time_point m_last_report{};
+  std::chrono::steady_clock::time_point m_scan_start{};
+};
+
+/**
+ * Number of supported files under `root`, only their names are looked at. Stops early if
+ * `stop_token` is triggered.
+ */
+size_t count_music_files(const string &root, const std::stop_token &stop_token) {
+  size_t res = 0;
+  std::error_code ec;
+  auto it =
+      fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied, ec);
+  for (; not ec and it != fs::recursive_directory_iterator{}; it.increment(ec)) {
+    if (stop_token.stop_requested())
+      break;
+    std::error_code entry_ec;
+    if (it->is_regular_file(entry_ec) and Utils::is_supported_file_type(it->path()))
+      ++res;
+  }
+  return res;
+}
+
+/**
+ * What the walker saw.
+ */
+struct WalkStats {
+  /**
+   * Unchanged files.
+   */
+  size_t n_skipped = 0;
+  /**
+   * Known tracks whose file was found, changed or not.
+   */
+  vector<TrackId> visited{};
+  /**
+   * False if the walk stopped early or hit an error, some files may not have been visited.
+   */
+  bool complete = true;
+};
+
+/**
+ * Call `fn` on each supported file under `root` that is new or changed since it was stored,
+ * and `on_skipped` on the other ones. Stops early if `fn` returns false or `stop_token` is
+ * triggered.
+ */
+void walk_music_files(
+    const string &root, const KnownTracks &known, WalkStats &stats, ProgressReporter &progress,
+    const std::stop_token &stop_token, const std::function<bool(const fs::path &)> &fn,
+    const std::function<void()> &on_skipped = {}
+) {
+  Utils::TraceSpan span{"walk", root};
+  std::error_code ec;
+  auto it =
+      fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied, ec);
+  const auto next = [&] {
+    Utils::StageTimer timer{ScanStage::Walk};
+    it.increment(ec);
+  };
+  for (; not ec and it != fs::recursive_directory_iterator{}; next()) {
+    if (stop_token.stop_requested()) {
+      stats.complete = false;
+      return;
+    }
+    std::error_code entry_ec;
+    if (not it->is_regular_file(entry_ec) or not Utils::is_supported_file_type(it->path()))
+      continue;
+    ++progress.n_seen;
+    Utils::add_to_counter(ScanCounter::FilesSeen);
+    const KnownTrack *stored = find_known_track(known, it->path());
+    if (stored != nullptr) {
+      stats.visited.push_back(stored->id);
+      bool unchanged = false;
+      if (stored->fingerprint.has_value()) {
+        Utils::StageTimer timer{ScanStage::Stat, it->path().native()};
+        unchanged = stored->fingerprint == Utils::get_file_fingerprint(it->path());
+      }
+      if (unchanged) {
+        ++stats.n_skipped;
+        Utils::add_to_counter(ScanCounter::FilesSkipped);
+        if (on_skipped)
+          on_skipped();
+        continue;
+      }
+    }
+    if (not fn(it->path())) {
+      stats.complete = false;
+      return;
+    }
+  }
+  if (ec) {
+    spdlog::error("Error while walking {}: {}", root, ec.message());
+    stats.complete = false;
+  }
+}
+
+/**
+ * Start a new scan of a music directory, returns its generation.
+ */
+int64_t begin_scan_generation(SQLite::Database &db, const MDirId mdir_id) {
+  Utils::CachedStatement stmt{
+      db, "UPDATE t_music_dirs SET scan_gen = scan_gen + 1 WHERE id = ? RETURNING scan_gen"
+  };
+  stmt->bind(1, uint32_t(mdir_id));
+  int64_t gen = 0;
+  while (stmt->executeStep())
+    gen = stmt->getColumn(0).getInt64();
+  return gen;
+}
+
+/**
+ * Stamp the tracks that were visited with `scan_gen` then delete the tracks of the music
+ * directory that weren't, returns their Ids.
+ */
+vector<TrackId> sweep_unvisited_tracks(
+    SQLite::Database &db, const MDirId mdir_id, const int64_t scan_gen,
+    const vector<TrackId> &visited
+) {
+  vector<TrackId> res{};
+  SQLite::Transaction transaction{db};
+  // The visited tracks, which are most of the library, are stamped by a single statement
+  // through a temporary table. Sorted, the ids are appended to it.
+  db.exec("CREATE TEMP TABLE IF NOT EXISTS temp_visited (id INTEGER PRIMARY KEY)");
+  {
+    vector<TrackId> sorted = visited;
+    std::ranges::sort(sorted);
+    Utils::CachedStatement stmt{db, "INSERT OR IGNORE INTO temp_visited (id) VALUES (?)"};
+    for (const auto id : sorted) {
+      stmt->bind(1, uint32_t(id));
+      stmt->exec();
+      stmt->reset();
+    }
+  }
+  Utils::CachedStatement stamp_stmt{
+      db, "UPDATE t_tracks SET scan_gen = ? WHERE id IN (SELECT id FROM temp_visited)"
+  };
+  stamp_stmt->bind(1, scan_gen);
+  stamp_stmt->exec();
+  db.exec("DELETE FROM temp_visited");
+
+  Utils::CachedStatement del_metadata_stmt{db, R"--(
+    DELETE FROM t_tracks_metadata WHERE track_id IN (
+      SELECT id FROM t_tracks WHERE parent_dir_id = ? AND scan_gen IS NOT ?
+    )
+  )--"};
+  del_metadata_stmt->bind(1, uint32_t(mdir_id));
+  del_metadata_stmt->bind(2, scan_gen);
+  del_metadata_stmt->exec();
+
+  Utils::CachedStatement del_stmt{
+      db, "DELETE FROM t_tracks WHERE parent_dir_id = ? AND scan_gen IS NOT ? RETURNING id"
+  };
+  del_stmt->bind(1, uint32_t(mdir_id));
+  del_stmt->bind(2, scan_gen);
+  while (del_stmt->executeStep())
+    res.push_back(del_stmt->getColumn(0).getUInt());
+  transaction.commit();
+  return res;
+}
+
+/**
+ * Writes the tracks of a scan in transactions of `options.batch_size` files, or of
+ * `options.batch_interval`. Each file is written inside a savepoint so a failing file is
+ * rolled back alone, a failing commit only loses its own batch.
+ */
+class BatchWriter {
+ public:
+  BatchWriter(
+      SQLite::Database &db, const MDirId mdir_id, const int64_t scan_gen,
+      const ScanOptions &options
+  )
+      : m_db{db},
+        m_mdir_id{mdir_id},
+        m_scan_gen{scan_gen},
+        m_options{options},
+        m_interned{db, true},
+        m_batch_report{mdir_id},
+        m_report{mdir_id} {}
+
+  BatchWriter(const BatchWriter &)            = delete;
+  BatchWriter &operator=(const BatchWriter &) = delete;
+
+  void write(const Utils::ParsedTrack &track) {
+    if (not m_transaction.has_value())
+      begin();
+    const size_t interned_mark = m_interned.mark();
+    try {
+      SQLite::Savepoint savepoint{m_db, "midx_track"};
+      optional<Utils::StoredTrack> stored = nullopt;
+      {
+        Utils::StageTimer timer{ScanStage::DbInsert, track.file_path};
+        stored = Utils::store_track(m_db, track, m_mdir_id, m_interned);
+      }
+      // Known tracks are stamped with the ones the walker visited
+      if (stored.has_value() and stored->inserted)
+        stamp(stored->id);
+      savepoint.release();
+      if (not stored.has_value()) {
+        ++m_report.n_failed;
+        Utils::add_to_counter(ScanCounter::WriteFailures);
+      } else {
+        if (stored->album_id.has_value() and track.metadata.has_value() and
+            track.metadata->album_art.has_value())
+          m_pending_art.try_emplace(*stored->album_id, *track.metadata->album_art);
+        ++(stored->inserted ? m_batch_report.n_new : m_batch_report.n_updated);
+        m_batch_report.changed_ids.push_back(stored->id);
+        ++m_n_written;
+        spdlog::info(
+            "{} - {}: {}", m_n_written, stored->inserted ? "INSERTED" : "UPDATED", track.file_path
+        );
+      }
+    } catch (SQLite::Exception &e) {
+      spdlog::error("Failed to insert {}: {}", track.file_path, e.what());
+      ++m_report.n_failed;
+      Utils::add_to_counter(ScanCounter::WriteFailures);
+      m_interned.rollback(interned_mark);
+      // Some errors (e.g. SQLITE_FULL) make SQLite roll back the whole transaction
+      if (sqlite3_get_autocommit(m_db.getHandle()) != 0) {
+        spdlog::error("Batch of {} files was rolled back", m_batch_files + 1);
+        abort();
+        return;
+      }
+    }
+    ++m_batch_files;
+    if (m_batch_files >= m_options.batch_size or
+        std::chrono::steady_clock::now() - m_batch_start >= m_options.batch_interval)
+      commit();
+  }
+
+  /**
+   * Commit the current batch then write the album art of its albums.
+   */
+  void commit() {
+    if (not m_transaction.has_value())
+      return;
+    try {
+      Utils::StageTimer timer{ScanStage::Commit};
+      m_transaction->commit();
+    } catch (SQLite::Exception &e) {
+      spdlog::error("Failed to commit a batch of {} files: {}", m_batch_files, e.what());
+      abort();
+      return;
+    }
+    m_interned.commit();
+    Utils::add_to_counter(ScanCounter::BatchesCommitted);
+    Utils::add_to_counter(
+        ScanCounter::TracksWritten, m_batch_report.n_new + m_batch_report.n_updated
+    );
+    {
+      Utils::StageTimer timer{ScanStage::ArtWrite};
+      Utils::store_album_art(m_db, m_pending_art);
+    }
+    m_pending_art.clear();
+    m_transaction.reset();
+    m_report.n_new += m_batch_report.n_new;
+    m_report.n_updated += m_batch_report.n_updated;
+    m_report.changed_ids.insert(
+        m_report.changed_ids.end(), m_batch_report.changed_ids.begin(),
+        m_batch_report.changed_ids.end()
+    );
+    m_batch_report = {};
+  }
+
+  /**
+   * Counts of the committed files, skipped files are counted by the walker.
+   */
+  const ScanReport &report() const { return m_report; }
+
+  void count_failure() { ++m_report.n_failed; }
+
+  /**
+   * Files written so far, committed or not.
+   */
+  size_t n_written() const { return m_n_written; }
+
+ private:
+  void stamp(const TrackId id) {
+    Utils::CachedStatement stmt{m_db, "UPDATE t_tracks SET scan_gen = ? WHERE id = ?"};
+    stmt->bind(1, m_scan_gen);
+    stmt->bind(2, uint32_t(id));
+    stmt->exec();
+  }
+
+  void begin() {
+    m_transaction.emplace(m_db);
+    m_batch_files = 0;
+    m_batch_start = std::chrono::steady_clock::now();
+  }
+
+  /**
+   * Drop the current batch, the transaction's destructor rolls it back.
+   */
+  void abort() {
+    Utils::add_to_counter(ScanCounter::BatchesRolledBack);
+    m_report.n_failed += m_batch_report.n_new + m_batch_report.n_updated;
+    m_batch_report = {};
+    m_pending_art.clear();
+    m_interned.rollback(0);
+    m_transaction.reset();
+  }
+
+ private:
+  SQLite::Database &m_db;
+  const MDirId m_mdir_id;
+  const int64_t m_scan_gen;
+  const ScanOptions &m_options;
+  /**
+   * Artists and albums of the whole scan, the commits forget the rolled back ones.
+   */
+  Utils::InternTable m_interned;
+
+  std::optional<SQLite::Transaction> m_transaction = nullopt;
+  size_t m_batch_files                             = 0;
+  std::chrono::steady_clock::time_point m_batch_start{};
+  /**
+   * Album art is only written once the rows referencing it are committed.
+   */
+  std::map<AlbumId, TagLib::ByteVector> m_pending_art{};
+  /**
+   * Files of the current batch are only counted in `m_report` once it's committed.
+   */
+  ScanReport m_batch_report;
+  ScanReport m_report;
+  size_t m_n_written = 0;
+};
+
+/**
+ * `Utils::parse_track()`, timed and counted.
+ */
+optional<Utils::ParsedTrack> parse_file(
+    const string &path, const Utils::ParseOptions &options, ProgressReporter &progress
+) {
+  optional<Utils::ParsedTrack> res = nullopt;
+  {
+    Utils::StageTimer timer{ScanStage::Parse, path};
+    res = Utils::parse_track(path, options);
+  }
+  const uint64_t n_bytes = res.has_value() and res->fingerprint.has_value()
+                               ? uint64_t(std::max<int64_t>(res->fingerprint->size, 0))
+                               : 0;
+  progress.parsed(n_bytes);
+  Utils::add_to_counter(ScanCounter::FilesParsed);
+  Utils::add_to_counter(ScanCounter::BytesParsed, n_bytes);
+  if (not res.has_value())
+    Utils::add_to_counter(ScanCounter::ParseFailures);
+  return res;
+}
+
+ScanReport scan_serially(
+    SQLite::Database &db, const string &root, const MDirId mdir_id, const int64_t scan_gen,
+    const KnownTracks &known, const ScanOptions &options,
+    const Utils::ParseOptions &parse_options, WalkStats &stats, ProgressReporter &progress
+) {
+  BatchWriter writer{db, mdir_id, scan_gen, options};
+  walk_music_files(
+      root, known, stats, progress, options.stop_token,
+      [&](const fs::path &path) {
+        const auto track = parse_file(path, parse_options, progress);
+        if (track.has_value())
+          writer.write(*track);
+        else
+          writer.count_failure();
+        progress.report(ScanPhase::Scanning, writer.n_written());
+        return true;
+      },
+      [&] { progress.report(ScanPhase::Scanning, writer.n_written()); }
+  );
+  writer.commit();
+  return writer.report();
+}
+
+/**
+ * One thread walks the directory, `options.n_workers` threads parse the files and the calling
+ * thread, which owns `db`, writes the results in walk order.
+ */
+ScanReport scan_in_parallel(
+    SQLite::Database &db, const string &root, const MDirId mdir_id, const int64_t scan_gen,
+    const KnownTracks &known, const ScanOptions &options,
+    const Utils::ParseOptions &parse_options, WalkStats &stats, ProgressReporter &progress
+) {
+  Utils::BoundedQueue<ScanItem> paths{options.queue_capacity};
+  Utils::BoundedQueue<ScanResult> results{options.queue_capacity};
+  ReorderWindow window{options.queue_capacity};
+
+  std::jthread walker{[&] {
+    Utils::set_trace_thread_name("walker");
+    size_t seq = 0;
+    walk_music_files(root, known, stats, progress, options.stop_token, [&](const fs::path &path) {
+      return paths.push(ScanItem{seq++, path});
+    });
+    paths.close();
+  }};
+
+  std::atomic<size_t> n_running{options.n_workers};
+  vector<std::jthread> parsers{};
+  parsers.reserve(options.n_workers);
+  for (size_t w = 0; w < options.n_workers; ++w) {
+    parsers.emplace_back([&] {
+      Utils::set_trace_thread_name("parser");
+      while (auto item = paths.pop()) {
+        if (not window.wait_for(item->seq))
+          break;
+        auto track = parse_file(item->file_path, parse_options, progress);
+        if (not results.push(ScanResult{item->seq, std::move(track)}))
+          break;
+      }
+      if (--n_running == 0)
+        results.close();
+    });
+  }
+
+  // Parsers finish out of order, hold results back until all the previous ones are written,
+  // `window` bounds how many are held. Waiting for results times out so progress is reported
+  // and stops are noticed while the walker skips unchanged files.
+  BatchWriter writer{db, mdir_id, scan_gen, options};
+  std::map<size_t, ScanResult> pending{};
+  size_t next_seq     = 0;
+  const auto wait_for = std::max(options.progress_interval, std::chrono::milliseconds{1});
+  try {
+    while (true) {
+      bool timed_out = false;
+      auto res       = results.pop_for(wait_for, timed_out);
+      progress.report(ScanPhase::Scanning, writer.n_written());
+      if (options.stop_token.stop_requested())
+        break;
+      if (not res.has_value()) {
+        if (timed_out)
+          continue;
+        break;
+      }
+      pending.emplace(res->seq, std::move(*res));
+      const size_t first_seq = next_seq;
+      for (auto it = pending.begin(); it != pending.end() and it->first == next_seq;
+           it      = pending.erase(it), ++next_seq) {
+        if (it->second.track.has_value())
+          writer.write(*it->second.track);
+        else
+          writer.count_failure();
+      }
+      if (next_seq != first_seq)
+        window.advance(next_seq);
+    }
+    writer.commit();
+  } catch (...) {
+    // Unblock the other stages so they can be joined
+    paths.close();
+    results.close();
+    window.close();
+    throw;
+  }
+  // After a stop the other stages may still be running
+  paths.close();
+  results.close();
+  window.close();
+
+  // `stats` belongs to the walker until it's done
+  walker.join();
+  return writer.report();
+}
+
+}  // namespace
+
+optional<ScanReport> scan_directory(
+    SQLite::Database &db, const string &path, const ScanOptions &options
+) {
+  // The directory may have been removed or unmounted, e.g. when the watcher rescans
+  std::error_code ec;
+  const string abs_path{fs::canonical(path, ec)};
+  if (ec or not fs::is_directory(abs_path, ec)) {
+    spdlog::error("Path doesn't exists or is not a directory: {}", path);
+    return nullopt;
+  }
+  const optional<MDirId> id = insert_music_dir(db, abs_path);
+  if (not id.has_value())
+    return nullopt;
+  // The calling thread writes the tracks
+  Utils::set_trace_thread_name("scan");
+  Utils::TraceSpan span{"scan", abs_path};
+
+  // Counting is only worth it if someone looks at the estimate
+  ProgressReporter progress{abs_path, options};
+  if (progress.enabled()) {
+    progress.report(ScanPhase::Counting, 0);
+    Utils::TraceSpan count_span{"count"};
+    progress.set_n_files(count_music_files(abs_path, options.stop_token));
+  }
+  progress.report(ScanPhase::Scanning, 0);
+
+  const KnownTracks known = get_known_tracks(db, *id);
+  const int64_t scan_gen  = begin_scan_generation(db, *id);
+  // Each album's picture is extracted once, from the first of its tracks that has one
+  Utils::AlbumArtClaims art_claims{db};
+  Utils::ParseOptions parse_options{options.art_mode, options.read_style};
+  parse_options.art_claims = &art_claims;
+  WalkStats stats{};
+  ScanReport report =
+      options.n_workers == 0
+          ? scan_serially(
+                db, abs_path, *id, scan_gen, known, options, parse_options, stats, progress
+            )
+          : scan_in_parallel(
+                db, abs_path, *id, scan_gen, known, options, parse_options, stats, progress
+            );
+  report.n_skipped = stats.n_skipped;
+  report.cancelled = options.stop_token.stop_requested();
+  if (report.cancelled) {
+    spdlog::info("Scan of {} was stopped, missing tracks are kept", abs_path);
+  } else if (stats.complete) {
+    progress.report(ScanPhase::Removing, report.n_new + report.n_updated);
+    Utils::TraceSpan sweep_span{"sweep"};
+    try {
+      report.removed_ids = sweep_unvisited_tracks(db, *id, scan_gen, stats.visited);
+    } catch (SQLite::Exception &e) {
+      spdlog::error("Failed to remove the missing tracks of {}: {}", abs_path, e.what());
+    }
+  } else {
+    spdlog::warn("{} wasn't fully walked, missing tracks are kept", abs_path);
+  }
+  // Pictures that lazily stored art replaced
+  if (options.art_mode == ArtMode::Lazy)
+    Utils::remove_unused_art(db);
+  spdlog::info(
+      "Scanned {}: {} new, {} updated, {} skipped, {} failed, {} removed", abs_path, report.n_new,
+      report.n_updated, report.n_skipped, report.n_failed, report.removed_ids.size()
+  );
+  progress.report(ScanPhase::Done, report.n_new + report.n_updated);
+  return report;
+}
+
+vector<ScanReport> build_music_library(SQLite::Database &db, const ScanOptions &options) {
+  vector<ScanReport> res{};
+  const auto mdirs = get_all_music_dirs(db);
+  for (const auto &mdir : mdirs) {
+    if (options.stop_token.stop_requested())
+      break;
+    auto report = scan_directory(db, mdir.path, options);
+    if (report.has_value())
+      res.push_back(*report);
+  }
+  return res;
+}
+
+}  // namespace Midx
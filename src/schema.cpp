@@ -0,0 +1,180 @@
+#include "./schema.hpp"
+
+#include <array>
+#include <format>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+#include "./art_store.hpp"
+#include "./search.hpp"
+
+using std::string;
+
+namespace Midx {
+
+namespace {
+
+/**
+ * Add a column to a table created before the schema was versioned.
+ */
+void add_column_if_missing(
+    SQLite::Database &db, const string &table, const string &column, const string &definition
+) {
+  SQLite::Statement stmt{db, "SELECT EXISTS(SELECT 1 FROM pragma_table_info(?) WHERE name = ?)"};
+  stmt.bindNoCopy(1, table);
+  stmt.bindNoCopy(2, column);
+  stmt.executeStep();
+  if (stmt.getColumn(0).getInt() == 0)
+    db.exec(std::format("ALTER TABLE {} ADD COLUMN {} {}", table, column, definition));
+}
+
+/**
+ * Version 1, the schema as it was when versioning started. Databases made before have version
+ * 0 like new ones, so every step also upgrades whatever an older version of the library left.
+ */
+void create_tables(SQLite::Database &db) {
+  // Create music directories table
+  db.exec(R"--(
+    CREATE TABLE IF NOT EXISTS t_music_dirs (
+      id              INTEGER PRIMARY KEY AUTOINCREMENT,
+      path            TEXT NOT NULL UNIQUE,
+      scan_gen        INTEGER NOT NULL DEFAULT 0
+    );
+  )--");
+  // Incremented by each scan of the directory
+  add_column_if_missing(db, "t_music_dirs", "scan_gen", "INTEGER NOT NULL DEFAULT 0");
+  // Create artists table
+  db.exec(R"--(
+    CREATE TABLE IF NOT EXISTS t_artists (
+      id              INTEGER PRIMARY KEY AUTOINCREMENT,
+      name            TEXT NOT NULL UNIQUE
+    );
+  )--");
+  // Create albums table
+  db.exec(R"--(
+    CREATE TABLE IF NOT EXISTS t_albums (
+      id                         INTEGER PRIMARY KEY AUTOINCREMENT,
+      name                       TEXT NOT NULL,
+      artist_id                  INTEGER,
+      FOREIGN KEY(artist_id)     REFERENCES t_artists(id),
+      CONSTRAINT unique_artist_album UNIQUE (name, artist_id)
+    );
+  )--");
+  // Create tracks table
+  db.exec(R"--(
+    CREATE TABLE IF NOT EXISTS t_tracks (
+      id                         INTEGER PRIMARY KEY AUTOINCREMENT,
+      file_path                  TEXT NOT NULL UNIQUE,
+      parent_dir_id              INTEGER NOT NULL,
+      mtime_ns                   INTEGER,
+      size                       INTEGER,
+      dev                        INTEGER,
+      inode                      INTEGER,
+      scan_gen                   INTEGER,
+      FOREIGN KEY(parent_dir_id) REFERENCES t_music_dirs(id)
+    );
+  )--");
+  // File fingerprints, used to skip unchanged files when rescanning
+  for (const auto *column : {"mtime_ns", "size", "dev", "inode"})
+    add_column_if_missing(db, "t_tracks", column, "INTEGER");
+  // Last scan that found the file, the ones a scan didn't find are removed
+  add_column_if_missing(db, "t_tracks", "scan_gen", "INTEGER");
+
+  // Create tracks' metadata table
+  db.exec(R"--(
+    CREATE TABLE IF NOT EXISTS t_tracks_metadata (
+      track_id                   INTEGER PRIMARY KEY,
+      title                      TEXT NOT NULL,
+      track_num                  INTEGER,
+      artist_id                  INTEGER,
+      album_id                   INTEGER,
+      FOREIGN KEY(track_id)      REFERENCES t_tracks(id),
+      FOREIGN KEY(artist_id)     REFERENCES t_artists(id),
+      FOREIGN KEY(album_id)      REFERENCES t_albums(id)
+    );
+  )--");
+  // Indexes of the sorted listings (see `get_tracks_page()`), the rowid ends every index so
+  // ties are ordered by id
+  db.exec(R"--(
+    CREATE INDEX IF NOT EXISTS idx_tracks_metadata_title ON t_tracks_metadata(title);
+    CREATE INDEX IF NOT EXISTS idx_tracks_metadata_artist ON t_tracks_metadata(artist_id, title);
+    CREATE INDEX IF NOT EXISTS idx_tracks_metadata_album
+      ON t_tracks_metadata(album_id, IFNULL(track_num, -1));
+    CREATE INDEX IF NOT EXISTS idx_albums_name ON t_albums(name);
+  )--");
+  // Create tracks' audio properties table
+  const bool had_properties = db.tableExists("t_tracks_properties");
+  db.exec(R"--(
+    CREATE TABLE IF NOT EXISTS t_tracks_properties (
+      track_id                   INTEGER PRIMARY KEY,
+      duration_ms                INTEGER NOT NULL,
+      bitrate                    INTEGER NOT NULL,
+      sample_rate                INTEGER NOT NULL,
+      channels                   INTEGER NOT NULL,
+      codec                      TEXT NOT NULL,
+      FOREIGN KEY(track_id)      REFERENCES t_tracks(id) ON DELETE CASCADE
+    );
+  )--");
+  // Tracks stored by older versions have no properties, forgetting their fingerprint makes
+  // the next scan parse them again
+  if (not had_properties)
+    db.exec("UPDATE t_tracks SET mtime_ns = NULL, size = NULL, dev = NULL, inode = NULL");
+  // Album art
+  Utils::init_art_tables(db);
+  // Full-text search
+  Utils::init_search_tables(db);
+}
+
+/**
+ * Version 2, indexes of the foreign keys that weren't covered by another index. Without them,
+ * scanning or removing a music directory reads the whole of `t_tracks`, and deleting a track
+ * or a picture reads the whole art table referencing it to enforce the foreign key.
+ */
+void index_foreign_keys(SQLite::Database &db) {
+  db.exec(R"--(
+    CREATE INDEX idx_tracks_parent_dir ON t_tracks(parent_dir_id);
+    CREATE INDEX idx_albums_artist ON t_albums(artist_id);
+    CREATE INDEX idx_albums_art_hash ON t_albums_art(art_hash);
+    CREATE INDEX idx_albums_embedded_art_track ON t_albums_embedded_art(track_id);
+  )--");
+}
+
+/**
+ * Migration `i` brings a database from version `i` to version `i + 1`.
+ */
+constexpr std::array<void (*)(SQLite::Database &), Utils::schema_version> migrations{
+    create_tables,
+    index_foreign_keys,
+};
+
+}  // namespace
+
+int Utils::get_schema_version(SQLite::Database &db) {
+  return db.execAndGet("PRAGMA user_version").getInt();
+}
+
+bool Utils::migrate_database(SQLite::Database &db) {
+  // Up to date, which is the common case, without taking the write lock
+  if (get_schema_version(db) == schema_version)
+    return true;
+  SQLite::Transaction transaction{db, SQLite::TransactionBehavior::IMMEDIATE};
+  // Read again under the lock, another connection may have upgraded it meanwhile
+  const int version = get_schema_version(db);
+  if (version > schema_version) {
+    spdlog::error(
+        "The database has schema version {}, newer than this library's ({})", version,
+        schema_version
+    );
+    return false;
+  }
+  for (int i = version; i < schema_version; ++i) {
+    spdlog::debug("Migrating the database to schema version {}", i + 1);
+    migrations[size_t(i)](db);
+  }
+  db.exec(std::format("PRAGMA user_version = {}", schema_version));
+  transaction.commit();
+  return true;
+}
+
+}  // namespace Midx
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+/*
+ * Versions of the database schema: `PRAGMA user_version` holds the number of migrations applied
+ * to a database, `init_database()` applies the missing ones in order. A migration is never
+ * changed once released, changes to the schema are made by adding one.
+ */
+
+namespace Midx::Utils {
+
+/**
+ * Version of the databases this library creates, the number of migrations.
+ */
+inline constexpr int schema_version = 2;
+
+int get_schema_version(SQLite::Database &db);
+
+/**
+ * Bring the database to `schema_version`. The pending migrations run in a single transaction
+ * so an upgrade is either complete or not started, concurrent upgrades of the same file are
+ * serialized by its write lock. Returns false if the database was made by a newer version.
+ */
+bool migrate_database(SQLite::Database &db);
+
+}  // namespace Midx::Utils
@@ -0,0 +1,131 @@
+#include "./search.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "./midx.hpp"
+#include "./statement_cache.hpp"
+
+using std::string;
+using std::vector;
+
+namespace Midx {
+
+void Utils::init_search_tables(SQLite::Database &db) {
+  const bool had_fts = db.tableExists("t_tracks_fts");
+  // Accents are removed from both the indexed text and the queries ("beyonce" finds
+  // "Beyoncé"), 2 and 3 characters prefixes are indexed so prefix queries stay cheap
+  db.exec(R"--(
+    CREATE VIRTUAL TABLE IF NOT EXISTS t_tracks_fts USING fts5(
+      title, artist, album,
+      tokenize = 'unicode61 remove_diacritics 2',
+      prefix = '2 3'
+    );
+  )--");
+  // `INSERT OR REPLACE` doesn't fire delete triggers, the replaced row is removed here
+  db.exec(R"--(
+    CREATE TRIGGER IF NOT EXISTS tr_tracks_fts_insert AFTER INSERT ON t_tracks_metadata
+    BEGIN
+      DELETE FROM t_tracks_fts WHERE rowid = new.track_id;
+      INSERT INTO t_tracks_fts (rowid, title, artist, album) VALUES (
+        new.track_id, new.title,
+        (SELECT name FROM t_artists WHERE id = new.artist_id),
+        (SELECT name FROM t_albums WHERE id = new.album_id)
+      );
+    END;
+  )--");
+  db.exec(R"--(
+    CREATE TRIGGER IF NOT EXISTS tr_tracks_fts_update AFTER UPDATE ON t_tracks_metadata
+    BEGIN
+      DELETE FROM t_tracks_fts WHERE rowid = old.track_id;
+      INSERT INTO t_tracks_fts (rowid, title, artist, album) VALUES (
+        new.track_id, new.title,
+        (SELECT name FROM t_artists WHERE id = new.artist_id),
+        (SELECT name FROM t_albums WHERE id = new.album_id)
+      );
+    END;
+  )--");
+  db.exec(R"--(
+    CREATE TRIGGER IF NOT EXISTS tr_tracks_fts_delete AFTER DELETE ON t_tracks_metadata
+    BEGIN
+      DELETE FROM t_tracks_fts WHERE rowid = old.track_id;
+    END;
+  )--");
+  // Renamed artists and albums
+  db.exec(R"--(
+    CREATE TRIGGER IF NOT EXISTS tr_tracks_fts_artist AFTER UPDATE OF name ON t_artists
+    BEGIN
+      UPDATE t_tracks_fts SET artist = new.name
+      WHERE rowid IN (SELECT track_id FROM t_tracks_metadata WHERE artist_id = new.id);
+    END;
+  )--");
+  db.exec(R"--(
+    CREATE TRIGGER IF NOT EXISTS tr_tracks_fts_album AFTER UPDATE OF name ON t_albums
+    BEGIN
+      UPDATE t_tracks_fts SET album = new.name
+      WHERE rowid IN (SELECT track_id FROM t_tracks_metadata WHERE album_id = new.id);
+    END;
+  )--");
+  // Databases created by older versions already have tracks
+  if (not had_fts) {
+    db.exec(R"--(
+      INSERT INTO t_tracks_fts (rowid, title, artist, album)
+      SELECT tm.track_id, tm.title, ar.name, al.name
+      FROM t_tracks_metadata tm
+      LEFT JOIN t_artists ar ON ar.id = tm.artist_id
+      LEFT JOIN t_albums al ON al.id = tm.album_id
+    )--");
+  }
+}
+
+string Utils::make_fts_query(const string &text) {
+  static constexpr const char *spaces = " \t\n\r\f\v";
+  string res{};
+  size_t pos = text.find_first_not_of(spaces);
+  while (pos != string::npos) {
+    const size_t end = std::min(text.find_first_of(spaces, pos), text.size());
+    if (not res.empty())
+      res += ' ';
+    res += '"';
+    for (size_t i = pos; i < end; ++i) {
+      if (text[i] == '"')
+        res += '"';
+      res += text[i];
+    }
+    res += "\"*";
+    pos = text.find_first_not_of(spaces, end);
+  }
+  return res;
+}
+
+/**
+ * Ids of the tracks whose title, artist or album match `query`, best matches first.
+ */
+vector<TrackId> search(SQLite::Database &db, const string &query, const size_t limit) {
+  vector<TrackId> res{};
+  const string fts_query = Utils::make_fts_query(query);
+  if (fts_query.empty() or limit == 0)
+    return res;
+  // A match in the title weighs more than one in the artist or album
+  Utils::CachedStatement stmt{db, R"--(
+    SELECT rowid FROM t_tracks_fts WHERE t_tracks_fts MATCH ?
+    ORDER BY bm25(t_tracks_fts, 2.0, 1.0, 1.0)
+    LIMIT ?
+  )--"};
+  stmt->bind(1, fts_query);
+  stmt->bind(2, int64_t(std::min<size_t>(limit, std::numeric_limits<int64_t>::max())));
+  try {
+    while (stmt->executeStep())
+      res.push_back(stmt->getColumn(0).getUInt());
+  } catch (SQLite::Exception &e) {
+    spdlog::error("Search for '{}' failed: {}", query, e.what());
+    res.clear();
+  }
+  return res;
+}
+
+}  // namespace Midx
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+/*
+ * Full-text search: `t_tracks_fts` is an FTS5 table holding the title, artist and album of each
+ * track that has metadata, its rowid is the track's id. Triggers on `t_tracks_metadata`,
+ * `t_artists` and `t_albums` keep it in sync.
+ */
+
+namespace Midx::Utils {
+
+/**
+ * Create the search table and its triggers, the table is filled from the existing metadata
+ * when it's created.
+ */
+void init_search_tables(SQLite::Database &db);
+
+/**
+ * Turn what a user typed into an FTS5 query: every word has to be the beginning of a word of
+ * the title, artist or album. Words are quoted so FTS5's syntax isn't interpreted.
+ */
+std::string make_fts_query(const std::string &text);
+
+}  // namespace Midx::Utils
@@ -0,0 +1,104 @@
+#include "./statement_cache.hpp"
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <sqlite3.h>
+
+namespace Midx {
+
+/**
+ * Shared with the `CachedStatement` borrowing it, so it outlives the cache if the connection
+ * is closed while it's borrowed.
+ */
+struct Utils::StatementCacheEntry {
+  std::unique_ptr<SQLite::Statement> stmt;
+  bool in_use = false;
+};
+
+namespace {
+
+/**
+ * Allows looking up the cache with the `const char *` given by the caller without
+ * building a `std::string`.
+ */
+struct SqlHash {
+  using is_transparent = void;
+
+  size_t operator()(const std::string_view sql) const {
+    return std::hash<std::string_view>{}(sql);
+  }
+};
+
+using Entry = Utils::StatementCacheEntry;
+
+using StatementCache =
+    std::unordered_map<std::string, std::shared_ptr<Entry>, SqlHash, std::equal_to<>>;
+
+std::mutex cache_mutex{};
+/**
+ * Cached statements of each open connection.
+ */
+std::unordered_map<sqlite3 *, StatementCache> caches{};
+
+/**
+ * Called by SQLite when a connection is closing, before it checks that all the statements are
+ * finalized, so the cache is dropped with the connection and a later connection at the same
+ * address starts with an empty one.
+ */
+int on_connection_close(const unsigned /*type*/, void * /*context*/, void *handle, void *) {
+  StatementCache cache{};
+  {
+    std::lock_guard lock{cache_mutex};
+    const auto it = caches.find(static_cast<sqlite3 *>(handle));
+    if (it == caches.end())
+      return 0;
+    cache = std::move(it->second);
+    caches.erase(it);
+  }
+  // Finalized outside of the lock, borrowed statements are finalized by their borrower
+  return 0;
+}
+
+}  // namespace
+
+Utils::CachedStatement::CachedStatement(SQLite::Database &db, const char *sql) {
+  {
+    std::lock_guard lock{cache_mutex};
+    auto [cache_it, inserted] = caches.try_emplace(db.getHandle());
+    // The connection's trace callback is taken to be told when it closes
+    if (inserted)
+      sqlite3_trace_v2(db.getHandle(), SQLITE_TRACE_CLOSE, on_connection_close, nullptr);
+    StatementCache &cache = cache_it->second;
+    auto it               = cache.find(std::string_view{sql});
+    if (it == cache.end()) {
+      auto entry = std::make_shared<Entry>(std::make_unique<SQLite::Statement>(db, sql));
+      it         = cache.emplace(sql, std::move(entry)).first;
+    }
+    if (not it->second->in_use) {
+      it->second->in_use = true;
+      m_entry            = it->second;
+      m_stmt             = m_entry->stmt.get();
+      return;
+    }
+  }
+  m_uncached = std::make_unique<SQLite::Statement>(db, sql);
+  m_stmt     = m_uncached.get();
+}
+
+Utils::CachedStatement::~CachedStatement() {
+  if (m_entry == nullptr)
+    return;
+  m_stmt->tryReset();
+  try {
+    // Bindings made with bindNoCopy() point to the caller's strings
+    m_stmt->clearBindings();
+  } catch (SQLite::Exception &) {
+  }
+  std::lock_guard lock{cache_mutex};
+  m_entry->in_use = false;
+}
+
+}  // namespace Midx
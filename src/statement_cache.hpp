@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+namespace Midx::Utils {
+
+struct StatementCacheEntry;
+
+/**
+ * A prepared statement borrowed from the cache of its connection, so the SQL is only parsed
+ * and planned the first time it's used. It is reset and its bindings are cleared when it goes
+ * out of scope, a statement that is kept stepping would otherwise hold a read transaction open.
+ *
+ * If the cached statement is already borrowed (a nested call, or another thread using the same
+ * connection) a new statement is prepared for this use only.
+ *
+ * The cache of a connection is finalized when the connection is closed, through its
+ * `SQLITE_TRACE_CLOSE` callback: a trace callback set on the connection by someone else stops
+ * that, and the connection then can't be closed.
+ */
+class CachedStatement {
+ public:
+  CachedStatement(SQLite::Database &db, const char *sql);
+  ~CachedStatement();
+
+  CachedStatement(const CachedStatement &)            = delete;
+  CachedStatement &operator=(const CachedStatement &) = delete;
+
+  SQLite::Statement &operator*() { return *m_stmt; }
+
+  SQLite::Statement *operator->() { return m_stmt; }
+
+ private:
+  std::shared_ptr<StatementCacheEntry> m_entry  = nullptr;
+  std::unique_ptr<SQLite::Statement> m_uncached = nullptr;
+  SQLite::Statement *m_stmt                     = nullptr;
+};
+
+}  // namespace Midx::Utils
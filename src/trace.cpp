@@ -0,0 +1,169 @@
+#include "./trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+namespace Midx {
+
+namespace {
+
+struct TraceEvent {
+  const char *name;
+  /**
+   * Since tracing started.
+   */
+  int64_t start_ns;
+  int64_t duration_ns;
+  /**
+   * The end of the detail (e.g. a file's path), null terminated.
+   */
+  std::array<char, 48> detail;
+};
+
+/**
+ * Events of one thread, only that thread writes to it. `n_written` is published after the
+ * event so the buffer can be read once the thread is done.
+ */
+struct ThreadBuffer {
+  explicit ThreadBuffer(const size_t capacity, const size_t id_)
+      : events(capacity), id{id_}, name{"thread " + std::to_string(id_)} {}
+
+  std::vector<TraceEvent> events;
+  std::atomic<uint64_t> n_written{0};
+  const size_t id;
+  std::string name;
+};
+
+std::mutex buffers_mutex{};
+/**
+ * Buffers of the current recording, they are kept until the next one starts since exited
+ * threads (e.g. the parsers of a scan) still have events to write.
+ */
+std::vector<std::unique_ptr<ThreadBuffer>> buffers{};
+size_t events_per_buffer = 0;
+std::chrono::steady_clock::time_point tracing_start{};
+/**
+ * Incremented by every recording, a thread's buffer belongs to the recording it was made for.
+ */
+std::atomic<uint64_t> generation{0};
+
+struct ThisThread {
+  uint64_t generation  = 0;
+  ThreadBuffer *buffer = nullptr;
+};
+thread_local ThisThread this_thread{};
+
+ThreadBuffer *get_thread_buffer() {
+  const uint64_t current = generation.load(std::memory_order_acquire);
+  if (this_thread.generation != current) {
+    std::lock_guard lock{buffers_mutex};
+    buffers.push_back(std::make_unique<ThreadBuffer>(events_per_buffer, buffers.size() + 1));
+    this_thread = {current, buffers.back().get()};
+  }
+  return this_thread.buffer;
+}
+
+std::string escape_json(const std::string_view s) {
+  std::string res{};
+  for (const char c : s) {
+    if (c == '"' or c == '\\')
+      res += '\\';
+    if (uint8_t(c) < 0x20)
+      res += std::format("\\u{:04x}", int(c));
+    else
+      res += c;
+  }
+  return res;
+}
+
+}  // namespace
+
+void start_tracing(const size_t events_per_thread) {
+  std::lock_guard lock{buffers_mutex};
+  buffers.clear();
+  events_per_buffer = std::max<size_t>(events_per_thread, 1);
+  tracing_start     = std::chrono::steady_clock::now();
+  generation.fetch_add(1, std::memory_order_release);
+  Utils::tracing_enabled.store(true, std::memory_order_relaxed);
+}
+
+bool stop_tracing(const std::string &path) {
+  Utils::tracing_enabled.store(false, std::memory_order_relaxed);
+  std::lock_guard lock{buffers_mutex};
+  std::ofstream out{path};
+  if (not out) {
+    spdlog::error("Failed to write the trace to {}", path);
+    return false;
+  }
+  uint64_t n_dropped = 0;
+  out << "{\"traceEvents\": [";
+  bool first = true;
+  for (const auto &buffer : buffers) {
+    out << std::format(
+        "{}\n{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": {}, \"args\": "
+        "{{\"name\": \"{}\"}}}}",
+        first ? "" : ",", buffer->id, escape_json(buffer->name)
+    );
+    first = false;
+    // Once full, the oldest events were overwritten
+    const uint64_t n_written = buffer->n_written.load(std::memory_order_acquire);
+    const uint64_t capacity  = buffer->events.size();
+    const uint64_t begin     = n_written > capacity ? n_written - capacity : 0;
+    n_dropped += begin;
+    for (uint64_t i = begin; i < n_written; ++i) {
+      const TraceEvent &e = buffer->events[i % capacity];
+      out << std::format(
+          ",\n{{\"name\": \"{}\", \"cat\": \"scan\", \"ph\": \"X\", \"ts\": {:.3f}, \"dur\": "
+          "{:.3f}, \"pid\": 1, \"tid\": {}",
+          e.name, double(e.start_ns) / 1e3, double(e.duration_ns) / 1e3, buffer->id
+      );
+      if (e.detail[0] != '\0')
+        out << std::format(", \"args\": {{\"detail\": \"{}\"}}", escape_json(e.detail.data()));
+      out << '}';
+    }
+  }
+  out << std::format("\n], \"otherData\": {{\"dropped_events\": {}}}}}\n", n_dropped);
+  if (n_dropped > 0)
+    spdlog::warn("{} trace events were overwritten, the buffers were too small", n_dropped);
+  return bool(out);
+}
+
+void Utils::record_span(
+    const char *name, const std::chrono::steady_clock::time_point start,
+    const std::chrono::steady_clock::time_point end, const std::string_view detail
+) {
+  if (not is_tracing())
+    return;
+  using std::chrono::nanoseconds;
+  ThreadBuffer *buffer = get_thread_buffer();
+  const uint64_t n     = buffer->n_written.load(std::memory_order_relaxed);
+  TraceEvent &e        = buffer->events[n % buffer->events.size()];
+  e.name               = name;
+  e.start_ns           = std::chrono::duration_cast<nanoseconds>(start - tracing_start).count();
+  e.duration_ns        = std::chrono::duration_cast<nanoseconds>(end - start).count();
+  // The end of a path tells more than its start, without cutting a UTF-8 character in half
+  const size_t max_size = e.detail.size() - 1;
+  size_t from           = detail.size() > max_size ? detail.size() - max_size : 0;
+  while (from < detail.size() and (uint8_t(detail[from]) & 0xc0) == 0x80)
+    ++from;
+  const size_t size = detail.size() - from;
+  if (size > 0)
+    std::memcpy(e.detail.data(), detail.data() + from, size);
+  e.detail[size] = '\0';
+  buffer->n_written.store(n + 1, std::memory_order_release);
+}
+
+void Utils::set_trace_thread_name(const std::string &name) {
+  if (is_tracing())
+    get_thread_buffer()->name = name;
+}
+
+}  // namespace Midx
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace Midx {
+
+/**
+ * Start recording the spans of the scans (each stage of each file, commits...) with the thread
+ * they ran on. Every thread writes to its own ring buffer of `events_per_thread` events without
+ * locking, the oldest events are overwritten once it's full. Previous recordings are dropped.
+ *
+ * Tracing must not be started or stopped while a scan is running.
+ */
+void start_tracing(const size_t events_per_thread = 1 << 15);
+
+/**
+ * Stop recording and write what was recorded to `path` as Chrome trace JSON, which Perfetto
+ * (ui.perfetto.dev) and chrome://tracing open. Returns false if it couldn't be written.
+ */
+bool stop_tracing(const std::string &path);
+
+namespace Utils {
+
+inline std::atomic<bool> tracing_enabled{false};
+
+inline bool is_tracing() { return tracing_enabled.load(std::memory_order_relaxed); }
+
+/**
+ * Record a span in this thread's buffer, `name` must outlive the recording (a literal) and only
+ * the end of `detail` is kept. Does nothing if tracing is off.
+ */
+void record_span(
+    const char *name, const std::chrono::steady_clock::time_point start,
+    const std::chrono::steady_clock::time_point end, const std::string_view detail = {}
+);
+
+/**
+ * Name shown for this thread in the trace.
+ */
+void set_trace_thread_name(const std::string &name);
+
+/**
+ * Records the time from its construction to its destruction as a span, if tracing is on.
+ */
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char *name, const std::string_view detail = {})
+      : m_name{name}, m_detail{detail} {
+    if (is_tracing())
+      m_start = std::chrono::steady_clock::now();
+  }
+  ~TraceSpan() {
+    if (m_start != std::chrono::steady_clock::time_point{})
+      record_span(m_name, m_start, std::chrono::steady_clock::now(), m_detail);
+  }
+
+  TraceSpan(const TraceSpan &)            = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+ private:
+  const char *m_name;
+  std::string_view m_detail;
+  std::chrono::steady_clock::time_point m_start{};
+};
+
+}  // namespace Utils
+
+}  // namespace Midx
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <optional>
 #include <string>
+#include <vector>
 #include <SQLiteCpp/SQLiteCpp.h>
 
 namespace Midx {
@@ -11,6 +13,32 @@ using ArtistId = size_t;
 using AlbumId  = size_t;
 using TrackId  = size_t;
 
+/**
+ * How scans handle album art.
+ */
+enum class ArtMode {
+  /**
+   * Pictures are copied to `Midx::data_dir` while scanning.
+   */
+  Eager,
+  /**
+   * Only where the picture is in the audio file is stored, it's read when requested (see
+   * `Midx::get_album_art()`). Pictures that can't be read in place, e.g. in unsynchronised
+   * ID3v2 tags, are still copied.
+   */
+  Lazy,
+};
+
+/**
+ * How much of a file TagLib reads to find its audio properties, slower styles are more
+ * accurate for files without a header giving the duration (e.g. VBR MP3 without a Xing header).
+ */
+enum class ReadStyle {
+  Fast,
+  Average,
+  Accurate,
+};
+
 class MusicDir {
  public:
   MusicDir(const MDirId id_, const std::string &path_) : id{id_}, path{path_} {}
@@ -85,18 +113,62 @@ class TrackMetadata {
   const std::optional<AlbumId> album_id;
 };
 
+/**
+ * Represents a track's audio properties, read when the file was indexed.
+ */
+class AudioProperties {
+ public:
+  AudioProperties(const AudioProperties &other) = default;
+
+  explicit AudioProperties(
+      const TrackId track_id_, const size_t duration_ms_, const size_t bitrate_,
+      const size_t sample_rate_, const size_t channels_, const std::string &codec_
+  )
+      : track_id{track_id_},
+        duration_ms{duration_ms_},
+        bitrate{bitrate_},
+        sample_rate{sample_rate_},
+        channels{channels_},
+        codec{codec_} {}
+
+ public:
+  /**
+   * Id of the track the properties belong to.
+   */
+  const TrackId track_id;
+  /**
+   * Duration in milliseconds.
+   */
+  const size_t duration_ms;
+  /**
+   * Average bitrate in kb/s.
+   */
+  const size_t bitrate;
+  /**
+   * Sample rate in Hz.
+   */
+  const size_t sample_rate;
+  const size_t channels;
+  /**
+   * Name of the codec, e.g. "FLAC", "MP3" or "AAC".
+   */
+  const std::string codec;
+};
+
 class Track {
  public:
   /**
-   * The constructor, it does not initialise the `metadata` field, call
-   * `Track::update_metadata()` for that.
+   * The constructor, it does not initialise the `metadata` and `properties` fields, call
+   * `Track::update_metadata()` and `Track::update_properties()` for that.
    */
   Track(const TrackId id_, const std::string &file_path_, const MDirId parent_dir_id_)
       : id{id_}, file_path{file_path_}, parent_dir_id{parent_dir_id_} {}
 
   const std::optional<TrackMetadata> &get_metadata() const { return m_metadata; }
+  const std::optional<AudioProperties> &get_properties() const { return m_properties; }
 
   void update_metadata(const TrackMetadata &metadata_) { m_metadata.emplace(metadata_); }
+  void update_properties(const AudioProperties &properties_) { m_properties.emplace(properties_); }
 
  public:
   const TrackId id;
@@ -104,7 +176,71 @@ class Track {
   const MDirId parent_dir_id;
 
  private:
-  std::optional<TrackMetadata> m_metadata = std::nullopt;
+  std::optional<TrackMetadata> m_metadata     = std::nullopt;
+  std::optional<AudioProperties> m_properties = std::nullopt;
+};
+
+/**
+ * Orders tracks can be listed in, see `Midx::get_tracks_page()`.
+ */
+enum class TrackOrder {
+  /**
+   * By title, tracks without metadata are not listed.
+   */
+  Title,
+  /**
+   * By artist's name then title, tracks without an artist are not listed.
+   */
+  Artist,
+  /**
+   * By album's name then track number, tracks without an album are not listed.
+   */
+  Album,
+  /**
+   * Most recently added first.
+   */
+  RecentlyAdded,
+};
+
+/**
+ * Orders artists and albums can be listed in.
+ */
+enum class ListOrder {
+  Name,
+  RecentlyAdded,
+};
+
+/**
+ * Sort key of the last item of a page, the next page starts right after it so it costs the same
+ * to fetch wherever it is. Only meaningful with the order it was returned for.
+ */
+struct PageCursor {
+  /**
+   * Name of the artist, album...
+   */
+  std::string name;
+  /**
+   * Title of the track, when tracks are ordered by title or artist.
+   */
+  std::string title;
+  int64_t album_id = 0;
+  /**
+   * -1 for tracks without a number.
+   */
+  int64_t track_number = -1;
+  int64_t id           = 0;
+};
+
+/**
+ * Items of a paginated listing.
+ */
+template <typename T>
+struct Page {
+  std::vector<T> items;
+  /**
+   * Where the next page starts, `nullopt` on the last page.
+   */
+  std::optional<PageCursor> next;
 };
 
 }  // namespace Midx
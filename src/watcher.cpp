@@ -0,0 +1,399 @@
+#include "./watcher.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <unordered_map>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+#include <SQLiteCpp/Savepoint.h>
+
+#include "./art_store.hpp"
+#include "./internal.hpp"
+#include "./statement_cache.hpp"
+#include "./midx.hpp"
+
+namespace fs = std::filesystem;
+
+using std::string;
+using std::vector;
+
+namespace Midx {
+
+namespace {
+
+constexpr uint32_t watch_mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |
+                                IN_DELETE | IN_ONLYDIR;
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Ids of the tracks whose path starts with `dir_path + '/'`.
+ */
+vector<TrackId> get_ids_of_tracks_under(SQLite::Database &db, const string &dir_path) {
+  vector<TrackId> res{};
+  // '0' comes right after '/', this is a range scan on the file_path index
+  Utils::CachedStatement stmt{db, "SELECT id FROM t_tracks WHERE file_path > ? AND file_path < ?"};
+  stmt->bind(1, dir_path + '/');
+  stmt->bind(2, dir_path + '0');
+  while (stmt->executeStep()) {
+    res.push_back(stmt->getColumn(0).getUInt());
+  }
+  return res;
+}
+
+}  // namespace
+
+/**
+ * Everything owned by a running watcher.
+ */
+class Watcher::State {
+ public:
+  State(const string &db_path, const Utils::ParseOptions &parse_options_)
+      : db{db_path, SQLite::OPEN_READWRITE},
+        parse_options{parse_options_},
+        inotify_fd{inotify_init1(IN_NONBLOCK | IN_CLOEXEC)},
+        stop_fd{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)} {}
+
+  ~State() {
+    if (inotify_fd >= 0)
+      close(inotify_fd);
+    if (stop_fd >= 0)
+      close(stop_fd);
+  }
+
+  State(const State &)            = delete;
+  State &operator=(const State &) = delete;
+
+  /**
+   * Watch `dir` and all its sub-directories. If `queue_files` is set the music files found
+   * are queued, they may have been written before the watch was added.
+   */
+  void add_watches(const string &dir, const MDirId mdir_id, const bool queue_files) {
+    add_watch(dir, mdir_id);
+    std::error_code ec;
+    auto it =
+        fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied, ec);
+    for (; not ec and it != fs::recursive_directory_iterator{}; it.increment(ec)) {
+      std::error_code entry_ec;
+      if (it->is_directory(entry_ec) and not it->is_symlink(entry_ec))
+        add_watch(it->path(), mdir_id);
+      else if (queue_files and it->is_regular_file(entry_ec) and
+               Utils::is_supported_file_type(it->path()))
+        queue(it->path(), mdir_id);
+    }
+    if (ec)
+      spdlog::error("Error while watching {}: {}", dir, ec.message());
+  }
+
+  /**
+   * Stop watching `dir` and its sub-directories, their paths are about to become stale.
+   */
+  void remove_watches(const string &dir) {
+    const string prefix = dir + '/';
+    for (auto it = watches.begin(); it != watches.end();) {
+      const string &path = it->second.path;
+      if (path == dir or path.starts_with(prefix)) {
+        inotify_rm_watch(inotify_fd, it->first);
+        it = watches.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  /**
+   * Read the available events and queue the changes they describe.
+   */
+  void read_events() {
+    alignas(inotify_event) char buf[16 * 1024];
+    while (true) {
+      const ssize_t len = read(inotify_fd, buf, sizeof(buf));
+      if (len <= 0) {
+        if (len < 0 and errno != EAGAIN and errno != EINTR)
+          spdlog::error("Failed to read inotify events: {}", strerror(errno));
+        return;
+      }
+      for (char *ptr = buf; ptr < buf + len;) {
+        const auto *event = reinterpret_cast<const inotify_event *>(ptr);
+        handle_event(*event);
+        ptr += sizeof(inotify_event) + event->len;
+      }
+    }
+  }
+
+  bool has_pending_changes() const {
+    return needs_rescan or not changed_files.empty() or not removed_dirs.empty();
+  }
+
+  /**
+   * When the pending changes should be applied.
+   */
+  Clock::time_point deadline(const WatcherOptions &options) const {
+    return std::min(last_event + options.debounce, first_event + options.max_delay);
+  }
+
+  /**
+   * Apply the pending changes in one transaction.
+   */
+  void flush() {
+    // Nothing may escape the watcher's thread, changes that failed are dropped rather than
+    // retried forever
+    try {
+      if (needs_rescan) {
+        // Events were lost, rescanning only parses the files that changed
+        spdlog::warn("inotify queue overflowed, rescanning the music directories");
+        ScanOptions options{};
+        options.art_mode   = parse_options.art_mode;
+        options.read_style = parse_options.read_style;
+        build_music_library(db, options);
+      } else if (has_pending_changes()) {
+        apply_changes();
+      }
+    } catch (const std::exception &e) {
+      spdlog::error("Failed to apply the changes: {}", e.what());
+    }
+    needs_rescan = false;
+    changed_files.clear();
+    removed_dirs.clear();
+  }
+
+ private:
+  struct WatchedDir {
+    string path;
+    MDirId mdir_id;
+  };
+
+  void add_watch(const string &dir, const MDirId mdir_id) {
+    const int wd = inotify_add_watch(inotify_fd, dir.c_str(), watch_mask);
+    if (wd < 0) {
+      spdlog::error("Failed to watch {}: {}", dir, strerror(errno));
+      return;
+    }
+    watches.insert_or_assign(wd, WatchedDir{dir, mdir_id});
+  }
+
+  void queue(const string &path, const MDirId mdir_id) {
+    if (not has_pending_changes())
+      first_event = Clock::now();
+    last_event = Clock::now();
+    changed_files.insert_or_assign(path, mdir_id);
+  }
+
+  void handle_event(const inotify_event &event) {
+    if (event.mask & IN_Q_OVERFLOW) {
+      if (not has_pending_changes())
+        first_event = Clock::now();
+      last_event   = Clock::now();
+      needs_rescan = true;
+      return;
+    }
+    const auto it = watches.find(event.wd);
+    if (it == watches.end())
+      return;
+    if (event.mask & IN_IGNORED) {
+      watches.erase(it);
+      return;
+    }
+    if (event.len == 0)
+      return;
+
+    const string path    = it->second.path + '/' + event.name;
+    const MDirId mdir_id = it->second.mdir_id;
+    if (event.mask & IN_ISDIR) {
+      if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+        add_watches(path, mdir_id, true);
+      } else if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+        remove_watches(path);
+        if (not has_pending_changes())
+          first_event = Clock::now();
+        last_event = Clock::now();
+        removed_dirs.insert(path);
+      }
+    } else if ((event.mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)) and
+               Utils::is_supported_file_type(path)) {
+      queue(path, mdir_id);
+    }
+  }
+
+  void apply_changes() {
+    std::map<AlbumId, TagLib::ByteVector> album_art{};
+    try {
+      SQLite::Transaction transaction{db};
+      Utils::InternTable interned{db, false};
+      for (const auto &dir : removed_dirs) {
+        std::error_code ec;
+        // The directory may have been moved back, its files are in `changed_files`
+        if (fs::exists(dir, ec))
+          continue;
+        for (const auto id : get_ids_of_tracks_under(db, dir))
+          remove_track(db, id);
+        spdlog::info("REMOVED: {}", dir);
+      }
+      for (const auto &[path, mdir_id] : changed_files) {
+        const size_t interned_mark = interned.mark();
+        try {
+          SQLite::Savepoint savepoint{db, "midx_watch"};
+          apply_change(path, mdir_id, interned, album_art);
+          savepoint.release();
+        } catch (SQLite::Exception &e) {
+          spdlog::error("Failed to update {}: {}", path, e.what());
+          interned.rollback(interned_mark);
+        }
+      }
+      transaction.commit();
+    } catch (SQLite::Exception &e) {
+      spdlog::error("Failed to apply {} changes: {}", changed_files.size(), e.what());
+      return;
+    }
+    Utils::store_album_art(db, album_art);
+    if (parse_options.art_mode == ArtMode::Lazy)
+      Utils::remove_unused_art(db);
+  }
+
+  /**
+   * Insert or update a file that exists, remove it otherwise.
+   */
+  void apply_change(
+      const string &path, const MDirId mdir_id, Utils::InternTable &interned,
+      std::map<AlbumId, TagLib::ByteVector> &album_art
+  ) {
+    std::error_code ec;
+    if (not fs::is_regular_file(path, ec)) {
+      const auto id = Utils::find_track_id(db, path);
+      if (id.has_value()) {
+        remove_track(db, *id);
+        spdlog::info("REMOVED: {}", path);
+      }
+      return;
+    }
+    const auto track = Utils::parse_track(path, parse_options);
+    if (not track.has_value())
+      return;
+    const auto stored = Utils::store_track(db, *track, mdir_id, interned);
+    if (not stored.has_value())
+      return;
+    if (stored->album_id.has_value() and track->metadata and track->metadata->album_art)
+      album_art.try_emplace(*stored->album_id, *track->metadata->album_art);
+    spdlog::info("{}: {}", stored->inserted ? "INSERTED" : "UPDATED", path);
+  }
+
+ public:
+  SQLite::Database db;
+  const Utils::ParseOptions parse_options;
+  const int inotify_fd;
+  const int stop_fd;
+
+ private:
+  std::unordered_map<int, WatchedDir> watches{};
+  /**
+   * Files that were written, moved or deleted, with the music directory they belong to.
+   */
+  std::map<string, MDirId> changed_files{};
+  std::set<string> removed_dirs{};
+  bool needs_rescan = false;
+  Clock::time_point first_event{};
+  Clock::time_point last_event{};
+};
+
+Watcher::Watcher(const SQLite::Database &db, const WatcherOptions &options)
+    : m_db_path{db.getFilename()}, m_options{options} {}
+
+Watcher::~Watcher() { stop(); }
+
+bool Watcher::start() {
+  if (m_running) {
+    spdlog::error("Watcher is already running");
+    return false;
+  }
+  if (m_db_path.empty()) {
+    spdlog::error("Can't watch an in-memory database");
+    return false;
+  }
+  // The thread may have stopped on its own after an error
+  stop();
+  try {
+    m_state = std::make_unique<State>(
+        m_db_path, Utils::ParseOptions{m_options.art_mode, m_options.read_style}
+    );
+    m_state->db.exec("PRAGMA foreign_keys = ON;");
+    m_state->db.setBusyTimeout(5000);
+  } catch (SQLite::Exception &e) {
+    spdlog::error("Failed to open {}: {}", m_db_path, e.what());
+    m_state.reset();
+    return false;
+  }
+  if (m_state->inotify_fd < 0 or m_state->stop_fd < 0) {
+    spdlog::error("Failed to initialise inotify: {}", strerror(errno));
+    m_state.reset();
+    return false;
+  }
+  for (const auto &mdir : get_all_music_dirs(m_state->db))
+    m_state->add_watches(mdir.path, mdir.id, false);
+
+  m_running = true;
+  m_thread  = std::jthread{[this](std::stop_token stop_token) { run(stop_token); }};
+  return true;
+}
+
+void Watcher::stop() {
+  if (not m_thread.joinable())
+    return;
+  m_thread.request_stop();
+  m_thread.join();
+  m_state.reset();
+  m_running = false;
+}
+
+void Watcher::run(std::stop_token stop_token) {
+  State &state = *m_state;
+  // Wake up poll() when a stop is requested
+  const std::stop_callback on_stop{stop_token, [&] {
+                                     const uint64_t one = 1;
+                                     [[maybe_unused]] auto _ = write(state.stop_fd, &one, 8);
+                                   }};
+
+  std::array<pollfd, 2> fds{
+      pollfd{state.inotify_fd, POLLIN, 0},
+      pollfd{state.stop_fd, POLLIN, 0},
+  };
+  while (not stop_token.stop_requested()) {
+    int timeout = -1;
+    if (state.has_pending_changes()) {
+      const auto left = std::chrono::ceil<std::chrono::milliseconds>(
+          state.deadline(m_options) - Clock::now()
+      );
+      timeout = int(std::max<int64_t>(left.count(), 0));
+    }
+    if (poll(fds.data(), fds.size(), timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      spdlog::error("Watcher stopped, poll() failed: {}", strerror(errno));
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      try {
+        state.read_events();
+      } catch (const std::exception &e) {
+        spdlog::error("Failed to read inotify events: {}", e.what());
+      }
+    }
+    if (state.has_pending_changes() and Clock::now() >= state.deadline(m_options))
+      state.flush();
+  }
+  state.flush();
+  m_running = false;
+}
+
+}  // namespace Midx
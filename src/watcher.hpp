@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+#include "./utils.hpp"
+
+namespace Midx {
+
+/**
+ * Options controlling how `Midx::Watcher` groups file system events.
+ */
+struct WatcherOptions {
+  /**
+   * Changes are applied once no event was received for this long, so that a burst of events
+   * (e.g. copying an album) ends up in a single transaction.
+   */
+  std::chrono::milliseconds debounce{500};
+  /**
+   * Upper bound on how long a change waits while events keep coming.
+   */
+  std::chrono::milliseconds max_delay{5000};
+  ArtMode art_mode     = ArtMode::Eager;
+  ReadStyle read_style = ReadStyle::Average;
+};
+
+/**
+ * Keeps the database in sync with the music directories (`t_music_dirs`) using inotify.
+ *
+ * The watcher runs in its own thread with its own connection to the database file, the
+ * connection it was constructed with is only used to get the file's path, so in-memory
+ * databases can't be watched. Using WAL mode (`PRAGMA journal_mode = WAL`) avoids blocking
+ * readers while changes are written.
+ *
+ * Music directories added after `start()` are not watched until the watcher is restarted.
+ */
+class Watcher {
+ public:
+  explicit Watcher(const SQLite::Database &db, const WatcherOptions &options = {});
+  ~Watcher();
+
+  Watcher(const Watcher &)            = delete;
+  Watcher &operator=(const Watcher &) = delete;
+
+  /**
+   * Put watches on every music directory and start applying changes.
+   * Returns false if the watcher couldn't be started or is already running.
+   */
+  bool start();
+
+  /**
+   * Apply the pending changes then stop watching, does nothing if the watcher isn't running.
+   */
+  void stop();
+
+  /**
+   * False once stopped, including when the thread stopped on its own after an error.
+   */
+  bool is_running() const { return m_running; }
+
+ private:
+  class State;
+
+  void run(std::stop_token stop_token);
+
+ private:
+  const std::string m_db_path;
+  const WatcherOptions m_options;
+  std::unique_ptr<State> m_state;
+  std::atomic<bool> m_running = false;
+  std::jthread m_thread;
+};
+
+}  // namespace Midx
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace Midx::Utils {
+
+/**
+ * XXH64 (https://github.com/Cyan4973/xxHash), used to identify album art by its content.
+ * Produces the same values as the reference implementation, on little-endian machines.
+ */
+inline uint64_t xxh64(const void *data, const size_t len, const uint64_t seed = 0) {
+  constexpr uint64_t p1 = 0x9E3779B185EBCA87ULL;
+  constexpr uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+  constexpr uint64_t p3 = 0x165667B19E3779F9ULL;
+  constexpr uint64_t p4 = 0x85EBCA77C2B2AE63ULL;
+  constexpr uint64_t p5 = 0x27D4EB2F165667C5ULL;
+
+  const auto read64 = [](const unsigned char *p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  };
+  const auto read32 = [](const unsigned char *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  };
+  const auto round = [](uint64_t acc, const uint64_t input) {
+    acc += input * p2;
+    acc = std::rotl(acc, 31);
+    return acc * p1;
+  };
+  const auto merge_round = [&](uint64_t acc, const uint64_t val) {
+    acc ^= round(0, val);
+    return acc * p1 + p4;
+  };
+
+  const auto *p         = static_cast<const unsigned char *>(data);
+  const auto *const end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + p1 + p2;
+    uint64_t v2 = seed + p2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - p1;
+    for (const auto *const limit = end - 32; p <= limit; p += 32) {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+    }
+    h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+    h = merge_round(h, v1);
+    h = merge_round(h, v2);
+    h = merge_round(h, v3);
+    h = merge_round(h, v4);
+  } else {
+    h = seed + p5;
+  }
+  h += uint64_t(len);
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= round(0, read64(p));
+    h = std::rotl(h, 27) * p1 + p4;
+  }
+  if (p + 4 <= end) {
+    h ^= uint64_t(read32(p)) * p1;
+    h = std::rotl(h, 23) * p2 + p3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= (*p) * p5;
+    h = std::rotl(h, 11) * p1;
+  }
+
+  h ^= h >> 33;
+  h *= p2;
+  h ^= h >> 29;
+  h *= p3;
+  h ^= h >> 32;
+  return h;
+}
+
+}  // namespace Midx::Utils